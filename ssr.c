@@ -9,7 +9,6 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
-#include <linux/genhd.h>
 #include <linux/fs.h>
 #include <linux/blkdev.h>
 #include <linux/blk-mq.h>
@@ -18,414 +17,7590 @@
 #include <linux/vmalloc.h>
 #include <linux/crc32.h>
 #include <linux/workqueue.h>
+#include <linux/bitmap.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/moduleparam.h>
+#include <linux/list.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/lz4.h>
+#include <linux/shrinker.h>
+#include <linux/atomic.h>
+#include <linux/sysfs.h>
+#include <linux/device-mapper.h>
+#include <linux/rwsem.h>
+#include <linux/log2.h>
+#include <linux/llist.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/debugfs.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/xarray.h>
+#include <linux/highmem.h>
+#include <linux/delay.h>
+#include <linux/seq_file.h>
+#include <linux/random.h>
+#include <linux/mempool.h>
+#include <linux/blk-integrity.h>
+#include <linux/percpu.h>
+#include <linux/wait_bit.h>
 
 #include "ssr.h"
+#include "ssr_core.h"
 
 #define LOGICAL_DEV_NAME "ssr"
+#define DM_MSG_PREFIX LOGICAL_DEV_NAME
+
+/* the initializer persists its cursor every 4 MiB */
+#define SSR_INIT_SB_INTERVAL	(4 * 1024 * 1024 / (KERNEL_SECTOR_SIZE))
+
+/* zoned members: map entries of sectors that have no data on the member */
+#define SSR_ZN_UNMAPPED		U64_MAX
+#define SSR_ZN_ZERO		(1ULL << 63)	/* tombstone, at the sector of its header */
+
+/* checkpoint slots are read and written in pieces of 512 KiB */
+#define SSR_ZCKPT_IO_SECTORS	1024
+
+/* free zones only the garbage collector may open, and its start threshold */
+#define SSR_ZN_GC_RESERVE	1
+#define SSR_ZN_GC_LOW		2
+
+/* room for the data, its record headers and the zones the collector needs */
+#define SSR_ZN_MIN_SECTORS(zone_sectors) \
+	((LOGICAL_DISK_SECTORS) + (LOGICAL_DISK_SECTORS) / (SSR_ZREC_SECTORS) + \
+	 ((SSR_ZN_GC_LOW) + 2) * (zone_sectors))
+
+static unsigned int cbt_granularity = 64;
+module_param(cbt_granularity, uint, 0444);
+MODULE_PARM_DESC(cbt_granularity, "Changed-block tracking granularity in KiB (power of two, default 64)");
+
+static unsigned int heat_region_kb = 1024;
+module_param(heat_region_kb, uint, 0444);
+MODULE_PARM_DESC(heat_region_kb, "Access heatmap region size in KiB (power of two, at least 64), 0 to disable (default 1024)");
+
+static unsigned int heat_sample = 8;
+module_param(heat_sample, uint, 0644);
+MODULE_PARM_DESC(heat_sample, "Count one request in heat_sample per CPU in the access heatmap (default 8)");
+
+static unsigned int heat_halflife_s = 60;
+module_param(heat_halflife_s, uint, 0644);
+MODULE_PARM_DESC(heat_halflife_s, "Seconds after which the access heatmap counts are halved (default 60)");
+
+static bool lazy_init;
+module_param(lazy_init, bool, 0444);
+MODULE_PARM_DESC(lazy_init, "Create a new array: write only the superblock and initialize it in the background");
+
+static bool force;
+module_param(force, bool, 0444);
+MODULE_PARM_DESC(force, "Let lazy_init, or \"create\" on the dm target, overwrite the array the members hold");
+
+static unsigned int init_rate = 10240;
+module_param(init_rate, uint, 0644);
+MODULE_PARM_DESC(init_rate, "Background initialization rate in KiB/s (default 10240)");
+
+static unsigned int qd_target_us;
+module_param(qd_target_us, uint, 0644);
+MODULE_PARM_DESC(qd_target_us, "Member I/O latency the in-flight cap of each member is adapted to, in microseconds, 0 for no cap (default 0)");
+
+static unsigned int qd_max = 64;
+module_param(qd_max, uint, 0644);
+MODULE_PARM_DESC(qd_max, "Upper bound of the in-flight cap of each member (default 64)");
+
+static unsigned int crc_cache_kb = 1024;
+module_param(crc_cache_kb, uint, 0644);
+MODULE_PARM_DESC(crc_cache_kb, "Upper bound of the CRC cache in KiB, reclaimed under memory pressure (default 1024)");
+
+static unsigned int log_segment_kb;
+module_param(log_segment_kb, uint, 0444);
+MODULE_PARM_DESC(log_segment_kb, "Log-structured layout on regular members, in segments of this many KiB (power of two, at least 256), 0 for the in-place layout (default 0)");
+
+static unsigned int log_checkpoint_s = 30;
+module_param(log_checkpoint_s, uint, 0644);
+MODULE_PARM_DESC(log_checkpoint_s, "Seconds between checkpoints of the map of the log-structured layout (default 30)");
+
+static bool compress;
+module_param(compress, bool, 0444);
+MODULE_PARM_DESC(compress, "Store each chunk LZ4-compressed (on-disk layout differs from the plain one)");
+
+static char *poll_cpus;
+module_param(poll_cpus, charp, 0444);
+MODULE_PARM_DESC(poll_cpus, "CPUs (cpulist) running busy-polling submission threads, unset to use the workqueue (default)");
+
+static unsigned int poll_idle_us = 100;
+module_param(poll_idle_us, uint, 0644);
+MODULE_PARM_DESC(poll_idle_us, "Idle time in us after which a polling thread sleeps until the next request (default 100)");
+
+static unsigned int trace_entries;
+module_param(trace_entries, uint, 0444);
+MODULE_PARM_DESC(trace_entries, "Size of the I/O trace ring in debugfs, in records (rounded up to a power of two), 0 to disable (default)");
+
+static char *replica;
+module_param(replica, charp, 0444);
+MODULE_PARM_DESC(replica, "Block device kept as an asynchronous replica of /dev/ssr, fed from a replication log (default none)");
+
+static unsigned int replica_lag_kb = 65536;
+module_param(replica_lag_kb, uint, 0644);
+MODULE_PARM_DESC(replica_lag_kb, "Unshipped data in KiB at which writers wait for the replica to catch up (default 65536)");
+
+static unsigned int replica_batch_kb = 1024;
+module_param(replica_batch_kb, uint, 0644);
+MODULE_PARM_DESC(replica_batch_kb, "Data in KiB shipped to the replica between two flushes of it (default 1024)");
+
+static char *fast_disks;
+module_param(fast_disks, charp, 0444);
+MODULE_PARM_DESC(fast_disks, "Two block devices (\"/dev/a,/dev/b\") mirrored as a fast tier holding the hottest heatmap regions of /dev/ssr (default none)");
+
+static unsigned int tier_rate = 10240;
+module_param(tier_rate, uint, 0644);
+MODULE_PARM_DESC(tier_rate, "Migration rate between the tiers in KiB/s (default 10240)");
+
+static unsigned int atomic_write_kb = 16;
+module_param(atomic_write_kb, uint, 0444);
+MODULE_PARM_DESC(atomic_write_kb, "Largest atomic (REQ_ATOMIC) write in KiB, a power of two up to 64, 0 to disable (default 16)");
+
+static bool integrity;
+module_param(integrity, bool, 0444);
+MODULE_PARM_DESC(integrity, "Take the sector CRCs from the integrity payload of writes and return them with reads (plain layout only)");
+
+static char *null_members;
+module_param(null_members, charp, 0444);
+MODULE_PARM_DESC(null_members, "Replace the member disks by built-in ones: \"ram\" keeps the data in memory, \"discard\" drops it (default none)");
+
+static unsigned int null_latency_us;
+module_param(null_latency_us, uint, 0644);
+MODULE_PARM_DESC(null_latency_us, "Latency added to each I/O of a built-in member, in us (default 0)");
+
+static char *meta_dev;
+module_param(meta_dev, charp, 0444);
+MODULE_PARM_DESC(meta_dev, "Block device holding the CRCs, maps, superblock and replication log of both members, so the members only see data I/O (default none)");
+
+/* state changes reported to userspace, see ssr_event() */
+enum ssr_event_type {
+	SSR_EVENT_MEMBER_FAULTY,
+	SSR_EVENT_DEGRADED,
+	SSR_EVENT_UNRECOVERABLE,
+	SSR_EVENT_REPAIRED,
+	SSR_EVENT_INIT_DONE,
+	SSR_EVENT_REPLICA_SYNC_STARTED,
+	SSR_EVENT_REPLICA_IN_SYNC,
+};
+
+static const char * const ssr_event_names[] = {
+	[SSR_EVENT_MEMBER_FAULTY]	= "MEMBER_FAULTY",
+	[SSR_EVENT_DEGRADED]		= "DEGRADED",
+	[SSR_EVENT_UNRECOVERABLE]	= "UNRECOVERABLE",
+	[SSR_EVENT_REPAIRED]		= "REPAIRED",
+	[SSR_EVENT_INIT_DONE]		= "INIT_DONE",
+	[SSR_EVENT_REPLICA_SYNC_STARTED] = "REPLICA_SYNC_STARTED",
+	[SSR_EVENT_REPLICA_IN_SYNC]	= "REPLICA_IN_SYNC",
+};
+
+/* member argument of events about the array or the replica */
+#define SSR_EVENT_NO_MEMBER	(-1)
+#define SSR_EVENT_REPLICA	(SSR_NUM_MEMBERS)
+
+/* requests of /dev/ssr that can always be queued, even under memory pressure */
+#define SSR_WORK_POOL_MIN	64
+
+/* a region replaces the coldest one on the fast tier once this many times hotter */
+#define SSR_TIER_HYSTERESIS	2
+
+/* runs of each microbenchmark in debugfs ssr/bench */
+#define SSR_BENCH_LOOPS		10000
+
+/* events queued at most, further ones are counted as dropped */
+#define SSR_EVENTS_MAX		64
+
+/* bit of logical_block_dev.state after the per-member faulty bits */
+#define SSR_STATE_DEGRADED	(SSR_NUM_MEMBERS)
+
+struct ssr_event {
+	struct list_head list;
+	enum ssr_event_type type;
+	int member;
+	sector_t sector;
+	unsigned int nr;
+};
+
+/* answer of a read policy: read and verify every copy */
+#define SSR_READ_ALL		(-1)
+
+/* member state as seen by a read policy */
+struct ssr_member_stats {
+	u64 lat_ns;		/* moving average of the I/O latency */
+	u32 inflight;
+	u32 faulty;
+};
+
+/* argument of the struct ssr_policy_ops callbacks */
+struct ssr_policy_ctx {
+	u64 sector;
+	u32 nr;
+	s32 member;		/* member to repair, -1 for select_read */
+	struct ssr_member_stats stats[SSR_NUM_MEMBERS];
+};
+
+/**
+ * struct ssr_policy_ops - Read policy, implemented by a BPF struct_ops map
+ * @select_read: Returns the member that serves a read on its own, falling
+ *	back to all members if its copy is bad, or SSR_READ_ALL
+ * @repair: Returns non-zero to repair the bad copy of ctx->member now, zero
+ *	to leave it to a later read
+ */
+struct ssr_policy_ops {
+	int (*select_read)(const struct ssr_policy_ctx *ctx);
+	int (*repair)(const struct ssr_policy_ctx *ctx);
+};
+
+struct ssr_cbt {
+	spinlock_t lock;
+	unsigned long *bitmap[2];
+	unsigned int active;
+	unsigned int shift;
+	unsigned long nr_bits;
+	u64 epoch;
+	u64 generation;
+};
+
+struct ssr_heat_cnt {
+	u32 reads;
+	u32 writes;
+};
+
+/* counts of each CPU since the last decay, and its sampling tick */
+struct ssr_heat_cpu {
+	unsigned int tick;
+	struct ssr_heat_cnt cnt[];
+};
+
+struct ssr_heat {
+	struct ssr_heat_cpu __percpu *cpu;
+	struct ssr_heat_rec *decayed;
+	spinlock_t lock;
+	unsigned int shift;
+	unsigned int nr_regions;
+	struct delayed_work work;
+	struct dentry *dentry;
+};
+
+struct ssr_crc_entry {
+	struct list_head lru;
+	unsigned int member;
+	unsigned int index;
+	__le32 crcs[SSR_CRCS_PER_SECTOR];
+};
+
+struct ssr_range {
+	struct list_head list;
+	sector_t start;
+	sector_t end;
+};
+
+struct ssr_zone {
+	sector_t start;
+	sector_t capacity;
+	sector_t alloc;
+	unsigned int valid;
+	unsigned int inflight;
+	bool usable;
+	bool full;
+};
+
+struct ssr_zmember {
+	struct ssr_zone *zones;
+	unsigned int nr_zones;
+	unsigned int zone_shift;
+	unsigned int open;
+	unsigned int nr_free;
+	sector_t *map;
+	u32 *crcs;
+	u64 *seqs;
+	bool emulated;		/* regular member, segments stand in for zones */
+	struct mutex append_mutex;
+	void *ckpt_buf;
+	sector_t ckpt_start;
+	sector_t ckpt_sectors;
+	unsigned int ckpt_slot;
+	u64 ckpt_seq;
+};
+
+/* built-in member, see null_members */
+struct ssr_nullmem {
+	struct xarray pages;
+	bool discard;
+	sector_t bad_start;	/* writes to [bad_start, bad_end) fail, for the tests */
+	sector_t bad_end;
+};
+
+struct ssr_tier;
+
+struct ssr_member {
+	const char *name;
+	struct block_device *bdev;
+	struct file *bdev_file;
+	struct dm_dev *dm_dev;
+	struct block_device *meta_bdev;
+	sector_t meta_offset;
+	atomic_t inflight;
+	u64 lat_ns;
+	unsigned int qd_cap;	/* in-flight cap, 0 until adapted, see qd_target_us */
+	unsigned int qd_acks;
+	u64 qd_cut_ns;
+	struct ssr_nullmem *null;
+	struct ssr_member *fast;
+	struct ssr_tier *tier;
+};
+
+/* fast mirror pair holding the hottest extents, see fast_disks */
+struct ssr_tier {
+	struct ssr_member fast[SSR_NUM_MEMBERS];
+	char *names;
+	struct ssr_tier_header *table;	/* header sector and map, as on disk */
+	__le32 *map;
+	unsigned long *slots;
+	unsigned long *pinned;
+	unsigned int shift;
+	unsigned int nr_extents;
+	unsigned int nr_slots;
+	unsigned int nr_fast;
+	sector_t table_sectors;
+	sector_t data_start;
+	u64 seq;
+	u64 migrated;
+	struct delayed_work work;
+};
 
 struct logical_block_dev {
 	struct blk_mq_tag_set tag_set;
-	struct request_queue *queue;
 	struct gendisk *gd;
 	size_t size;
+	struct ssr_member members[SSR_NUM_MEMBERS];
+	struct file *meta_file;
+	struct ssr_cbt cbt;
+	struct ssr_heat heat;
+	struct ssr_tier tier;
+	unsigned long *unwritten;
+	spinlock_t range_lock;
+	struct list_head ranges;
+	wait_queue_head_t range_wait;
+	struct ssr_cmap_entry *cmap;
+	struct mutex cmap_mutex;
+	struct mutex sb_mutex;
+	u64 sb_flags;
+	sector_t init_cursor;
+	sector_t init_persisted;	/* init_cursor in the superblock */
+	DECLARE_BITMAP(init_ahead, SSR_NUM_CHUNKS);	/* see ssr_init_ahead() */
+	struct delayed_work init_work;
+	struct ssr_crc_entry **crc_cache[SSR_NUM_MEMBERS];
+	struct list_head crc_lru;
+	spinlock_t crc_cache_lock;
+	unsigned long crc_cache_nr;
+	atomic64_t crc_cache_hits;
+	atomic64_t crc_cache_misses;
+	struct shrinker *crc_shrinker;
+	struct ssr_zmember *zn;
+	spinlock_t zn_lock;
+	wait_queue_head_t zn_wait;
+	struct rw_semaphore zn_reset_sem;
+	atomic64_t zn_seq;
+	struct work_struct zn_gc_work;
+	bool zn_emulated;
+	struct mutex zn_ckpt_mutex;
+	u64 zn_ckpt_at;
+	struct delayed_work zn_ckpt_work;
+	struct ssr_member replica;
+	struct ssr_rlog_entry *rlog;
+	struct mutex rlog_mutex;
+	wait_queue_head_t rlog_wait;
+	u64 rlog_head;
+	unsigned int rlog_reserved;	/* entries writers are about to append */
+	u64 rlog_shipped;
+	sector_t rlog_cursor;
+	atomic64_t rlog_lag;
+	struct delayed_work rlog_work;
+	unsigned long state;
+	struct gendisk *event_disk;
+	spinlock_t event_lock;
+	struct list_head events;
+	unsigned int nr_events;
+	unsigned long events_dropped;
+	struct work_struct event_work;
+	bool atomic;
+	unsigned long jrnl_busy;
+	wait_queue_head_t jrnl_wait;
+	bool integrity;
+};
+
+struct ssr_work {
+	struct work_struct work;
+	struct llist_node node;
+	struct logical_block_dev *dev;
+	struct bio *bio_from_up;
+};
+
+struct ssr_trace {
+	struct ssr_trace_rec *ring;
+	unsigned long mask;
+	atomic64_t head;
+	u64 tail;
+	u64 dropped;
+	struct mutex mutex;
+};
+
+struct ssr_poller {
+	struct task_struct *task;
+	struct llist_head ring;
+	wait_queue_head_t wait;
+};
+
+static const char * const ssr_member_names[SSR_NUM_MEMBERS] = {
+	PHYSICAL_DISK1_NAME,
+	PHYSICAL_DISK2_NAME,
+};
+
+static const char * const ssr_null_names[SSR_NUM_MEMBERS] = {
+	"null0",
+	"null1",
 };
 
-struct ssr_work {
-	struct work_struct work;
-	char *buffer_from_up;
-	struct bio *bio_from_up;
-	struct bio *data_bio_from_down;
-	struct bio *crc32_bio_from_down;
-};
+static struct workqueue_struct *ssr_wq;
+static mempool_t *ssr_work_pool;
+
+static struct ssr_poller *ssr_pollers;
+static unsigned int ssr_nr_pollers;
+
+static struct ssr_trace ssr_trace;
+static struct dentry *ssr_debugfs;
+
+static struct logical_block_dev logical_raid_block_device;
+
+/* CRC of an all-zero sector, the on-disk CRC of unwritten sectors */
+static u32 ssr_zero_crc;
+
+/**
+ * ssr_block_open - block_device open operation
+ * @gd: gendisk structure containing the disk information
+ * @mode: mode in which the device is to be opened
+ *
+ * This function is called when the block device is opened.
+ * Currently, it performs no specific action and always returns 0.
+ */
+static int ssr_block_open(struct gendisk *gd, blk_mode_t mode)
+{
+	return 0;
+}
+
+/**
+ * ssr_block_release - block_device release operation
+ * @gd: gendisk structure containing the disk information
+ *
+ * This function is called when the block device is released.
+ * Currently, it performs no specific action.
+ */
+static void ssr_block_release(struct gendisk *gd)
+{
+}
+
+/**
+ * ssr_cbt_init - Allocates the changed-block tracking bitmaps
+ * @cbt: Changed-block tracking state of the logical device
+ *
+ * Two bitmaps are kept: the active one collects the writes of the current
+ * epoch, the other one holds the writes of the last closed epoch. Epochs
+ * are numbered from 1, so epoch 0 stands for "none closed yet". The bitmaps
+ * do not survive an unload, so each load starts a new generation.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_cbt_init(struct ssr_cbt *cbt)
+{
+	unsigned long sectors;
+
+	if (!cbt_granularity || !is_power_of_2(cbt_granularity)) {
+		pr_err("cbt_granularity: %u is not a power of two\n", cbt_granularity);
+		return -EINVAL;
+	}
+
+	sectors = cbt_granularity * 1024UL / KERNEL_SECTOR_SIZE;
+
+	spin_lock_init(&cbt->lock);
+	cbt->shift = ilog2(sectors);
+	cbt->nr_bits = DIV_ROUND_UP(LOGICAL_DISK_SECTORS, sectors);
+	cbt->active = 0;
+	cbt->epoch = 1;
+	cbt->generation = get_random_u64();
+
+	cbt->bitmap[0] = bitmap_zalloc(cbt->nr_bits, GFP_KERNEL);
+	cbt->bitmap[1] = bitmap_zalloc(cbt->nr_bits, GFP_KERNEL);
+
+	if (!cbt->bitmap[0] || !cbt->bitmap[1]) {
+		bitmap_free(cbt->bitmap[0]);
+		bitmap_free(cbt->bitmap[1]);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/**
+ * ssr_cbt_free - Releases the changed-block tracking bitmaps
+ * @cbt: Changed-block tracking state of the logical device
+ */
+static void ssr_cbt_free(struct ssr_cbt *cbt)
+{
+	bitmap_free(cbt->bitmap[0]);
+	bitmap_free(cbt->bitmap[1]);
+}
+
+/**
+ * ssr_cbt_mark - Records a write in the current backup epoch
+ * @cbt: Changed-block tracking state of the logical device
+ * @sector: First sector written
+ * @nr_sectors: Number of sectors written
+ *
+ * Writes are marked both when they are submitted and when they complete, so
+ * a write that straddles an epoch rotation shows up in both epochs.
+ */
+static void ssr_cbt_mark(struct ssr_cbt *cbt, sector_t sector, unsigned int nr_sectors)
+{
+	unsigned long first, last;
+
+	if (!nr_sectors)
+		return;
+
+	first = sector >> cbt->shift;
+	last = (sector + nr_sectors - 1) >> cbt->shift;
+
+	spin_lock(&cbt->lock);
+	bitmap_set(cbt->bitmap[cbt->active], first, last - first + 1);
+	spin_unlock(&cbt->lock);
+}
+
+/**
+ * ssr_cbt_rotate - Closes the current epoch and opens a new one
+ * @cbt: Changed-block tracking state of the logical device
+ *
+ * The bitmap of the closed epoch stays available to SSR_IOCTL_CBT_GET
+ * until the next rotation.
+ */
+static void ssr_cbt_rotate(struct ssr_cbt *cbt)
+{
+	spin_lock(&cbt->lock);
+	cbt->active ^= 1;
+	bitmap_zero(cbt->bitmap[cbt->active], cbt->nr_bits);
+	cbt->epoch++;
+	spin_unlock(&cbt->lock);
+}
+
+/**
+ * ssr_cbt_get - Copies the bitmap of the last closed epoch to user space
+ * @cbt: Changed-block tracking state of the logical device
+ * @uinfo: User pointer to a struct ssr_cbt_info
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_cbt_get(struct ssr_cbt *cbt, struct ssr_cbt_info __user *uinfo)
+{
+	struct ssr_cbt_info info;
+	unsigned int nr_words = BITS_TO_U32(cbt->nr_bits);
+	u32 *words = NULL;
+	u32 capacity;
+	int err = 0;
+
+	if (copy_from_user(&info, uinfo, sizeof(info)))
+		return -EFAULT;
+
+	capacity = info.nr_bits;
+
+	if (info.bitmap && capacity >= cbt->nr_bits) {
+		words = kcalloc(nr_words, sizeof(*words), GFP_KERNEL);
+		if (!words)
+			return -ENOMEM;
+	}
+
+	spin_lock(&cbt->lock);
+	info.epoch = cbt->epoch - 1;
+	if (words)
+		bitmap_to_arr32(words, cbt->bitmap[cbt->active ^ 1], cbt->nr_bits);
+	spin_unlock(&cbt->lock);
+
+	info.granularity = (KERNEL_SECTOR_SIZE << cbt->shift);
+	info.nr_bits = cbt->nr_bits;
+	info.generation = cbt->generation;
+
+	if (words && copy_to_user(u64_to_user_ptr(info.bitmap), words,
+				  nr_words * sizeof(*words)))
+		err = -EFAULT;
+	else if (info.bitmap && !words)
+		err = -EOVERFLOW;
+
+	kfree(words);
+
+	if (copy_to_user(uinfo, &info, sizeof(info)))
+		return -EFAULT;
+
+	return err;
+}
+
+/**
+ * ssr_heat_pending - Counts of a region not folded into the decayed ones yet
+ * @heat: Access heatmap of the logical device
+ * @region: Region index
+ * @rec: Output, counts summed over every CPU
+ */
+static void ssr_heat_pending(struct ssr_heat *heat, unsigned int region,
+			     struct ssr_heat_rec *rec)
+{
+	int cpu;
+
+	rec->reads = 0;
+	rec->writes = 0;
+
+	for_each_possible_cpu(cpu) {
+		struct ssr_heat_cnt *cnt = &per_cpu_ptr(heat->cpu, cpu)->cnt[region];
+
+		rec->reads += READ_ONCE(cnt->reads);
+		rec->writes += READ_ONCE(cnt->writes);
+	}
+}
+
+/**
+ * ssr_heat_get - Current heat of a region
+ * @heat: Access heatmap of the logical device, enabled
+ * @region: Region index
+ * @rec: Output, decayed counts plus the counts since the last decay
+ */
+static void ssr_heat_get(struct ssr_heat *heat, unsigned int region, struct ssr_heat_rec *rec)
+{
+	ssr_heat_pending(heat, region, rec);
+
+	spin_lock(&heat->lock);
+	rec->reads += heat->decayed[region].reads;
+	rec->writes += heat->decayed[region].writes;
+	spin_unlock(&heat->lock);
+}
+
+/**
+ * ssr_heat_worker - Halves the decayed counts and folds the per-CPU ones in
+ * @work: work of the access heatmap
+ *
+ * The per-CPU counters are reset with xchg() while their CPUs may still be
+ * adding to them with this_cpu ops, which are not atomic against it. The
+ * odd lost sample does not matter for a sampled estimate.
+ */
+static void ssr_heat_worker(struct work_struct *work)
+{
+	struct ssr_heat *heat = container_of(to_delayed_work(work), struct ssr_heat, work);
+	unsigned int i;
+	int cpu;
+
+	for (i = 0; i < heat->nr_regions; i++) {
+		u64 reads = 0, writes = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct ssr_heat_cnt *cnt = &per_cpu_ptr(heat->cpu, cpu)->cnt[i];
+
+			reads += xchg(&cnt->reads, 0);
+			writes += xchg(&cnt->writes, 0);
+		}
+
+		spin_lock(&heat->lock);
+		heat->decayed[i].reads = heat->decayed[i].reads / 2 + reads;
+		heat->decayed[i].writes = heat->decayed[i].writes / 2 + writes;
+		spin_unlock(&heat->lock);
+	}
+
+	queue_delayed_work(system_wq, &heat->work,
+			   max(READ_ONCE(heat_halflife_s), 1U) * HZ);
+}
+
+/**
+ * ssr_heat_init - Allocates the access heatmap and starts its decay
+ * @heat: Access heatmap of the logical device
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_heat_init(struct ssr_heat *heat)
+{
+	unsigned long sectors;
+
+	memset(heat, 0, sizeof(*heat));
+	spin_lock_init(&heat->lock);
+	INIT_DELAYED_WORK(&heat->work, ssr_heat_worker);
+
+	if (!heat_region_kb)
+		return 0;
+
+	/* a request then touches at most two regions, it is counted in the first */
+	if (!is_power_of_2(heat_region_kb) ||
+	    heat_region_kb * 1024UL < SSR_MAX_SECTORS * KERNEL_SECTOR_SIZE) {
+		pr_err("heat_region_kb: %u is not a power of two of at least 64\n",
+		       heat_region_kb);
+		return -EINVAL;
+	}
+
+	sectors = heat_region_kb * 1024UL / KERNEL_SECTOR_SIZE;
+	heat->shift = ilog2(sectors);
+	heat->nr_regions = DIV_ROUND_UP(LOGICAL_DISK_SECTORS, sectors);
+
+	heat->decayed = kvcalloc(heat->nr_regions, sizeof(*heat->decayed), GFP_KERNEL);
+	heat->cpu = __alloc_percpu(struct_size(heat->cpu, cnt, heat->nr_regions),
+				   __alignof__(struct ssr_heat_cpu));
+	if (!heat->decayed || !heat->cpu) {
+		kvfree(heat->decayed);
+		free_percpu(heat->cpu);
+		heat->decayed = NULL;
+		heat->cpu = NULL;
+		return -ENOMEM;
+	}
+
+	queue_delayed_work(system_wq, &heat->work,
+			   max(READ_ONCE(heat_halflife_s), 1U) * HZ);
+
+	return 0;
+}
+
+/**
+ * ssr_heat_free - Stops the decay and releases the access heatmap
+ * @heat: Access heatmap of the logical device
+ */
+static void ssr_heat_free(struct ssr_heat *heat)
+{
+	debugfs_remove(heat->dentry);
+	heat->dentry = NULL;
+	cancel_delayed_work_sync(&heat->work);
+	free_percpu(heat->cpu);
+	kvfree(heat->decayed);
+	heat->cpu = NULL;
+	heat->decayed = NULL;
+}
+
+/**
+ * ssr_heat_mark - Counts a request in the access heatmap
+ * @heat: Access heatmap of the logical device
+ * @bio: Request, after splitting
+ *
+ * Only one request in heat_sample of each CPU is counted, with a weight of
+ * heat_sample, so the submission path touches a CPU-local counter and,
+ * now and then, one more CPU-local cache line.
+ */
+static void ssr_heat_mark(struct ssr_heat *heat, struct bio *bio)
+{
+	unsigned int sample = max(READ_ONCE(heat_sample), 1U);
+	unsigned int region;
+
+	if (!heat->cpu || !bio_sectors(bio))
+		return;
+
+	if (this_cpu_inc_return(heat->cpu->tick) % sample)
+		return;
+
+	region = bio->bi_iter.bi_sector >> heat->shift;
+	if (op_is_write(bio_op(bio)))
+		this_cpu_add(heat->cpu->cnt[region].writes, sample);
+	else
+		this_cpu_add(heat->cpu->cnt[region].reads, sample);
+}
+
+/**
+ * ssr_heat_open - Takes a snapshot of the access heatmap for a reader
+ * @inode: debugfs inode, i_private is the heatmap
+ * @file: debugfs file, private_data receives the snapshot
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_heat_open(struct inode *inode, struct file *file)
+{
+	struct ssr_heat *heat = inode->i_private;
+	struct ssr_heat_header *hdr;
+	struct ssr_heat_rec *recs;
+	unsigned int i;
+
+	hdr = kvmalloc(sizeof(*hdr) + heat->nr_regions * sizeof(*recs), GFP_KERNEL);
+	if (!hdr)
+		return -ENOMEM;
+
+	recs = (struct ssr_heat_rec *)(hdr + 1);
+	for (i = 0; i < heat->nr_regions; i++)
+		ssr_heat_get(heat, i, &recs[i]);
+
+	hdr->time_ns = ktime_get_ns();
+	hdr->region_size = KERNEL_SECTOR_SIZE << heat->shift;
+	hdr->nr_regions = heat->nr_regions;
+	hdr->halflife_s = max(READ_ONCE(heat_halflife_s), 1U);
+	hdr->sample = max(READ_ONCE(heat_sample), 1U);
+
+	file->private_data = hdr;
+
+	return nonseekable_open(inode, file);
+}
+
+/**
+ * ssr_heat_read - Reads the snapshot taken at open
+ * @file: debugfs file
+ * @ubuf: User buffer
+ * @count: Size of @ubuf
+ * @ppos: Position in the snapshot
+ *
+ * Returns the number of bytes read or a negative error code.
+ */
+static ssize_t ssr_heat_read(struct file *file, char __user *ubuf, size_t count,
+			     loff_t *ppos)
+{
+	struct ssr_heat_header *hdr = file->private_data;
+
+	return simple_read_from_buffer(ubuf, count, ppos, hdr, sizeof(*hdr) +
+				       hdr->nr_regions * sizeof(struct ssr_heat_rec));
+}
+
+/**
+ * ssr_heat_release - Frees the snapshot of a reader
+ * @inode: debugfs inode
+ * @file: debugfs file
+ */
+static int ssr_heat_release(struct inode *inode, struct file *file)
+{
+	kvfree(file->private_data);
+
+	return 0;
+}
+
+static const struct file_operations ssr_heat_fops = {
+	.owner = THIS_MODULE,
+	.open = ssr_heat_open,
+	.read = ssr_heat_read,
+	.release = ssr_heat_release,
+};
+
+/**
+ * ssr_bio_add_buf - Adds a kernel buffer to a bio
+ * @bio: Bio with room for the pages of @buf
+ * @buf: Kernel buffer (kmalloc'ed or vmalloc'ed)
+ * @len: Length of the buffer in bytes
+ *
+ * kmalloc'ed buffers larger than a page are backed by one folio and go
+ * out as a single segment, vmalloc'ed ones are added page by page.
+ */
+static void ssr_bio_add_buf(struct bio *bio, void *buf, size_t len)
+{
+	while (len) {
+		struct folio *folio;
+		size_t offset, bytes;
+
+		if (is_vmalloc_addr(buf)) {
+			folio = page_folio(vmalloc_to_page(buf));
+			offset = offset_in_page(buf);
+			bytes = min_t(size_t, len, PAGE_SIZE - offset);
+		} else {
+			folio = virt_to_folio(buf);
+			offset = offset_in_folio(folio, buf);
+			bytes = min_t(size_t, len, folio_size(folio) - offset);
+		}
+
+		bio_add_folio_nofail(bio, folio, bytes, offset);
+		buf += bytes;
+		len -= bytes;
+	}
+}
+
+/**
+ * ssr_poll_current - Tells whether the current task is a polling thread
+ */
+static bool ssr_poll_current(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ssr_nr_pollers; i++)
+		if (ssr_pollers[i].task == current)
+			return true;
+
+	return false;
+}
+
+/**
+ * ssr_member_io_end - Completion of a polled member bio
+ * @bio: Member bio, bi_private points at its done flag
+ */
+static void ssr_member_io_end(struct bio *bio)
+{
+	smp_store_release((bool *)bio->bi_private, true);
+}
+
+/**
+ * ssr_null_delay - Simulates the latency of a null member
+ */
+static void ssr_null_delay(void)
+{
+	unsigned int us = READ_ONCE(null_latency_us);
+
+	if (us)
+		fsleep(us);
+}
+
+/**
+ * ssr_null_page - Returns the page backing an offset of a RAM member
+ * @nm: Null member
+ * @idx: Page index on the member
+ *
+ * Returns the page, allocated zeroed on first use, or NULL on failure.
+ */
+static struct page *ssr_null_page(struct ssr_nullmem *nm, pgoff_t idx)
+{
+	struct page *page, *old;
+
+	page = xa_load(&nm->pages, idx);
+	if (page)
+		return page;
+
+	page = alloc_page(GFP_NOIO | __GFP_ZERO);
+	if (!page)
+		return NULL;
+
+	old = xa_cmpxchg(&nm->pages, idx, NULL, page, GFP_NOIO);
+	if (old) {
+		__free_page(page);
+		return xa_is_err(old) ? NULL : old;
+	}
+
+	return page;
+}
+
+/**
+ * ssr_null_io - Completes a member transfer from memory
+ * @nm: Null member
+ * @op: Operation, only reads and writes are supported
+ * @sector: First sector on the member
+ * @buf: Kernel buffer
+ * @len: Length of the transfer in bytes
+ *
+ * Sectors that were never written, or all sectors of a discarding member,
+ * read as zeroes. Writes touching the bad range fail with -EIO.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_null_io(struct ssr_nullmem *nm, blk_opf_t op, sector_t sector,
+		       void *buf, size_t len)
+{
+	loff_t pos = (loff_t)sector << SECTOR_SHIFT;
+	bool write;
+
+	switch (op & REQ_OP_MASK) {
+	case REQ_OP_READ:
+		write = false;
+		break;
+	case REQ_OP_WRITE:
+		write = true;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	ssr_null_delay();
+
+	if (write && sector < nm->bad_end && sector + (len >> SECTOR_SHIFT) > nm->bad_start)
+		return -EIO;
+
+	if (write && nm->discard)
+		return 0;
+
+	while (len) {
+		size_t off = offset_in_page(pos);
+		size_t bytes = min_t(size_t, len, PAGE_SIZE - off);
+		struct page *page;
+
+		if (write) {
+			page = ssr_null_page(nm, pos >> PAGE_SHIFT);
+			if (!page)
+				return -ENOMEM;
+			memcpy_to_page(page, off, buf, bytes);
+		} else {
+			page = xa_load(&nm->pages, pos >> PAGE_SHIFT);
+			if (page)
+				memcpy_from_page(buf, page, off, bytes);
+			else
+				memset(buf, 0, bytes);
+		}
+
+		buf += bytes;
+		pos += bytes;
+		len -= bytes;
+	}
+
+	return 0;
+}
+
+/**
+ * ssr_null_zeroout - Zeroes a range of a null member
+ * @nm: Null member
+ * @sector: First sector on the member
+ * @nr: Number of sectors
+ */
+static void ssr_null_zeroout(struct ssr_nullmem *nm, sector_t sector, unsigned int nr)
+{
+	loff_t pos = (loff_t)sector << SECTOR_SHIFT;
+	size_t len = (size_t)nr << SECTOR_SHIFT;
+
+	ssr_null_delay();
+
+	while (len) {
+		size_t off = offset_in_page(pos);
+		size_t bytes = min_t(size_t, len, PAGE_SIZE - off);
+		struct page *page = xa_load(&nm->pages, pos >> PAGE_SHIFT);
+
+		if (page)
+			memzero_page(page, off, bytes);
+
+		pos += bytes;
+		len -= bytes;
+	}
+}
+
+/**
+ * ssr_null_init - Sets up a member completing its I/O from memory
+ * @m: Member
+ * @name: Name of the member in messages
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_null_init(struct ssr_member *m, const char *name)
+{
+	m->null = kzalloc(sizeof(*m->null), GFP_KERNEL);
+	if (!m->null)
+		return -ENOMEM;
+
+	xa_init(&m->null->pages);
+	m->null->discard = !strcmp(null_members, "discard");
+	m->name = name;
+
+	return 0;
+}
+
+/**
+ * ssr_null_free - Releases a null member and its pages
+ * @m: Member
+ */
+static void ssr_null_free(struct ssr_member *m)
+{
+	struct page *page;
+	unsigned long idx;
+
+	xa_for_each(&m->null->pages, idx, page)
+		__free_page(page);
+	xa_destroy(&m->null->pages);
+	kfree(m->null);
+	m->null = NULL;
+}
+
+/**
+ * ssr_tier_span - Sectors from a logical sector to the end of its extent
+ * @tier: Tiering state
+ * @sector: Logical sector
+ */
+static sector_t ssr_tier_span(struct ssr_tier *tier, sector_t sector)
+{
+	return (1ULL << tier->shift) - (sector & ((1ULL << tier->shift) - 1));
+}
+
+/**
+ * ssr_tier_map - Location of a data sector of a tiered member on its fast member
+ * @tier: Tiering state
+ * @sector: Logical sector
+ * @fast: Output, sector on the fast member
+ *
+ * The mapping holds up to the end of the extent, see ssr_tier_span(). The
+ * map entry of an extent only changes under the range lock of the extent,
+ * which every caller of member data I/O holds.
+ *
+ * Returns true if the extent is on the fast tier.
+ */
+static bool ssr_tier_map(struct ssr_tier *tier, sector_t sector, sector_t *fast)
+{
+	unsigned int e = sector >> tier->shift;
+	u32 slot = le32_to_cpu(READ_ONCE(tier->map[e]));
+
+	if (!slot)
+		return false;
+
+	*fast = tier->data_start + ((sector_t)(slot - 1) << tier->shift) +
+		(sector & ((1ULL << tier->shift) - 1));
+
+	return true;
+}
+
+/**
+ * ssr_member_account - Updates the latency average of a member
+ * @m: Member
+ * @start: ktime_get_ns() at the start of the I/O
+ *
+ * Moving average over ~8 requests, racing updates only lose samples.
+ */
+static void ssr_member_account(struct ssr_member *m, u64 start)
+{
+	s64 delta = ktime_get_ns() - start - READ_ONCE(m->lat_ns);
+
+	WRITE_ONCE(m->lat_ns, READ_ONCE(m->lat_ns) + delta / 8);
+}
+
+/**
+ * ssr_qd_cap - In-flight cap of a member
+ * @m: Member
+ */
+static unsigned int ssr_qd_cap(struct ssr_member *m)
+{
+	unsigned int max = max_t(unsigned int, READ_ONCE(qd_max), 1);
+	unsigned int cap = READ_ONCE(m->qd_cap);
+
+	return cap && cap < max ? cap : max;
+}
+
+/**
+ * ssr_qd_full - Tells whether a member has reached its in-flight cap
+ * @m: Member
+ */
+static bool ssr_qd_full(struct ssr_member *m)
+{
+	return READ_ONCE(qd_target_us) && !m->null &&
+	       atomic_read(&m->inflight) >= ssr_qd_cap(m);
+}
+
+/**
+ * ssr_qd_try - Takes an in-flight slot of a member if one is left
+ * @m: Member
+ */
+static bool ssr_qd_try(struct ssr_member *m)
+{
+	int n = atomic_read(&m->inflight);
+
+	if (!READ_ONCE(qd_target_us)) {
+		atomic_inc(&m->inflight);
+		return true;
+	}
+
+	do {
+		if (n >= ssr_qd_cap(m))
+			return false;
+	} while (!atomic_try_cmpxchg(&m->inflight, &n, n + 1));
+
+	return true;
+}
+
+/**
+ * ssr_qd_done - Releases an in-flight slot and adapts the cap of a member
+ * @m: Member
+ * @issued: ktime_get_ns() when the I/O was issued to the member
+ *
+ * AIMD, like a congestion window: an I/O slower than qd_target_us halves
+ * the cap, at most once per round trip, i.e. only if the last cut happened
+ * before the I/O was issued. Faster I/Os grow the cap by one per cap
+ * completions, while the cap is actually in use. Racing updates only lose
+ * samples. Waiters are woken even without a target, which may just have
+ * been cleared.
+ */
+static void ssr_qd_done(struct ssr_member *m, u64 issued)
+{
+	u64 target = (u64)READ_ONCE(qd_target_us) * NSEC_PER_USEC;
+	u64 now = ktime_get_ns();
+	unsigned int cap, acks;
+
+	cap = ssr_qd_cap(m);
+
+	if (target && now - issued > target) {
+		if (READ_ONCE(m->qd_cut_ns) < issued) {
+			WRITE_ONCE(m->qd_cap, max(cap / 2, 1U));
+			WRITE_ONCE(m->qd_acks, 0);
+			WRITE_ONCE(m->qd_cut_ns, now);
+		}
+	} else if (target && atomic_read(&m->inflight) >= cap) {
+		acks = READ_ONCE(m->qd_acks) + 1;
+		if (acks >= cap) {
+			WRITE_ONCE(m->qd_cap, cap + 1);
+			acks = 0;
+		}
+		WRITE_ONCE(m->qd_acks, acks);
+	}
+
+	atomic_dec(&m->inflight);
+	wake_up_var(&m->inflight);
+}
+
+/**
+ * ssr_qd_select - Redirects a read away from a member at its in-flight cap
+ * @dev: Logical device
+ * @first: Member selected to serve the read, or SSR_READ_ALL
+ *
+ * With one member at its cap and the other one healthy and below it, the
+ * read is served by the other one alone instead of queueing. Its copy is
+ * still verified, and a bad one falls back to all members as usual.
+ *
+ * Returns the member to read first, or SSR_READ_ALL.
+ */
+static int ssr_qd_select(struct logical_block_dev *dev, int first)
+{
+	bool full[SSR_NUM_MEMBERS];
+	int m, other = -1;
+
+	if (!READ_ONCE(qd_target_us))
+		return first;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		full[m] = ssr_qd_full(&dev->members[m]);
+		if (!full[m] && !test_bit(m, &dev->state))
+			other = m;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (full[m] && (first == SSR_READ_ALL || first == m) && other >= 0)
+			return other;
+
+	return first;
+}
+
+/**
+ * ssr_member_io - Synchronously transfers a kernel buffer to/from a member
+ * @m: Member the I/O is issued to
+ * @op: Operation and flags of the bio
+ * @sector: First sector on the member
+ * @buf: Kernel buffer (kmalloc'ed or vmalloc'ed)
+ * @len: Length of the transfer in bytes, a multiple of KERNEL_SECTOR_SIZE
+ *
+ * Polling threads issue REQ_POLLED bios to members with poll queues and spin
+ * on bio_poll() for the completion instead of sleeping on an interrupt.
+ * Metadata sectors of a member with an external metadata device are
+ * redirected to its area on that device, data sectors of extents on the
+ * fast tier to the fast member, extent by extent; built-in members complete
+ * the rest from memory. With qd_target_us set, I/O to a member at its
+ * in-flight cap waits here for a slot, which keeps the member near the knee
+ * of its latency curve instead of queueing in it.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_member_io(struct ssr_member *m, blk_opf_t op, sector_t sector,
+			 void *buf, size_t len)
+{
+	unsigned int nr_pages = DIV_ROUND_UP(offset_in_page(buf) + len, PAGE_SIZE);
+	struct block_device *bdev = m->bdev;
+	u64 start = ktime_get_ns(), issued;
+	struct bio *bio;
+	sector_t fast;
+	int ret;
+
+	if (m->fast && sector < LOGICAL_DISK_SECTORS) {
+		size_t n = ssr_tier_span(m->tier, sector) * KERNEL_SECTOR_SIZE;
+
+		/* the extents of the range may be on different tiers */
+		if (n < len) {
+			do {
+				ret = ssr_member_io(m, op, sector, buf, n);
+				sector += n / KERNEL_SECTOR_SIZE;
+				buf += n;
+				len -= n;
+				n = min_t(size_t, len, KERNEL_SECTOR_SIZE << m->tier->shift);
+			} while (!ret && len);
+
+			return ret;
+		}
+
+		if (ssr_tier_map(m->tier, sector, &fast))
+			return ssr_member_io(m->fast, op, fast, buf, len);
+	}
+
+	if (m->meta_bdev && sector >= SSR_CRC_FIRST_SECTOR) {
+		bdev = m->meta_bdev;
+		sector = m->meta_offset + sector - SSR_CRC_FIRST_SECTOR;
+	} else if (m->null) {
+		atomic_inc(&m->inflight);
+		ret = ssr_null_io(m->null, op, sector, buf, len);
+		atomic_dec(&m->inflight);
+		ssr_member_account(m, start);
+		return ret;
+	}
+
+	bio = bio_alloc(bdev, nr_pages, op, GFP_NOIO);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_iter.bi_sector = sector;
+	ssr_bio_add_buf(bio, buf, len);
+
+	if (bdev == m->bdev)
+		wait_var_event(&m->inflight, ssr_qd_try(m));
+	else
+		atomic_inc(&m->inflight);
+	issued = ktime_get_ns();
+
+	if (ssr_poll_current() &&
+	    (bdev_get_queue(bdev)->limits.features & BLK_FEAT_POLL)) {
+		bool done = false;
+
+		bio->bi_opf |= REQ_POLLED;
+		bio->bi_private = &done;
+		bio->bi_end_io = ssr_member_io_end;
+		submit_bio(bio);
+
+		while (!smp_load_acquire(&done)) {
+			if (!bio_poll(bio, NULL, 0))
+				cpu_relax();
+			cond_resched();
+		}
+
+		ret = blk_status_to_errno(bio->bi_status);
+	} else {
+		ret = submit_bio_wait(bio);
+	}
+	bio_put(bio);
+
+	if (bdev == m->bdev) {
+		ssr_qd_done(m, issued);
+		ssr_member_account(m, start);
+	} else {
+		atomic_dec(&m->inflight);
+	}
+
+	return ret;
+}
+
+/**
+ * ssr_member_zeroout - Zeroes a range of a member
+ * @m: Member
+ * @sector: First sector on the member
+ * @nr: Number of sectors
+ *
+ * Data sectors of a tiered member are zeroed extent by extent, each on the
+ * tier that holds it.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_member_zeroout(struct ssr_member *m, sector_t sector, unsigned int nr)
+{
+	sector_t fast;
+	unsigned int n;
+	int err;
+
+	if (m->fast && sector < LOGICAL_DISK_SECTORS) {
+		n = min_t(sector_t, nr, ssr_tier_span(m->tier, sector));
+		if (n < nr) {
+			do {
+				err = ssr_member_zeroout(m, sector, n);
+				sector += n;
+				nr -= n;
+				n = min_t(sector_t, nr, 1ULL << m->tier->shift);
+			} while (!err && nr);
+
+			return err;
+		}
+
+		if (ssr_tier_map(m->tier, sector, &fast))
+			return ssr_member_zeroout(m->fast, fast, nr);
+	}
+
+	if (m->null) {
+		ssr_null_zeroout(m->null, sector, nr);
+		return 0;
+	}
+
+	return blkdev_issue_zeroout(m->bdev, sector, nr, GFP_NOIO, 0);
+}
+
+/**
+ * ssr_member_flush - Flushes the volatile write cache of a member
+ * @m: Member
+ *
+ * The fast member of a tiered member holds part of its data and is flushed
+ * along with it.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_member_flush(struct ssr_member *m)
+{
+	int err;
+
+	if (m->fast) {
+		err = ssr_member_flush(m->fast);
+		if (err)
+			return err;
+	}
+
+	if (m->null)
+		return 0;
+
+	return blkdev_issue_flush(m->bdev);
+}
+
+/**
+ * ssr_member_zoned - Tells whether a member is a zoned block device
+ * @m: Member
+ */
+static bool ssr_member_zoned(struct ssr_member *m)
+{
+	return m->bdev && bdev_is_zoned(m->bdev);
+}
+
+/**
+ * ssr_copy_bio - Copies the payload of a bio to/from a linear buffer
+ * @bio_from_up: Bio structure representing the original request
+ * @buffer: Linear buffer of bio_sectors(@bio_from_up) sectors
+ * @to_bio: true to fill the bio from @buffer, false to fill @buffer
+ */
+static void ssr_copy_bio(struct bio *bio_from_up, char *buffer, bool to_bio)
+{
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+
+	bio_for_each_segment(bvec, bio_from_up, iter) {
+		if (to_bio)
+			memcpy_to_bvec(&bvec, buffer);
+		else
+			memcpy_from_bvec(buffer, &bvec);
+
+		buffer += bvec.bv_len;
+	}
+}
+
+#ifdef CONFIG_BLK_DEV_INTEGRITY
+/**
+ * ssr_copy_integrity - Copies the integrity payload of a bio to/from CRCs
+ * @bio_from_up: Bio structure representing the original request
+ * @pi: CRC32 of each of the bio_sectors(@bio_from_up) sectors
+ * @to_bio: true to fill the payload from @pi, false to fill @pi
+ *
+ * The payload holds one little-endian CRC32 per sector, the same value the
+ * CRC area stores.
+ *
+ * Returns a blk_status_t: BLK_STS_PROTECTION if the payload does not match
+ * the bio.
+ */
+static blk_status_t ssr_copy_integrity(struct bio *bio_from_up, u32 *pi, bool to_bio)
+{
+	struct bio_integrity_payload *bip = bio_integrity(bio_from_up);
+	unsigned int nr = bio_sectors(bio_from_up);
+	struct bio_vec bvec;
+	struct bvec_iter iter;
+	__le32 *tuples;
+	char *p;
+	unsigned int i;
+
+	if (bip->bip_iter.bi_size != nr * sizeof(*tuples))
+		return BLK_STS_PROTECTION;
+
+	tuples = kmalloc_array(nr, sizeof(*tuples), GFP_NOIO);
+	if (!tuples)
+		return BLK_STS_RESOURCE;
+
+	if (to_bio)
+		for (i = 0; i < nr; i++)
+			tuples[i] = cpu_to_le32(pi[i]);
+
+	p = (char *)tuples;
+	bip_for_each_vec(bvec, bip, iter) {
+		if (to_bio)
+			memcpy_to_bvec(&bvec, p);
+		else
+			memcpy_from_bvec(p, &bvec);
+
+		p += bvec.bv_len;
+	}
+
+	if (!to_bio)
+		for (i = 0; i < nr; i++)
+			pi[i] = le32_to_cpu(tuples[i]);
+
+	kfree(tuples);
+
+	return BLK_STS_OK;
+}
+#else
+static blk_status_t ssr_copy_integrity(struct bio *bio_from_up, u32 *pi, bool to_bio)
+{
+	return BLK_STS_NOTSUPP;
+}
+#endif
+
+/**
+ * ssr_event - Queues a state change to be reported as a uevent
+ * @dev: Logical device
+ * @type: What happened
+ * @member: Member concerned, SSR_EVENT_NO_MEMBER or SSR_EVENT_REPLICA
+ * @sector: First sector concerned
+ * @nr: Number of sectors concerned
+ *
+ * The I/O paths cannot sleep on the uevent allocations, so events are queued
+ * and sent by ssr_event_worker(). A full queue drops events; the number of
+ * dropped events goes with the next ones sent.
+ */
+static void ssr_event(struct logical_block_dev *dev, enum ssr_event_type type, int member,
+		      sector_t sector, unsigned int nr)
+{
+	struct ssr_event *ev;
+
+	if (!READ_ONCE(dev->event_disk))
+		return;
+
+	ev = kmalloc(sizeof(*ev), GFP_NOWAIT);
+
+	spin_lock(&dev->event_lock);
+	if (!ev || dev->nr_events >= SSR_EVENTS_MAX) {
+		dev->events_dropped++;
+		spin_unlock(&dev->event_lock);
+		kfree(ev);
+		return;
+	}
+
+	ev->type = type;
+	ev->member = member;
+	ev->sector = sector;
+	ev->nr = nr;
+	list_add_tail(&ev->list, &dev->events);
+	dev->nr_events++;
+	spin_unlock(&dev->event_lock);
+
+	queue_work(system_wq, &dev->event_work);
+}
+
+/**
+ * ssr_member_failed - Records an I/O error on a member
+ * @dev: Logical device
+ * @m: Member index
+ * @sector: First sector of the failed I/O
+ * @nr: Number of sectors of the failed I/O
+ *
+ * Only the first error of a member marks it faulty, and only the first
+ * faulty member marks the array degraded, so a dying disk does not flood
+ * userspace. The state lasts until the module is reloaded.
+ */
+static void ssr_member_failed(struct logical_block_dev *dev, int m, sector_t sector,
+			      unsigned int nr)
+{
+	if (test_and_set_bit(m, &dev->state))
+		return;
+
+	ssr_event(dev, SSR_EVENT_MEMBER_FAULTY, m, sector, nr);
+
+	if (!test_and_set_bit(SSR_STATE_DEGRADED, &dev->state))
+		ssr_event(dev, SSR_EVENT_DEGRADED, SSR_EVENT_NO_MEMBER, sector, nr);
+}
+
+/**
+ * ssr_event_worker - Sends the queued events as KOBJ_CHANGE uevents
+ * @work: Work structure embedded in the logical device
+ */
+static void ssr_event_worker(struct work_struct *work)
+{
+	struct logical_block_dev *dev = container_of(work, struct logical_block_dev, event_work);
+	struct gendisk *disk = READ_ONCE(dev->event_disk);
+	struct ssr_event *ev, *tmp;
+	unsigned long dropped;
+	LIST_HEAD(events);
+
+	spin_lock(&dev->event_lock);
+	list_splice_init(&dev->events, &events);
+	dev->nr_events = 0;
+	dropped = dev->events_dropped;
+	spin_unlock(&dev->event_lock);
+
+	list_for_each_entry_safe(ev, tmp, &events, list) {
+		char event[32], array[16 + DISK_NAME_LEN], member[80];
+		char sector[40], sectors[24], lost[40];
+		char *envp[] = { event, array, member, sector, sectors, lost, NULL };
+		const char *name = "";
+
+		if (ev->member == SSR_EVENT_REPLICA)
+			name = dev->replica.name;
+		else if (ev->member != SSR_EVENT_NO_MEMBER)
+			name = dev->members[ev->member].name;
+
+		snprintf(event, sizeof(event), "SSR_EVENT=%s", ssr_event_names[ev->type]);
+		snprintf(array, sizeof(array), "SSR_ARRAY=%s", disk ? disk->disk_name : "");
+		snprintf(member, sizeof(member), "SSR_MEMBER=%s", name);
+		snprintf(sector, sizeof(sector), "SSR_SECTOR=%llu",
+			 (unsigned long long)ev->sector);
+		snprintf(sectors, sizeof(sectors), "SSR_SECTORS=%u", ev->nr);
+		snprintf(lost, sizeof(lost), "SSR_DROPPED=%lu", dropped);
+
+		if (disk)
+			kobject_uevent_env(&disk_to_dev(disk)->kobj, KOBJ_CHANGE, envp);
+
+		list_del(&ev->list);
+		kfree(ev);
+	}
+}
+
+/**
+ * ssr_event_start - Starts reporting events on a disk
+ * @dev: Logical device
+ * @disk: Disk the uevents are sent on, /dev/ssr or the dm device
+ */
+static void ssr_event_start(struct logical_block_dev *dev, struct gendisk *disk)
+{
+	WRITE_ONCE(dev->event_disk, disk);
+}
+
+/**
+ * ssr_event_stop - Stops reporting events and drops the queued ones
+ * @dev: Logical device
+ */
+static void ssr_event_stop(struct logical_block_dev *dev)
+{
+	struct ssr_event *ev, *tmp;
+
+	WRITE_ONCE(dev->event_disk, NULL);
+	cancel_work_sync(&dev->event_work);
+
+	list_for_each_entry_safe(ev, tmp, &dev->events, list) {
+		list_del(&ev->list);
+		kfree(ev);
+	}
+	dev->nr_events = 0;
+}
+
+#if IS_ENABLED(CONFIG_BPF_JIT) && IS_ENABLED(CONFIG_BPF_SYSCALL)
+static struct ssr_policy_ops __rcu *ssr_policy;
+
+/**
+ * ssr_policy_fill - Fills the context passed to the policy
+ * @dev: Logical device
+ * @ctx: Context to fill
+ * @sector: First sector of the request
+ * @nr: Number of sectors of the request
+ * @member: Member to repair, -1 for a read selection
+ */
+static void ssr_policy_fill(struct logical_block_dev *dev, struct ssr_policy_ctx *ctx,
+			    sector_t sector, unsigned int nr, int member)
+{
+	int m;
+
+	ctx->sector = sector;
+	ctx->nr = nr;
+	ctx->member = member;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		ctx->stats[m].lat_ns = READ_ONCE(dev->members[m].lat_ns);
+		ctx->stats[m].inflight = atomic_read(&dev->members[m].inflight);
+		ctx->stats[m].faulty = test_bit(m, &dev->state);
+	}
+}
+
+/**
+ * ssr_policy_select_read - Asks the read policy which member serves a read
+ * @dev: Logical device
+ * @sector: First sector of the read
+ * @nr: Number of sectors of the read
+ *
+ * Returns the member to read first, or SSR_READ_ALL to read and verify
+ * every copy, which is also the answer without a policy or for an invalid
+ * one.
+ */
+static int ssr_policy_select_read(struct logical_block_dev *dev, sector_t sector,
+				  unsigned int nr)
+{
+	struct ssr_policy_ops *ops;
+	struct ssr_policy_ctx ctx;
+	int m = SSR_READ_ALL;
+
+	rcu_read_lock();
+	ops = rcu_dereference(ssr_policy);
+	if (ops && ops->select_read) {
+		ssr_policy_fill(dev, &ctx, sector, nr, -1);
+		m = ops->select_read(&ctx);
+	}
+	rcu_read_unlock();
+
+	return m >= 0 && m < SSR_NUM_MEMBERS ? m : SSR_READ_ALL;
+}
+
+/**
+ * ssr_policy_repair - Asks the repair policy whether to repair a copy now
+ * @dev: Logical device
+ * @m: Member holding the bad copy
+ * @sector: First sector of the range
+ * @nr: Number of sectors of the range
+ *
+ * A repair that is put off happens on a later read of the range.
+ */
+static bool ssr_policy_repair(struct logical_block_dev *dev, int m, sector_t sector,
+			      unsigned int nr)
+{
+	struct ssr_policy_ops *ops;
+	struct ssr_policy_ctx ctx;
+	bool repair = true;
+
+	rcu_read_lock();
+	ops = rcu_dereference(ssr_policy);
+	if (ops && ops->repair) {
+		ssr_policy_fill(dev, &ctx, sector, nr, m);
+		repair = ops->repair(&ctx) != 0;
+	}
+	rcu_read_unlock();
+
+	return repair;
+}
+
+static int ssr_bpf_select_read_stub(const struct ssr_policy_ctx *ctx)
+{
+	return SSR_READ_ALL;
+}
+
+static int ssr_bpf_repair_stub(const struct ssr_policy_ctx *ctx)
+{
+	return 1;
+}
+
+static struct ssr_policy_ops ssr_bpf_stubs = {
+	.select_read = ssr_bpf_select_read_stub,
+	.repair = ssr_bpf_repair_stub,
+};
+
+static int ssr_bpf_init(struct btf *btf)
+{
+	return 0;
+}
+
+static int ssr_bpf_init_member(const struct btf_type *t, const struct btf_member *member,
+			       void *kdata, const void *udata)
+{
+	return 0;
+}
+
+static bool ssr_bpf_is_valid_access(int off, int size, enum bpf_access_type type,
+				    const struct bpf_prog *prog,
+				    struct bpf_insn_access_aux *info)
+{
+	return bpf_tracing_btf_ctx_access(off, size, type, prog, info);
+}
+
+static const struct bpf_verifier_ops ssr_bpf_verifier_ops = {
+	.get_func_proto = bpf_base_func_proto,
+	.is_valid_access = ssr_bpf_is_valid_access,
+};
+
+/**
+ * ssr_bpf_reg - Installs a policy, one at a time for all arrays
+ * @kdata: Kernel copy of the struct ssr_policy_ops
+ * @link: BPF link the policy is attached with
+ */
+static int ssr_bpf_reg(void *kdata, struct bpf_link *link)
+{
+	if (cmpxchg((struct ssr_policy_ops __force **)&ssr_policy, NULL, kdata))
+		return -EEXIST;
+
+	pr_info("ssr_bpf_reg: read policy installed\n");
+
+	return 0;
+}
+
+/**
+ * ssr_bpf_unreg - Removes a policy, the in-kernel one applies again
+ * @kdata: Kernel copy of the struct ssr_policy_ops
+ * @link: BPF link the policy was attached with
+ */
+static void ssr_bpf_unreg(void *kdata, struct bpf_link *link)
+{
+	if (rcu_access_pointer(ssr_policy) != kdata)
+		return;
+
+	RCU_INIT_POINTER(ssr_policy, NULL);
+	synchronize_rcu();
+	pr_info("ssr_bpf_unreg: read policy removed\n");
+}
+
+static struct bpf_struct_ops bpf_ssr_policy_ops = {
+	.verifier_ops = &ssr_bpf_verifier_ops,
+	.init = ssr_bpf_init,
+	.init_member = ssr_bpf_init_member,
+	.reg = ssr_bpf_reg,
+	.unreg = ssr_bpf_unreg,
+	.cfi_stubs = &ssr_bpf_stubs,
+	.name = "ssr_policy_ops",
+	.owner = THIS_MODULE,
+};
+
+/**
+ * ssr_policy_register - Makes struct ssr_policy_ops available to BPF
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_policy_register(void)
+{
+	return register_bpf_struct_ops(&bpf_ssr_policy_ops, ssr_policy_ops);
+}
+#else
+static int ssr_policy_select_read(struct logical_block_dev *dev, sector_t sector,
+				  unsigned int nr)
+{
+	return SSR_READ_ALL;
+}
+
+static bool ssr_policy_repair(struct logical_block_dev *dev, int m, sector_t sector,
+			      unsigned int nr)
+{
+	return true;
+}
+
+static int ssr_policy_register(void)
+{
+	return 0;
+}
+#endif
+
+/**
+ * ssr_crc_cache_max - Number of CRC cache entries allowed by crc_cache_kb
+ */
+static unsigned long ssr_crc_cache_max(void)
+{
+	return READ_ONCE(crc_cache_kb) * 1024UL / sizeof(struct ssr_crc_entry);
+}
+
+/**
+ * ssr_crc_cache_evict - Unlinks the least recently used CRC cache entries
+ * @dev: Logical device, crc_cache_lock held
+ * @nr: Number of entries to unlink
+ * @freed: List receiving the unlinked entries, freed by the caller
+ *
+ * Returns the number of entries unlinked.
+ */
+static unsigned long ssr_crc_cache_evict(struct logical_block_dev *dev, unsigned long nr,
+					 struct list_head *freed)
+{
+	unsigned long evicted = 0;
+
+	while (evicted < nr && !list_empty(&dev->crc_lru)) {
+		struct ssr_crc_entry *e = list_last_entry(&dev->crc_lru,
+							  struct ssr_crc_entry, lru);
+
+		dev->crc_cache[e->member][e->index] = NULL;
+		list_move(&e->lru, freed);
+		dev->crc_cache_nr--;
+		evicted++;
+	}
+
+	return evicted;
+}
+
+/**
+ * ssr_crc_cache_free_list - Frees entries unlinked by ssr_crc_cache_evict()
+ * @freed: List of unlinked entries
+ */
+static void ssr_crc_cache_free_list(struct list_head *freed)
+{
+	struct ssr_crc_entry *e, *tmp;
+
+	list_for_each_entry_safe(e, tmp, freed, lru)
+		kfree(e);
+}
+
+/**
+ * ssr_crc_store - Updates the cached CRC sectors of a member
+ * @dev: Logical device
+ * @m: Member index
+ * @sector: First data sector the CRC window was built for
+ * @nr: Number of data sectors
+ * @crcs: CRC window as it is on the member
+ *
+ * The cache is write-through: entries always match the member, so they can
+ * be dropped at any time without I/O.
+ */
+static void ssr_crc_store(struct logical_block_dev *dev, int m, sector_t sector,
+			  unsigned int nr, __le32 *crcs)
+{
+	unsigned int first = ssr_crc_sector(sector) - SSR_CRC_FIRST_SECTOR;
+	unsigned int count = ssr_crc_window_len(sector, nr) / KERNEL_SECTOR_SIZE;
+	unsigned long max = ssr_crc_cache_max();
+	LIST_HEAD(freed);
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		__le32 *src = crcs + i * SSR_CRCS_PER_SECTOR;
+		struct ssr_crc_entry *e, *new = NULL;
+
+		if (!max)
+			break;
+
+		spin_lock(&dev->crc_cache_lock);
+		e = dev->crc_cache[m][first + i];
+		if (e) {
+			memcpy(e->crcs, src, KERNEL_SECTOR_SIZE);
+			list_move(&e->lru, &dev->crc_lru);
+		}
+		spin_unlock(&dev->crc_cache_lock);
+
+		if (e)
+			continue;
+
+		new = kmalloc(sizeof(*new), GFP_NOIO | __GFP_NOWARN);
+		if (!new)
+			break;
+
+		new->member = m;
+		new->index = first + i;
+		memcpy(new->crcs, src, KERNEL_SECTOR_SIZE);
+
+		spin_lock(&dev->crc_cache_lock);
+		e = dev->crc_cache[m][first + i];
+		if (e) {
+			memcpy(e->crcs, src, KERNEL_SECTOR_SIZE);
+			list_move(&e->lru, &dev->crc_lru);
+			list_add(&new->lru, &freed);
+		} else {
+			dev->crc_cache[m][first + i] = new;
+			list_add(&new->lru, &dev->crc_lru);
+			dev->crc_cache_nr++;
+			if (dev->crc_cache_nr > max)
+				ssr_crc_cache_evict(dev, dev->crc_cache_nr - max, &freed);
+		}
+		spin_unlock(&dev->crc_cache_lock);
+	}
+
+	ssr_crc_cache_free_list(&freed);
+}
+
+/**
+ * ssr_crc_invalidate - Drops the cached CRC sectors of a member
+ * @dev: Logical device
+ * @m: Member index
+ * @sector: First data sector
+ * @nr: Number of data sectors
+ *
+ * Used when a write to the member failed and its CRC area is unknown.
+ */
+static void ssr_crc_invalidate(struct logical_block_dev *dev, int m, sector_t sector,
+			       unsigned int nr)
+{
+	unsigned int first = ssr_crc_sector(sector) - SSR_CRC_FIRST_SECTOR;
+	unsigned int count = ssr_crc_window_len(sector, nr) / KERNEL_SECTOR_SIZE;
+	LIST_HEAD(freed);
+	unsigned int i;
+
+	spin_lock(&dev->crc_cache_lock);
+	for (i = 0; i < count; i++) {
+		struct ssr_crc_entry *e = dev->crc_cache[m][first + i];
+
+		if (!e)
+			continue;
+
+		dev->crc_cache[m][first + i] = NULL;
+		list_move(&e->lru, &freed);
+		dev->crc_cache_nr--;
+	}
+	spin_unlock(&dev->crc_cache_lock);
+
+	ssr_crc_cache_free_list(&freed);
+}
+
+/**
+ * ssr_crc_load - Reads the CRC window of a data range from a member
+ * @dev: Logical device
+ * @m: Member index
+ * @sector: First data sector
+ * @nr: Number of data sectors
+ * @crcs: Buffer of ssr_crc_window_len() bytes
+ *
+ * The window is served from the CRC cache when all its sectors are cached,
+ * otherwise it is read from the member and cached.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_crc_load(struct logical_block_dev *dev, int m, sector_t sector,
+			unsigned int nr, __le32 *crcs)
+{
+	unsigned int first = ssr_crc_sector(sector) - SSR_CRC_FIRST_SECTOR;
+	size_t crc_len = ssr_crc_window_len(sector, nr);
+	unsigned int count = crc_len / KERNEL_SECTOR_SIZE;
+	unsigned int i;
+	int err;
+
+	spin_lock(&dev->crc_cache_lock);
+	for (i = 0; i < count; i++) {
+		struct ssr_crc_entry *e = dev->crc_cache[m][first + i];
+
+		if (!e)
+			break;
+
+		memcpy(crcs + i * SSR_CRCS_PER_SECTOR, e->crcs, KERNEL_SECTOR_SIZE);
+		list_move(&e->lru, &dev->crc_lru);
+	}
+	spin_unlock(&dev->crc_cache_lock);
+
+	if (i == count) {
+		atomic64_inc(&dev->crc_cache_hits);
+		return 0;
+	}
+
+	atomic64_inc(&dev->crc_cache_misses);
+
+	err = ssr_member_io(&dev->members[m], REQ_OP_READ, ssr_crc_sector(sector),
+			    crcs, crc_len);
+	if (!err)
+		ssr_crc_store(dev, m, sector, nr, crcs);
+
+	return err;
+}
+
+/**
+ * ssr_crc_cache_count - Shrinker count_objects callback of the CRC cache
+ * @shrink: crc_shrinker of the logical device
+ * @sc: Shrink control
+ */
+static unsigned long ssr_crc_cache_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct logical_block_dev *dev = shrink->private_data;
+	unsigned long nr = READ_ONCE(dev->crc_cache_nr);
+
+	return nr ? nr : SHRINK_EMPTY;
+}
+
+/**
+ * ssr_crc_cache_scan - Shrinker scan_objects callback of the CRC cache
+ * @shrink: crc_shrinker of the logical device
+ * @sc: Shrink control
+ *
+ * All entries are clean, so reclaim only has to free the coldest ones.
+ */
+static unsigned long ssr_crc_cache_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+	struct logical_block_dev *dev = shrink->private_data;
+	unsigned long freed_nr;
+	LIST_HEAD(freed);
+
+	spin_lock(&dev->crc_cache_lock);
+	freed_nr = ssr_crc_cache_evict(dev, sc->nr_to_scan, &freed);
+	spin_unlock(&dev->crc_cache_lock);
+
+	ssr_crc_cache_free_list(&freed);
+
+	return freed_nr ? freed_nr : SHRINK_STOP;
+}
+
+/**
+ * ssr_crc_cache_init - Sets up the CRC cache and registers its shrinker
+ * @dev: Logical device
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_crc_cache_init(struct logical_block_dev *dev)
+{
+	int m, err;
+
+	spin_lock_init(&dev->crc_cache_lock);
+	INIT_LIST_HEAD(&dev->crc_lru);
+	dev->crc_cache_nr = 0;
+	atomic64_set(&dev->crc_cache_hits, 0);
+	atomic64_set(&dev->crc_cache_misses, 0);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		dev->crc_cache[m] = kvcalloc(SSR_CRC_SECTORS, sizeof(*dev->crc_cache[m]),
+					     GFP_KERNEL);
+		if (!dev->crc_cache[m]) {
+			err = -ENOMEM;
+			goto out_free;
+		}
+	}
+
+	dev->crc_shrinker = shrinker_alloc(0, "ssr-crc-cache");
+	if (!dev->crc_shrinker) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	dev->crc_shrinker->count_objects = ssr_crc_cache_count;
+	dev->crc_shrinker->scan_objects = ssr_crc_cache_scan;
+	dev->crc_shrinker->private_data = dev;
+
+	shrinker_register(dev->crc_shrinker);
+
+	return 0;
+
+out_free:
+	while (m--)
+		kvfree(dev->crc_cache[m]);
+	return err;
+}
+
+/**
+ * ssr_crc_cache_free - Unregisters the shrinker and empties the CRC cache
+ * @dev: Logical device
+ */
+static void ssr_crc_cache_free(struct logical_block_dev *dev)
+{
+	LIST_HEAD(freed);
+	int m;
+
+	shrinker_free(dev->crc_shrinker);
+
+	spin_lock(&dev->crc_cache_lock);
+	ssr_crc_cache_evict(dev, ULONG_MAX, &freed);
+	spin_unlock(&dev->crc_cache_lock);
+
+	ssr_crc_cache_free_list(&freed);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		kvfree(dev->crc_cache[m]);
+}
+
+/**
+ * ssr_write_sectors - Writes a range of sectors and their CRCs to both members
+ * @dev: Logical device
+ * @sector: First sector of the range
+ * @nr: Number of sectors in the range
+ * @data: Payload of the range, NULL to write zeroes
+ * @pi: CRC32 of each sector supplied by the upper layer, NULL to compute them
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * The CRCs are computed in a single pass over the payload, fused with the
+ * zero check (see ssr_core_sums()), unless @pi supplies them: those are
+ * stored as they are, so data the upper layer corrupted before handing it
+ * over fails the verification of later reads. All-zero ranges are sent to
+ * the members as write-zeroes instead of data and marked unwritten, so
+ * later reads are served without member I/O.
+ *
+ * The CRC window is read-modify-written separately on each member so that a
+ * corrupted CRC on one member never spreads to the other one.
+ *
+ * Returns a blk_status_t: success if at least one member was written.
+ */
+static blk_status_t ssr_write_sectors(struct logical_block_dev *dev, sector_t sector,
+				      unsigned int nr, char *data, const u32 *pi,
+				      blk_opf_t flags)
+{
+	size_t crc_len = ssr_crc_window_len(sector, nr);
+	bool partial = !IS_ALIGNED(sector, SSR_CRCS_PER_SECTOR) ||
+		       !IS_ALIGNED(sector + nr, SSR_CRCS_PER_SECTOR);
+	bool zero = true;
+	__le32 *crcs;
+	u32 *sums;
+	unsigned int i;
+	int m, written = 0;
+
+	sums = kmalloc_array(nr, sizeof(*sums), GFP_NOIO);
+	crcs = kmalloc(crc_len, GFP_NOIO);
+	if (!sums || !crcs) {
+		kfree(sums);
+		kfree(crcs);
+		return BLK_STS_RESOURCE;
+	}
+
+	if (data && pi) {
+		memcpy(sums, pi, nr * sizeof(*sums));
+		for (i = 0; i < nr && zero; i++)
+			zero = sums[i] == ssr_zero_crc &&
+			       !memchr_inv(data + i * KERNEL_SECTOR_SIZE, 0, KERNEL_SECTOR_SIZE);
+	} else if (data) {
+		zero = ssr_core_sums(data, nr, sums, ssr_zero_crc);
+	} else
+		for (i = 0; i < nr; i++)
+			sums[i] = ssr_zero_crc;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct ssr_member *member = &dev->members[m];
+		sector_t crc_sector = ssr_crc_sector(sector);
+		int err = 0;
+
+		if (partial)
+			err = ssr_crc_load(dev, m, sector, nr, crcs);
+		else
+			memset(crcs, 0, crc_len);
+
+		if (!err && zero)
+			err = ssr_member_zeroout(member, sector, nr);
+		else if (!err)
+			err = ssr_member_io(member, REQ_OP_WRITE | flags, sector, data,
+					    nr * KERNEL_SECTOR_SIZE);
+
+		if (!err) {
+			for (i = 0; i < nr; i++)
+				*ssr_crc_slot(crcs, sector, sector + i) = cpu_to_le32(sums[i]);
+
+			err = ssr_member_io(member, REQ_OP_WRITE | flags, crc_sector,
+					    crcs, crc_len);
+		}
+
+		if (!err && zero && (flags & REQ_FUA))
+			err = ssr_member_flush(member);
+
+		if (err) {
+			pr_err("ssr_write_sectors: %s: write of sector %llu failed (%d)\n",
+			       member->name, (unsigned long long)sector, err);
+			ssr_member_failed(dev, m, sector, nr);
+			ssr_crc_invalidate(dev, m, sector, nr);
+			continue;
+		}
+
+		ssr_crc_store(dev, m, sector, nr, crcs);
+		written++;
+	}
+
+	/*
+	 * A range no member took keeps its old state. The range lock keeps
+	 * concurrent requests on separate bitmap words.
+	 */
+	if (written && zero)
+		bitmap_set(dev->unwritten, sector, nr);
+	else if (written)
+		bitmap_clear(dev->unwritten, sector, nr);
+
+	kfree(crcs);
+	kfree(sums);
+
+	return written ? BLK_STS_OK : BLK_STS_IOERR;
+}
+
+/**
+ * ssr_read_sectors - Reads a range of sectors, verifying and repairing it
+ * @dev: Logical device
+ * @sector: First sector of the range
+ * @nr: Number of sectors in the range
+ * @out: Buffer receiving the verified payload
+ * @pi: Receives the verified CRC32 of each sector, NULL if not wanted
+ *
+ * The data and the CRCs are read from both members. For each sector the copy
+ * whose CRC matches is returned; a member holding a corrupted copy is then
+ * rewritten with the good one. Sectors marked unwritten read as zeroes,
+ * which covers those the initializer of a new array has not reached yet.
+ *
+ * Returns a blk_status_t: an error if a sector is corrupted on both members.
+ */
+static blk_status_t ssr_read_sectors(struct logical_block_dev *dev, sector_t sector,
+				     unsigned int nr, char *out, u32 *pi)
+{
+	size_t len = nr * KERNEL_SECTOR_SIZE;
+	size_t crc_len = ssr_crc_window_len(sector, nr);
+	char *data[SSR_NUM_MEMBERS] = { NULL };
+	__le32 *crcs[SSR_NUM_MEMBERS] = { NULL };
+	bool valid[SSR_NUM_MEMBERS], dirty[SSR_NUM_MEMBERS] = { false };
+	blk_status_t status = BLK_STS_OK;
+	int m, first, primary = -1;
+	unsigned int i;
+
+	if (find_next_zero_bit(dev->unwritten, sector + nr, sector) >= sector + nr) {
+		memset(out, 0, len);
+		for (i = 0; pi && i < nr; i++)
+			pi[i] = ssr_zero_crc;
+		return BLK_STS_OK;
+	}
+
+	first = ssr_qd_select(dev, ssr_policy_select_read(dev, sector, nr));
+
+again:
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct ssr_member *member = &dev->members[m];
+
+		valid[m] = false;
+		if (first != SSR_READ_ALL && m != first)
+			continue;
+
+		if (!data[m])
+			data[m] = kmalloc(len, GFP_NOIO);
+		if (!crcs[m])
+			crcs[m] = kmalloc(crc_len, GFP_NOIO);
+		if (!data[m] || !crcs[m]) {
+			status = BLK_STS_RESOURCE;
+			goto out;
+		}
+
+		valid[m] = !ssr_member_io(member, REQ_OP_READ, sector, data[m], len) &&
+			   !ssr_crc_load(dev, m, sector, nr, crcs[m]);
+		if (!valid[m]) {
+			pr_err("ssr_read_sectors: %s: read of sector %llu failed\n",
+			       member->name, (unsigned long long)sector);
+			ssr_member_failed(dev, m, sector, nr);
+		} else if (primary < 0) {
+			primary = m;
+		}
+	}
+
+	if (primary < 0 && first != SSR_READ_ALL) {
+		first = SSR_READ_ALL;
+		goto again;
+	}
+
+	if (primary < 0) {
+		status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		size_t off = i * KERNEL_SECTOR_SIZE;
+
+		if (test_bit(sector + i, dev->unwritten)) {
+			for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+				if (!valid[m])
+					continue;
+				memset(data[m] + off, 0, KERNEL_SECTOR_SIZE);
+				*ssr_crc_slot(crcs[m], sector, sector + i) =
+					cpu_to_le32(ssr_zero_crc);
+			}
+		}
+
+		if (ssr_core_verify_sector(data, crcs, valid, sector, sector + i, dirty) >= 0)
+			continue;
+
+		/* the selected copy is bad: verify and repair on every member */
+		if (first != SSR_READ_ALL) {
+			first = SSR_READ_ALL;
+			primary = -1;
+			goto again;
+		}
+
+		pr_err("ssr_read_sectors: sector %llu is corrupted on all members\n",
+		       (unsigned long long)(sector + i));
+		ssr_event(dev, SSR_EVENT_UNRECOVERABLE, SSR_EVENT_NO_MEMBER, sector + i, 1);
+		status = BLK_STS_IOERR;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct ssr_member *member = &dev->members[m];
+
+		if (!dirty[m] || !ssr_policy_repair(dev, m, sector, nr))
+			continue;
+
+		pr_info("ssr_read_sectors: %s: repairing sectors %llu-%llu\n", member->name,
+			(unsigned long long)sector, (unsigned long long)(sector + nr - 1));
+
+		if (ssr_member_io(member, REQ_OP_WRITE, sector, data[m], len) ||
+		    ssr_member_io(member, REQ_OP_WRITE, ssr_crc_sector(sector),
+				  crcs[m], crc_len)) {
+			pr_err("ssr_read_sectors: %s: repair failed\n", member->name);
+			ssr_member_failed(dev, m, sector, nr);
+			ssr_crc_invalidate(dev, m, sector, nr);
+			continue;
+		}
+
+		ssr_crc_store(dev, m, sector, nr, crcs[m]);
+		ssr_event(dev, SSR_EVENT_REPAIRED, m, sector, nr);
+	}
+
+	if (status == BLK_STS_OK) {
+		memcpy(out, data[primary], len);
+		for (i = 0; pi && i < nr; i++)
+			pi[i] = le32_to_cpu(*ssr_crc_slot(crcs[primary], sector, sector + i));
+	}
+
+out:
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		kfree(data[m]);
+		kfree(crcs[m]);
+	}
+
+	return status;
+}
+
+/**
+ * ssr_range_overlaps - Tells whether a range overlaps a locked range
+ * @dev: Logical device, range_lock held
+ * @range: Range that is not locked yet
+ */
+static bool ssr_range_overlaps(struct logical_block_dev *dev, struct ssr_range *range)
+{
+	struct ssr_range *other;
+
+	list_for_each_entry(other, &dev->ranges, list)
+		if (other->start < range->end && range->start < other->end)
+			return true;
+
+	return false;
+}
+
+/**
+ * ssr_range_busy - Locked wrapper of ssr_range_overlaps() for wait_event()
+ * @dev: Logical device
+ * @range: Range that is not locked yet
+ */
+static bool ssr_range_busy(struct logical_block_dev *dev, struct ssr_range *range)
+{
+	bool busy;
+
+	spin_lock(&dev->range_lock);
+	busy = ssr_range_overlaps(dev, range);
+	spin_unlock(&dev->range_lock);
+
+	return busy;
+}
+
+/**
+ * ssr_range_lock - Locks a range of logical sectors against overlapping requests
+ * @dev: Logical device
+ * @range: Range to lock, owned by the caller until ssr_range_unlock()
+ * @sector: First sector of the range
+ * @nr: Number of sectors in the range
+ *
+ * The range is rounded out to whole SSR_CHUNK_SECTORS chunks. A chunk shares
+ * one CRC sector and, in compressed mode, one compressed extent, so requests
+ * touching the same chunk must not run concurrently. It also keeps requests
+ * running on different workers on separate words of the unwritten map.
+ */
+static void ssr_range_lock(struct logical_block_dev *dev, struct ssr_range *range,
+			   sector_t sector, unsigned int nr)
+{
+	range->start = round_down(sector, SSR_CHUNK_SECTORS);
+	range->end = round_up(sector + nr, SSR_CHUNK_SECTORS);
+
+	for (;;) {
+		spin_lock(&dev->range_lock);
+		if (!ssr_range_overlaps(dev, range)) {
+			list_add(&range->list, &dev->ranges);
+			spin_unlock(&dev->range_lock);
+			return;
+		}
+		spin_unlock(&dev->range_lock);
+
+		wait_event(dev->range_wait, !ssr_range_busy(dev, range));
+	}
+}
+
+/**
+ * ssr_range_unlock - Unlocks a range locked by ssr_range_lock()
+ * @dev: Logical device
+ * @range: Locked range
+ */
+static void ssr_range_unlock(struct logical_block_dev *dev, struct ssr_range *range)
+{
+	spin_lock(&dev->range_lock);
+	list_del(&range->list);
+	spin_unlock(&dev->range_lock);
+
+	wake_up_all(&dev->range_wait);
+}
+
+/**
+ * ssr_flush - Flushes the volatile write caches of both members
+ * @dev: Logical device
+ *
+ * The metadata device, if any, holds the metadata of both members and has
+ * to be flushed in any case.
+ *
+ * Returns a blk_status_t: success if at least one member was flushed.
+ */
+static blk_status_t ssr_flush(struct logical_block_dev *dev)
+{
+	int m, flushed = 0;
+
+	if (dev->meta_file && blkdev_issue_flush(file_bdev(dev->meta_file)))
+		return BLK_STS_IOERR;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (!ssr_member_flush(&dev->members[m]))
+			flushed++;
+
+	return flushed ? BLK_STS_OK : BLK_STS_IOERR;
+}
+
+/**
+ * ssr_jrnl_slot_sector - First member sector of a journal slot
+ * @slot: Slot index
+ */
+static sector_t ssr_jrnl_slot_sector(int slot)
+{
+	return SSR_JRNL_FIRST_SECTOR + slot * SSR_JRNL_SLOT_SECTORS;
+}
+
+/**
+ * ssr_jrnl_get - Takes a free journal slot
+ * @dev: Logical device
+ *
+ * Returns the slot, or -1 if all of them are in use.
+ */
+static int ssr_jrnl_get(struct logical_block_dev *dev)
+{
+	int slot;
+
+	for (slot = 0; slot < SSR_JRNL_SLOTS; slot++)
+		if (!test_and_set_bit(slot, &dev->jrnl_busy))
+			return slot;
+
+	return -1;
+}
+
+/**
+ * ssr_jrnl_clear - Invalidates a journal slot on both members
+ * @dev: Logical device
+ * @slot: Slot index
+ * @hdr: Buffer of one sector, overwritten
+ */
+static void ssr_jrnl_clear(struct logical_block_dev *dev, int slot, struct ssr_jrec *hdr)
+{
+	int m;
+
+	memset(hdr, 0, KERNEL_SECTOR_SIZE);
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (ssr_member_io(&dev->members[m], REQ_OP_WRITE | REQ_FUA,
+				  ssr_jrnl_slot_sector(slot), hdr, KERNEL_SECTOR_SIZE))
+			pr_err("ssr_jrnl_clear: %s: slot %d\n", dev->members[m].name, slot);
+}
+
+/**
+ * ssr_jrnl_write - Takes a journal slot and writes a record to it
+ * @dev: Logical device
+ * @rec: Header sector with its sector and cmp_len set, followed by the data
+ * @nr: Number of data sectors, at most SSR_MAX_SECTORS
+ * @slot: Receives the slot, released with ssr_jrnl_put() whatever the result
+ *
+ * The header and the data go out in one FUA write per member.
+ *
+ * Returns 0 if at least one member holds the record.
+ */
+static int ssr_jrnl_write(struct logical_block_dev *dev, char *rec, unsigned int nr, int *slot)
+{
+	struct ssr_jrec *hdr = (struct ssr_jrec *)rec;
+	size_t len = nr * KERNEL_SECTOR_SIZE;
+	int m, written = 0;
+
+	hdr->magic = cpu_to_le32(SSR_JRNL_MAGIC);
+	hdr->nr = cpu_to_le32(nr);
+	hdr->data_crc = cpu_to_le32(crc32(0, rec + KERNEL_SECTOR_SIZE, len));
+	hdr->crc = 0;
+	hdr->crc = cpu_to_le32(crc32(0, hdr, KERNEL_SECTOR_SIZE));
+
+	wait_event(dev->jrnl_wait, (*slot = ssr_jrnl_get(dev)) >= 0);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (!ssr_member_io(&dev->members[m], REQ_OP_WRITE | REQ_FUA,
+				   ssr_jrnl_slot_sector(*slot), rec, KERNEL_SECTOR_SIZE + len))
+			written++;
+
+	return written ? 0 : -EIO;
+}
+
+/**
+ * ssr_jrnl_put - Invalidates a journal slot and releases it
+ * @dev: Logical device
+ * @slot: Slot from ssr_jrnl_write()
+ * @hdr: Buffer of one sector, overwritten
+ *
+ * A failed FUA write may still have reached the medium, so the slot is
+ * invalidated even if ssr_jrnl_write() failed.
+ */
+static void ssr_jrnl_put(struct logical_block_dev *dev, int slot, struct ssr_jrec *hdr)
+{
+	ssr_jrnl_clear(dev, slot, hdr);
+	clear_bit(slot, &dev->jrnl_busy);
+	wake_up(&dev->jrnl_wait);
+}
+
+/**
+ * ssr_cmap_init - Loads the compressed extent map from the members
+ * @dev: Logical device
+ *
+ * The map lives right after the CRC area: a header sector followed by one
+ * struct ssr_cmap_entry per chunk. If no member holds a valid header, or
+ * @create is set, the array is new and an empty map (every chunk reads as
+ * zeroes) is written.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_cmap_init(struct logical_block_dev *dev, bool create)
+{
+	size_t len = SSR_CMAP_SECTORS * KERNEL_SECTOR_SIZE;
+	struct ssr_cmap_header *hdr;
+	int m, err = -EIO;
+
+	mutex_init(&dev->cmap_mutex);
+
+	hdr = kzalloc(KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	dev->cmap = vzalloc(len);
+	if (!hdr || !dev->cmap) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS && !create; m++) {
+		struct ssr_member *member = &dev->members[m];
+
+		if (ssr_member_io(member, REQ_OP_READ, SSR_CMAP_FIRST_SECTOR, hdr,
+				  KERNEL_SECTOR_SIZE) ||
+		    le32_to_cpu(hdr->magic) != SSR_CMAP_MAGIC)
+			continue;
+
+		if (le32_to_cpu(hdr->chunk_sectors) != SSR_CHUNK_SECTORS) {
+			pr_err("ssr_cmap_init: %s: unsupported chunk size\n", member->name);
+			err = -EINVAL;
+			goto out;
+		}
+
+		err = ssr_member_io(member, REQ_OP_READ, SSR_CMAP_FIRST_SECTOR + 1,
+				    dev->cmap, len);
+		if (!err)
+			goto out;
+	}
+
+	pr_info("ssr_cmap_init: no compressed map found, creating an empty one\n");
+
+	memset(hdr, 0, KERNEL_SECTOR_SIZE);
+	hdr->magic = cpu_to_le32(SSR_CMAP_MAGIC);
+	hdr->chunk_sectors = cpu_to_le32(SSR_CHUNK_SECTORS);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct ssr_member *member = &dev->members[m];
+
+		err = ssr_member_io(member, REQ_OP_WRITE, SSR_CMAP_FIRST_SECTOR + 1,
+				    dev->cmap, len);
+		if (!err)
+			err = ssr_member_io(member, REQ_OP_WRITE | REQ_FUA,
+					    SSR_CMAP_FIRST_SECTOR, hdr, KERNEL_SECTOR_SIZE);
+		if (err)
+			goto out;
+	}
+
+out:
+	kfree(hdr);
+	if (err) {
+		vfree(dev->cmap);
+		dev->cmap = NULL;
+	}
+
+	return err;
+}
+
+/**
+ * ssr_cmap_update - Updates and persists the map entry of a chunk
+ * @dev: Logical device
+ * @chunk: Chunk index
+ * @len: Stored length of the chunk in bytes
+ * @crc: CRC32 of the stored payload
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * Entries of different chunks share map sectors, so the update and the
+ * write-out of the sector are serialized by cmap_mutex.
+ *
+ * Returns 0 if at least one member was updated.
+ */
+static int ssr_cmap_update(struct logical_block_dev *dev, unsigned long chunk,
+			   u32 len, u32 crc, blk_opf_t flags)
+{
+	unsigned long idx = chunk / SSR_CMAP_ENTRIES_PER_SECTOR;
+	int m, written = 0;
+
+	mutex_lock(&dev->cmap_mutex);
+
+	dev->cmap[chunk].len = cpu_to_le32(len);
+	dev->cmap[chunk].crc = cpu_to_le32(crc);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (!ssr_member_io(&dev->members[m], REQ_OP_WRITE | flags,
+				   SSR_CMAP_FIRST_SECTOR + 1 + idx,
+				   &dev->cmap[idx * SSR_CMAP_ENTRIES_PER_SECTOR],
+				   KERNEL_SECTOR_SIZE))
+			written++;
+
+	mutex_unlock(&dev->cmap_mutex);
+
+	return written ? 0 : -EIO;
+}
+
+/**
+ * ssr_cmp_read_chunk - Reads, verifies and decompresses one chunk
+ * @dev: Logical device
+ * @chunk: Chunk index
+ * @out: Buffer of SSR_CHUNK_BYTES receiving the uncompressed chunk
+ * @payload: Scratch buffer of SSR_CHUNK_BYTES
+ *
+ * The stored payload is read from one member at a time until its CRC
+ * matches the map; members returning a bad copy are rewritten with the
+ * good one.
+ *
+ * Returns a blk_status_t.
+ */
+static blk_status_t ssr_cmp_read_chunk(struct logical_block_dev *dev, unsigned long chunk,
+				       char *out, char *payload)
+{
+	u32 len = le32_to_cpu(dev->cmap[chunk].len);
+	u32 crc = le32_to_cpu(dev->cmap[chunk].crc);
+	size_t stored = round_up(len, KERNEL_SECTOR_SIZE);
+	sector_t sector = chunk * SSR_CHUNK_SECTORS;
+	bool bad[SSR_NUM_MEMBERS] = { false };
+	int i, m, first, good = -1;
+
+	if (!len) {
+		memset(out, 0, SSR_CHUNK_BYTES);
+		return BLK_STS_OK;
+	}
+
+	/* copies are tried in turn, starting with the one the policy selects */
+	first = ssr_qd_select(dev, ssr_policy_select_read(dev, sector, SSR_CHUNK_SECTORS));
+	if (first == SSR_READ_ALL)
+		first = 0;
+
+	for (i = 0; i < SSR_NUM_MEMBERS && good < 0; i++) {
+		struct ssr_member *member;
+
+		m = (first + i) % SSR_NUM_MEMBERS;
+		member = &dev->members[m];
+
+		if (ssr_member_io(member, REQ_OP_READ, sector, payload, stored)) {
+			pr_err("ssr_cmp_read_chunk: %s: read of chunk %lu failed\n",
+			       member->name, chunk);
+			ssr_member_failed(dev, m, chunk * SSR_CHUNK_SECTORS, SSR_CHUNK_SECTORS);
+			continue;
+		}
+
+		if (crc32(0, payload, len) == crc)
+			good = m;
+		else
+			bad[m] = true;
+	}
+
+	if (good < 0) {
+		pr_err("ssr_cmp_read_chunk: chunk %lu is corrupted on all members\n", chunk);
+		ssr_event(dev, SSR_EVENT_UNRECOVERABLE, SSR_EVENT_NO_MEMBER,
+			  chunk * SSR_CHUNK_SECTORS, SSR_CHUNK_SECTORS);
+		return BLK_STS_IOERR;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (!bad[m] || !ssr_policy_repair(dev, m, sector, SSR_CHUNK_SECTORS))
+			continue;
+
+		pr_info("ssr_cmp_read_chunk: %s: repairing chunk %lu\n",
+			dev->members[m].name, chunk);
+		if (ssr_member_io(&dev->members[m], REQ_OP_WRITE, sector, payload, stored)) {
+			pr_err("ssr_cmp_read_chunk: %s: repair failed\n", dev->members[m].name);
+			ssr_member_failed(dev, m, chunk * SSR_CHUNK_SECTORS, SSR_CHUNK_SECTORS);
+		} else {
+			ssr_event(dev, SSR_EVENT_REPAIRED, m, chunk * SSR_CHUNK_SECTORS,
+				  SSR_CHUNK_SECTORS);
+		}
+	}
+
+	if (len == SSR_CHUNK_BYTES) {
+		memcpy(out, payload, SSR_CHUNK_BYTES);
+		return BLK_STS_OK;
+	}
+
+	if (LZ4_decompress_safe(payload, out, len, SSR_CHUNK_BYTES) != SSR_CHUNK_BYTES) {
+		pr_err("ssr_cmp_read_chunk: chunk %lu does not decompress\n", chunk);
+		return BLK_STS_IOERR;
+	}
+
+	return BLK_STS_OK;
+}
+
+/**
+ * ssr_cmp_store - Writes the stored payload of a chunk in place and maps it
+ * @dev: Logical device
+ * @chunk: Chunk index
+ * @payload: Stored payload, padded with zeroes to whole sectors
+ * @len: Length of the payload in bytes
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * Returns a blk_status_t: success if at least one member was written.
+ */
+static blk_status_t ssr_cmp_store(struct logical_block_dev *dev, unsigned long chunk,
+				  char *payload, u32 len, blk_opf_t flags)
+{
+	sector_t sector = chunk * SSR_CHUNK_SECTORS;
+	size_t stored = round_up(len, KERNEL_SECTOR_SIZE);
+	int m, written = 0;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct ssr_member *member = &dev->members[m];
+
+		if (ssr_member_io(member, REQ_OP_WRITE | flags, sector, payload, stored)) {
+			pr_err("ssr_cmp_store: %s: write of chunk %lu failed\n",
+			       member->name, chunk);
+			ssr_member_failed(dev, m, sector, SSR_CHUNK_SECTORS);
+			continue;
+		}
+
+		written++;
+	}
+
+	if (!written)
+		return BLK_STS_IOERR;
+
+	if (ssr_cmap_update(dev, chunk, len, crc32(0, payload, len), flags))
+		return BLK_STS_IOERR;
+
+	return BLK_STS_OK;
+}
+
+/**
+ * ssr_cmp_write_chunk - Compresses one chunk and mirrors it
+ * @dev: Logical device
+ * @chunk: Chunk index
+ * @src: Uncompressed chunk of SSR_CHUNK_BYTES
+ * @payload: Scratch buffer of SSR_CHUNK_BYTES
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * The compressed payload is stored at the start of the chunk's slot, padded
+ * to whole sectors, and its CRC goes to the map. Chunks that do not save at
+ * least one sector are stored raw; all-zero chunks are not stored at all.
+ *
+ * The slot is overwritten in place and its map entry after it, so a crash
+ * in between would leave the old entry describing a new payload. Payload
+ * and length therefore go to a journal slot first, as in ssr_atomic_write(),
+ * which is invalidated once both are flushed; ssr_jrnl_replay() completes
+ * an interrupted write. An all-zero chunk only changes its map entry, a
+ * single sector write.
+ *
+ * Returns a blk_status_t: success if at least one member was written.
+ */
+static blk_status_t ssr_cmp_write_chunk(struct logical_block_dev *dev, unsigned long chunk,
+					char *src, char *payload, blk_opf_t flags)
+{
+	char *stored_payload = payload;
+	blk_status_t status;
+	void *wrkmem;
+	size_t stored;
+	char *rec;
+	int len, slot;
+
+	BUILD_BUG_ON(SSR_CHUNK_SECTORS > SSR_MAX_SECTORS);
+
+	if (!memchr_inv(src, 0, SSR_CHUNK_BYTES))
+		return ssr_cmap_update(dev, chunk, 0, 0, flags) ? BLK_STS_IOERR : BLK_STS_OK;
+
+	wrkmem = kmalloc(LZ4_MEM_COMPRESS, GFP_NOIO);
+	if (!wrkmem)
+		return BLK_STS_RESOURCE;
+
+	len = LZ4_compress_default(src, payload, SSR_CHUNK_BYTES,
+				   SSR_CHUNK_BYTES - KERNEL_SECTOR_SIZE, wrkmem);
+	kfree(wrkmem);
+
+	if (len <= 0) {
+		stored_payload = src;
+		len = SSR_CHUNK_BYTES;
+	}
+
+	stored = round_up(len, KERNEL_SECTOR_SIZE);
+	memset(stored_payload + len, 0, stored - len);
+
+	rec = kzalloc(KERNEL_SECTOR_SIZE + stored, GFP_NOIO);
+	if (!rec)
+		return BLK_STS_RESOURCE;
+
+	((struct ssr_jrec *)rec)->sector = cpu_to_le64(chunk * SSR_CHUNK_SECTORS);
+	((struct ssr_jrec *)rec)->cmp_len = cpu_to_le32(len);
+	memcpy(rec + KERNEL_SECTOR_SIZE, stored_payload, stored);
+
+	if (ssr_jrnl_write(dev, rec, stored >> SECTOR_SHIFT, &slot)) {
+		status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	status = ssr_cmp_store(dev, chunk, stored_payload, len, flags);
+	if (status == BLK_STS_OK)
+		status = ssr_flush(dev);
+
+out:
+	ssr_jrnl_put(dev, slot, (struct ssr_jrec *)rec);
+	kfree(rec);
+
+	return status;
+}
+
+/**
+ * ssr_cmp_rw_chunk - Handles the part of a request within one chunk
+ * @dev: Logical device
+ * @sector: First sector of the part
+ * @nr: Number of sectors, the part never crosses a chunk boundary
+ * @buffer: Payload of the part, NULL for write-zeroes
+ * @write: true for writes
+ * @flags: REQ_* flags to propagate to the member writes
+ * @chunk_buf: Scratch buffer of SSR_CHUNK_BYTES
+ * @payload: Scratch buffer of SSR_CHUNK_BYTES
+ *
+ * Partial chunk writes read-modify-write the whole chunk.
+ *
+ * Returns a blk_status_t.
+ */
+static blk_status_t ssr_cmp_rw_chunk(struct logical_block_dev *dev, sector_t sector,
+				     unsigned int nr, char *buffer, bool write,
+				     blk_opf_t flags, char *chunk_buf, char *payload)
+{
+	unsigned long chunk = sector / SSR_CHUNK_SECTORS;
+	size_t off = (sector % SSR_CHUNK_SECTORS) * KERNEL_SECTOR_SIZE;
+	size_t len = nr * KERNEL_SECTOR_SIZE;
+	blk_status_t status = BLK_STS_OK;
+
+	if (WARN_ON_ONCE(off + len > SSR_CHUNK_BYTES))
+		return BLK_STS_IOERR;
+
+	if (!write || len != SSR_CHUNK_BYTES)
+		status = ssr_cmp_read_chunk(dev, chunk, chunk_buf, payload);
+
+	if (status != BLK_STS_OK)
+		return status;
+
+	if (!write) {
+		memcpy(buffer, chunk_buf + off, len);
+		return BLK_STS_OK;
+	}
+
+	if (buffer)
+		memcpy(chunk_buf + off, buffer, len);
+	else
+		memset(chunk_buf + off, 0, len);
+
+	return ssr_cmp_write_chunk(dev, chunk, chunk_buf, payload, flags);
+}
+
+/**
+ * ssr_cmp_rw - Handles a read or write request in compressed mode
+ * @dev: Logical device
+ * @sector: First sector of the request
+ * @nr: Number of sectors of the request
+ * @buffer: Payload of the request, NULL for write-zeroes
+ * @write: true for writes
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * Reads and writes are split at chunk boundaries by the queue limits, but
+ * write-zeroes and internal callers are not, so the request is handled
+ * chunk by chunk.
+ *
+ * Returns a blk_status_t.
+ */
+static blk_status_t ssr_cmp_rw(struct logical_block_dev *dev, sector_t sector,
+			       unsigned int nr, char *buffer, bool write, blk_opf_t flags)
+{
+	blk_status_t status = BLK_STS_OK;
+	char *chunk_buf, *payload;
+	unsigned int done, n;
+
+	chunk_buf = kmalloc(SSR_CHUNK_BYTES, GFP_NOIO);
+	payload = kmalloc(SSR_CHUNK_BYTES, GFP_NOIO);
+	if (!chunk_buf || !payload) {
+		status = BLK_STS_RESOURCE;
+		goto out;
+	}
+
+	for (done = 0; done < nr && status == BLK_STS_OK; done += n) {
+		n = min_t(unsigned int, nr - done,
+			  SSR_CHUNK_SECTORS - (sector + done) % SSR_CHUNK_SECTORS);
+		status = ssr_cmp_rw_chunk(dev, sector + done, n,
+					  buffer ? buffer + done * KERNEL_SECTOR_SIZE : NULL,
+					  write, flags, chunk_buf, payload);
+	}
+
+out:
+	kfree(payload);
+	kfree(chunk_buf);
+
+	return status;
+}
+
+/**
+ * ssr_sb_sector - Superblock sector of a member
+ * @m: Member
+ * @layout: SSR_SB_LAYOUT flags of the array
+ */
+static sector_t ssr_sb_sector(struct ssr_member *m, u64 layout)
+{
+	if (layout & SSR_SB_LOG)
+		return ssr_sb_log_sector(bdev_nr_sectors(m->bdev));
+
+	return SSR_SB_SECTOR;
+}
+
+/**
+ * ssr_sb_io - Reads or writes one superblock sector of a member
+ * @m: Member
+ * @op: REQ_OP_* and REQ_* flags
+ * @sector: Superblock sector
+ * @sb: Buffer of one sector
+ * @own: Access the member itself even if its metadata is on meta_dev
+ *
+ * An array with its metadata on meta_dev also keeps a copy of its
+ * superblock on the members, when they are large enough, so a load without
+ * meta_dev finds out where the metadata is.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_sb_io(struct ssr_member *m, blk_opf_t op, sector_t sector, void *sb, bool own)
+{
+	struct ssr_member raw = { .name = m->name, .bdev = m->bdev, .null = m->null };
+
+	if (!own || !m->meta_bdev)
+		return ssr_member_io(m, op, sector, sb, KERNEL_SECTOR_SIZE);
+
+	if (m->bdev && bdev_nr_sectors(m->bdev) <= sector)
+		return -ENOSPC;
+
+	return ssr_member_io(&raw, op, sector, sb, KERNEL_SECTOR_SIZE);
+}
+
+/**
+ * ssr_sb_write - Writes the in-memory superblock state to both members
+ * @dev: Logical device
+ *
+ * Returns 0 if at least one member was updated.
+ */
+static int ssr_sb_write(struct logical_block_dev *dev)
+{
+	struct ssr_superblock *sb;
+	int m, written = 0;
+	sector_t cursor;
+	unsigned long c;
+
+	BUILD_BUG_ON(sizeof(*sb) > KERNEL_SECTOR_SIZE);
+
+	sb = kzalloc(KERNEL_SECTOR_SIZE, GFP_NOIO);
+	if (!sb)
+		return -ENOMEM;
+
+	mutex_lock(&dev->sb_mutex);
+
+	cursor = READ_ONCE(dev->init_cursor);
+	sb->magic = cpu_to_le32(SSR_SB_MAGIC);
+	sb->version = cpu_to_le32(SSR_SB_VERSION);
+	sb->flags = cpu_to_le64(dev->sb_flags);
+	sb->init_cursor = cpu_to_le64(cursor);
+	for_each_set_bit(c, dev->init_ahead, SSR_NUM_CHUNKS)
+		sb->init_ahead[c / 8] |= BIT(c % 8);
+	if (dev->sb_flags & SSR_SB_LOG)
+		sb->log_segment_kb = cpu_to_le32(log_segment_kb);
+	sb->crc = cpu_to_le32(crc32(0, sb, KERNEL_SECTOR_SIZE));
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct ssr_member *member = &dev->members[m];
+
+		if (!ssr_sb_io(member, REQ_OP_WRITE | REQ_FUA,
+			       ssr_sb_sector(member, dev->sb_flags), sb, false))
+			written++;
+
+		if (member->meta_bdev)
+			ssr_sb_io(member, REQ_OP_WRITE | REQ_FUA, SSR_SB_SECTOR, sb, true);
+	}
+
+	if (written)
+		WRITE_ONCE(dev->init_persisted, cursor);
+
+	mutex_unlock(&dev->sb_mutex);
+	kfree(sb);
+
+	return written ? 0 : -EIO;
+}
+
+/**
+ * ssr_sb_read - Reads the superblock of the members, whatever their layout
+ * @dev: Logical device
+ * @layout: SSR_SB_LAYOUT flags the array is loaded with
+ * @sb: Buffer of one sector, receives the superblock
+ *
+ * Each layout keeps the superblock in one place: SSR_SB_SECTOR on the
+ * members, the same sector of meta_dev with a copy on the members, or the
+ * last sector of the members for the log-structured layout. The places of
+ * @layout are looked at first, then the one of the other family, so an
+ * array loaded with the wrong layout is still found. The first valid copy
+ * wins.
+ *
+ * Returns 0 if a superblock was found, -ENOENT otherwise.
+ */
+static int ssr_sb_read(struct logical_block_dev *dev, u64 layout, struct ssr_superblock *sb)
+{
+	int m, place;
+
+	for (place = 0; place < 3; place++) {
+		for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+			struct ssr_member *member = &dev->members[m];
+			bool log = !!(layout & SSR_SB_LOG) != (place == 2);
+			sector_t sector;
+			u32 crc;
+
+			/* the log-structured layout is for regular disks only */
+			if (log && (!member->bdev || ssr_member_zoned(member)))
+				continue;
+
+			/* the copy on meta_dev, for members too small for their own */
+			if (place == 1 && (log || !member->meta_bdev))
+				continue;
+
+			if (log)
+				sector = ssr_sb_log_sector(bdev_nr_sectors(member->bdev));
+			else
+				sector = SSR_SB_SECTOR;
+
+			if (ssr_sb_io(member, REQ_OP_READ, sector, sb, place != 1) ||
+			    le32_to_cpu(sb->magic) != SSR_SB_MAGIC)
+				continue;
+
+			crc = le32_to_cpu(sb->crc);
+			sb->crc = 0;
+			if (crc32(0, sb, KERNEL_SECTOR_SIZE) != crc) {
+				pr_err("ssr_sb_read: %s: bad superblock checksum\n", member->name);
+				continue;
+			}
+
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/**
+ * ssr_sb_check - Checks the array the members hold against the configuration
+ * @dev: Logical device
+ * @layout: SSR_SB_LAYOUT flags the array is loaded or created with
+ * @create: true to create a new array
+ *
+ * An array is only loaded with the layout it was created with: another one
+ * would read its data and metadata from the wrong places. A new array is
+ * only created over one the members hold if the force parameter is set.
+ * Members without a superblock are new, or hold an array that predates it.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_sb_check(struct logical_block_dev *dev, u64 layout, bool create)
+{
+	struct ssr_superblock *sb;
+	u32 segment_kb;
+	u64 flags;
+	int err;
+
+	sb = kmalloc(KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	if (!sb)
+		return -ENOMEM;
+
+	if (ssr_sb_read(dev, layout, sb)) {
+		kfree(sb);
+		return 0;
+	}
+
+	flags = le64_to_cpu(sb->flags);
+	segment_kb = flags & SSR_SB_LOG ? le32_to_cpu(sb->log_segment_kb) : 0;
+	kfree(sb);
+
+	err = -EINVAL;
+	if (create && !force) {
+		pr_err("ssr_sb_check: the members hold an array, set force=1 to overwrite it\n");
+		err = -EEXIST;
+	} else if (create && (layout & SSR_SB_LOG)) {
+		pr_err("ssr_sb_check: a log-structured array cannot be created over another one, zero the members first\n");
+	} else if (create) {
+		err = 0;
+	} else if ((flags ^ layout) & SSR_SB_COMPRESSED) {
+		pr_err("ssr_sb_check: the array was created with compress=%d\n",
+		       !!(flags & SSR_SB_COMPRESSED));
+	} else if ((flags ^ layout) & SSR_SB_META_DEV) {
+		pr_err("ssr_sb_check: the array keeps its metadata %s\n",
+		       flags & SSR_SB_META_DEV ? "on meta_dev" : "on the members");
+	} else if ((flags ^ layout) & SSR_SB_LOG ||
+		   ((layout & SSR_SB_LOG) && segment_kb != log_segment_kb)) {
+		pr_err("ssr_sb_check: the array was created with log_segment_kb=%u\n", segment_kb);
+	} else if ((flags & SSR_SB_TIERED) && !(layout & SSR_SB_TIERED)) {
+		pr_err("ssr_sb_check: the array may have extents on its fast pair, set fast_disks\n");
+	} else {
+		err = 0;
+	}
+
+	return err;
+}
+
+/**
+ * ssr_sb_init - Loads or creates the superblock
+ * @dev: Logical device
+ * @layout: SSR_SB_LAYOUT flags of the array, checked by ssr_sb_check()
+ * @create: true to create a new array instead of loading the existing one
+ *
+ * Arrays without a superblock predate it and are used as fully initialized;
+ * they get one recording their layout, and so do arrays whose superblock
+ * predates the layout flags. A new array only gets a superblock: all its
+ * sectors are marked unwritten and the background initializer fills them
+ * in. On a reload during initialization, the sectors past the cursor are
+ * marked unwritten again, except in the chunks initialized ahead of it.
+ * Creating one clears the superblock of a log-structured array the
+ * members held, so it is not found again.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_sb_init(struct logical_block_dev *dev, u64 layout, bool create)
+{
+	struct ssr_superblock *sb;
+	u64 flags = 0;
+	sector_t sector;
+	unsigned long c;
+	int m, err;
+
+	mutex_init(&dev->sb_mutex);
+	dev->sb_flags = layout;
+	dev->init_cursor = LOGICAL_DISK_SECTORS;
+	dev->init_persisted = LOGICAL_DISK_SECTORS;
+	bitmap_zero(dev->init_ahead, SSR_NUM_CHUNKS);
+
+	if (create) {
+		if (!(layout & (SSR_SB_COMPRESSED | SSR_SB_LOG))) {
+			dev->sb_flags |= SSR_SB_INITIALIZING;
+			dev->init_cursor = 0;
+			dev->init_persisted = 0;
+			bitmap_fill(dev->unwritten, LOGICAL_DISK_SECTORS);
+		}
+
+		for (m = 0; m < SSR_NUM_MEMBERS && !(layout & SSR_SB_LOG); m++) {
+			struct ssr_member *member = &dev->members[m];
+
+			if (!member->bdev || ssr_member_zoned(member))
+				continue;
+
+			/* past the metadata, unused by the other layouts */
+			sector = ssr_sb_log_sector(bdev_nr_sectors(member->bdev));
+			if (sector >= SSR_META_END)
+				blkdev_issue_zeroout(member->bdev, sector, 1, GFP_KERNEL, 0);
+		}
+
+		return ssr_sb_write(dev);
+	}
+
+	sb = kmalloc(KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	if (!sb)
+		return -ENOMEM;
+
+	err = ssr_sb_read(dev, layout, sb);
+	if (!err) {
+		flags = le64_to_cpu(sb->flags);
+		dev->sb_flags |= flags & ~SSR_SB_LAYOUT;
+	}
+
+	if (!err && (flags & SSR_SB_INITIALIZING)) {
+		dev->init_cursor = round_down(min_t(u64, le64_to_cpu(sb->init_cursor),
+						    LOGICAL_DISK_SECTORS), SSR_CHUNK_SECTORS);
+		dev->init_persisted = dev->init_cursor;
+
+		for (c = dev->init_cursor / SSR_CHUNK_SECTORS; c < SSR_NUM_CHUNKS; c++) {
+			if (sb->init_ahead[c / 8] & BIT(c % 8))
+				set_bit(c, dev->init_ahead);
+			else
+				bitmap_set(dev->unwritten, c * SSR_CHUNK_SECTORS,
+					   SSR_CHUNK_SECTORS);
+		}
+	}
+
+	kfree(sb);
+
+	if (err || flags != dev->sb_flags)
+		return ssr_sb_write(dev);
+
+	return 0;
+}
+
+/**
+ * ssr_init_fill - Makes the data and the CRCs of a chunk consistent
+ * @dev: Logical device
+ * @sector: First sector of the chunk
+ * @buffer: Scratch buffer of SSR_CHUNK_BYTES
+ * @flags: REQ_FUA or 0
+ *
+ * A chunk nobody wrote to becomes zeroes with matching CRCs and a chunk that
+ * was fully rewritten is left alone. A partially written chunk is read
+ * (uninitialized sectors read as zeroes) and written back. The caller holds
+ * the range lock of the chunk.
+ *
+ * Returns a blk_status_t.
+ */
+static blk_status_t ssr_init_fill(struct logical_block_dev *dev, sector_t sector, char *buffer,
+				  blk_opf_t flags)
+{
+	sector_t end = sector + SSR_CHUNK_SECTORS;
+	blk_status_t status;
+
+	if (find_next_zero_bit(dev->unwritten, end, sector) >= end)
+		return ssr_write_sectors(dev, sector, SSR_CHUNK_SECTORS, NULL, NULL, flags);
+
+	if (find_next_bit(dev->unwritten, end, sector) >= end)
+		return BLK_STS_OK;
+
+	status = ssr_read_sectors(dev, sector, SSR_CHUNK_SECTORS, buffer, NULL);
+	if (status == BLK_STS_OK)
+		status = ssr_write_sectors(dev, sector, SSR_CHUNK_SECTORS, buffer, NULL, flags);
+
+	return status;
+}
+
+/**
+ * ssr_init_ahead - Initializes the chunks of a write the initializer has not reached
+ * @dev: Logical device
+ * @sector: First sector of the write
+ * @nr: Number of sectors of the write
+ *
+ * A reload marks every sector past the persisted cursor unwritten, except in
+ * the chunks flagged in init_ahead of the superblock. So before the first
+ * write to a chunk past it, the chunk is filled with FUA, flagged and the
+ * superblock written; a chunk the initializer passed since the cursor was
+ * persisted only needs a flush and the flag. This costs one superblock write
+ * per chunk, and only while the array is initializing. The caller holds the
+ * range lock of the write.
+ *
+ * Returns a blk_status_t.
+ */
+static blk_status_t ssr_init_ahead(struct logical_block_dev *dev, sector_t sector,
+				   unsigned int nr)
+{
+	unsigned long c, last = (sector + nr - 1) / SSR_CHUNK_SECTORS;
+	blk_status_t status = BLK_STS_OK;
+	char *buffer = NULL;
+
+	if (!(dev->sb_flags & SSR_SB_INITIALIZING) ||
+	    sector + nr <= READ_ONCE(dev->init_persisted))
+		return BLK_STS_OK;
+
+	for (c = sector / SSR_CHUNK_SECTORS; c <= last; c++) {
+		sector_t start = c * SSR_CHUNK_SECTORS;
+
+		if (start + SSR_CHUNK_SECTORS <= READ_ONCE(dev->init_persisted) ||
+		    test_bit(c, dev->init_ahead))
+			continue;
+
+		/* the range lock keeps the initializer off the chunk */
+		if (start >= READ_ONCE(dev->init_cursor)) {
+			if (!buffer)
+				buffer = kmalloc(SSR_CHUNK_BYTES, GFP_NOIO);
+			if (!buffer) {
+				status = BLK_STS_RESOURCE;
+				break;
+			}
+
+			status = ssr_init_fill(dev, start, buffer, REQ_FUA);
+		} else {
+			/* the initializer filled it, make that stable first */
+			status = ssr_flush(dev);
+		}
+		if (status != BLK_STS_OK)
+			break;
+
+		set_bit(c, dev->init_ahead);
+		if (ssr_sb_write(dev)) {
+			clear_bit(c, dev->init_ahead);
+			status = BLK_STS_IOERR;
+			break;
+		}
+	}
+
+	kfree(buffer);
+
+	return status;
+}
+
+/**
+ * ssr_init_chunk - Initializes one chunk of a new array
+ * @dev: Logical device
+ * @sector: First sector of the chunk
+ * @buffer: Scratch buffer of SSR_CHUNK_BYTES
+ *
+ * See ssr_init_fill(). Chunks initialized ahead of the cursor are skipped.
+ */
+static void ssr_init_chunk(struct logical_block_dev *dev, sector_t sector, char *buffer)
+{
+	struct ssr_range range;
+
+	ssr_range_lock(dev, &range, sector, SSR_CHUNK_SECTORS);
+
+	if (!test_bit(sector / SSR_CHUNK_SECTORS, dev->init_ahead))
+		ssr_init_fill(dev, sector, buffer, 0);
+
+	WRITE_ONCE(dev->init_cursor, sector + SSR_CHUNK_SECTORS);
+
+	ssr_range_unlock(dev, &range);
+}
+
+/**
+ * ssr_init_worker - Background initializer of a new array
+ * @work: init_work of the logical device
+ *
+ * Every run initializes init_rate / 10 KiB and requeues itself 100 ms later,
+ * which throttles the initializer to init_rate KiB/s. The cursor is persisted
+ * in the superblock every SSR_INIT_SB_INTERVAL sectors.
+ */
+static void ssr_init_worker(struct work_struct *work)
+{
+	struct logical_block_dev *dev = container_of(to_delayed_work(work),
+						     struct logical_block_dev, init_work);
+	unsigned int chunks = max(init_rate / 10 * 1024 / SSR_CHUNK_BYTES, 1U);
+	sector_t persisted = round_down(dev->init_cursor, SSR_INIT_SB_INTERVAL);
+	char *buffer;
+
+	buffer = kmalloc(SSR_CHUNK_BYTES, GFP_NOIO);
+	if (!buffer)
+		goto requeue;
+
+	while (chunks-- && dev->init_cursor < LOGICAL_DISK_SECTORS)
+		ssr_init_chunk(dev, dev->init_cursor, buffer);
+
+	kfree(buffer);
+
+	if (dev->init_cursor >= LOGICAL_DISK_SECTORS) {
+		dev->sb_flags &= ~SSR_SB_INITIALIZING;
+		ssr_sb_write(dev);
+		pr_info("ssr_init_worker: array initialized\n");
+		ssr_event(dev, SSR_EVENT_INIT_DONE, SSR_EVENT_NO_MEMBER, 0, LOGICAL_DISK_SECTORS);
+		return;
+	}
+
+	if (round_down(dev->init_cursor, SSR_INIT_SB_INTERVAL) != persisted)
+		ssr_sb_write(dev);
+
+requeue:
+	queue_delayed_work(ssr_wq, &dev->init_work, HZ / 10);
+}
+
+/**
+ * ssr_zn_zone - Zone of a member holding a map entry
+ * @zm: Zoned state of the member
+ * @loc: Map entry, a member sector possibly tagged SSR_ZN_ZERO
+ */
+static inline unsigned int ssr_zn_zone(struct ssr_zmember *zm, sector_t loc)
+{
+	return (loc & ~SSR_ZN_ZERO) >> zm->zone_shift;
+}
+
+/**
+ * ssr_zn_report_cb - Records one zone of a member
+ * @bz: Zone reported by the member
+ * @idx: Index of the zone
+ * @data: Zoned state of the member
+ *
+ * Conventional, offline and read-only zones are not used. Zones holding
+ * data are treated as full: they are scanned, finished and only reused once
+ * the garbage collector has emptied them.
+ */
+static int ssr_zn_report_cb(struct blk_zone *bz, unsigned int idx, void *data)
+{
+	struct ssr_zmember *zm = data;
+	struct ssr_zone *z = &zm->zones[idx];
+
+	z->start = bz->start;
+	z->capacity = bz->capacity;
+	z->usable = bz->type != BLK_ZONE_TYPE_CONVENTIONAL &&
+		    bz->cond != BLK_ZONE_COND_OFFLINE &&
+		    bz->cond != BLK_ZONE_COND_READONLY;
+
+	if (!z->usable || bz->cond == BLK_ZONE_COND_FULL)
+		z->alloc = z->capacity;
+	else
+		z->alloc = bz->wp - bz->start;
+	z->full = z->alloc != 0;
+
+	return 0;
+}
+
+/**
+ * ssr_zn_apply - Applies a record found by the load scan to the map
+ * @zm: Zoned state of the member
+ * @rec: Header of the record
+ * @loc: Member sector of the header
+ *
+ * Records are found in zone order, not in write order, so a sector only
+ * follows a record newer than the one it already maps to.
+ */
+static void ssr_zn_apply(struct ssr_zmember *zm, struct ssr_zrec *rec, sector_t loc)
+{
+	bool zero = le32_to_cpu(rec->flags) & SSR_ZREC_ZERO;
+	sector_t sector = le64_to_cpu(rec->sector);
+	u64 seq = le64_to_cpu(rec->seq);
+	unsigned int i, nr = le32_to_cpu(rec->nr);
+
+	for (i = 0; i < nr && sector + i < LOGICAL_DISK_SECTORS; i++) {
+		sector_t s = sector + i;
+
+		if (zm->map[s] != SSR_ZN_UNMAPPED && zm->seqs[s] >= seq)
+			continue;
+
+		zm->map[s] = zero ? loc | SSR_ZN_ZERO : loc + 1 + i;
+		zm->crcs[s] = zero ? ssr_zero_crc : le32_to_cpu(rec->crcs[i]);
+		zm->seqs[s] = seq;
+	}
+}
+
+/**
+ * ssr_zn_scan_zone - Rebuilds the map from the records of one zone
+ * @dev: Logical device
+ * @m: Member index
+ * @zi: Zone index
+ * @rec: Scratch buffer of one sector
+ * @max_seq: Updated with the newest record found
+ *
+ * The scan stops at the write pointer or at the first header that is not
+ * intact, which is the tail of a write torn by a crash. Segments of regular
+ * members have no write pointer, their allocation is set to where the scan
+ * stopped.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_scan_zone(struct logical_block_dev *dev, int m, unsigned int zi,
+			    struct ssr_zrec *rec, u64 *max_seq)
+{
+	struct ssr_zmember *zm = &dev->zn[m];
+	struct ssr_zone *z = &zm->zones[zi];
+	sector_t loc = z->start, end = z->start + z->alloc;
+	int err;
+
+	while (loc < end) {
+		unsigned int nr;
+		u32 crc;
+
+		err = ssr_member_io(&dev->members[m], REQ_OP_READ, loc, rec,
+				    KERNEL_SECTOR_SIZE);
+		if (err)
+			return err;
+
+		crc = le32_to_cpu(rec->crc);
+		rec->crc = 0;
+		nr = le32_to_cpu(rec->nr);
+		if (le32_to_cpu(rec->magic) != SSR_ZREC_MAGIC || !nr ||
+		    nr > SSR_ZREC_SECTORS || crc32(0, rec, KERNEL_SECTOR_SIZE) != crc)
+			break;
+
+		ssr_zn_apply(zm, rec, loc);
+		*max_seq = max_t(u64, *max_seq, le64_to_cpu(rec->seq));
+
+		loc += 1;
+		if (!(le32_to_cpu(rec->flags) & SSR_ZREC_ZERO))
+			loc += nr;
+	}
+
+	if (zm->emulated)
+		z->alloc = min_t(sector_t, loc - z->start, z->capacity);
+
+	return 0;
+}
+
+/**
+ * ssr_zn_ckpt_body - Locates the arrays of the checkpoint buffer of a member
+ * @zm: Zoned state of the member
+ * @map: Output, map entries
+ * @seqs: Output, sequence numbers
+ * @crcs: Output, CRCs
+ *
+ * Returns the scan flags of the segments.
+ */
+static u8 *ssr_zn_ckpt_body(struct ssr_zmember *zm, __le64 **map, __le64 **seqs,
+			    __le32 **crcs)
+{
+	*map = zm->ckpt_buf + KERNEL_SECTOR_SIZE;
+	*seqs = *map + LOGICAL_DISK_SECTORS;
+	*crcs = (__le32 *)(*seqs + LOGICAL_DISK_SECTORS);
+
+	return (u8 *)(*crcs + LOGICAL_DISK_SECTORS);
+}
+
+/**
+ * ssr_zn_ckpt_check - Tells whether a checkpoint header is intact
+ * @zm: Zoned state of the member
+ * @hdr: Header sector, its crc field is cleared
+ */
+static bool ssr_zn_ckpt_check(struct ssr_zmember *zm, struct ssr_zckpt *hdr)
+{
+	u32 crc = le32_to_cpu(hdr->crc);
+
+	hdr->crc = 0;
+
+	return le32_to_cpu(hdr->magic) == SSR_ZCKPT_MAGIC &&
+	       le32_to_cpu(hdr->nr_zones) == zm->nr_zones &&
+	       le64_to_cpu(hdr->zone_sectors) == 1ULL << zm->zone_shift &&
+	       le64_to_cpu(hdr->seq) && crc32(0, hdr, KERNEL_SECTOR_SIZE) == crc;
+}
+
+/**
+ * ssr_zn_ckpt_read - Reads the body of a checkpoint slot
+ * @dev: Logical device
+ * @m: Member index
+ * @slot: Slot index
+ * @body_crc: Expected CRC32 of the body
+ *
+ * Returns 0 on success, -EBADMSG if the body is corrupted or another
+ * negative error code on failure.
+ */
+static int ssr_zn_ckpt_read(struct logical_block_dev *dev, int m, unsigned int slot,
+			    u32 body_crc)
+{
+	struct ssr_zmember *zm = &dev->zn[m];
+	sector_t start = zm->ckpt_start + slot * zm->ckpt_sectors + 1;
+	char *body = zm->ckpt_buf + KERNEL_SECTOR_SIZE;
+	sector_t done, nr;
+	int err;
+
+	for (done = 0; done < zm->ckpt_sectors - 1; done += nr) {
+		nr = min_t(sector_t, zm->ckpt_sectors - 1 - done, SSR_ZCKPT_IO_SECTORS);
+		err = ssr_member_io(&dev->members[m], REQ_OP_READ, start + done,
+				    body + done * KERNEL_SECTOR_SIZE, nr * KERNEL_SECTOR_SIZE);
+		if (err)
+			return err;
+	}
+
+	if (crc32(0, body, ssr_zckpt_body_len(zm->nr_zones)) != body_crc)
+		return -EBADMSG;
+
+	return 0;
+}
+
+/**
+ * ssr_zn_ckpt_load - Loads the newest intact checkpoint of a regular member
+ * @dev: Logical device
+ * @m: Member index
+ * @max_seq: Updated with the newest sequence number of the map
+ *
+ * Falls back to the older slot if the body of the newer one is corrupted.
+ * The next checkpoint goes to the other slot than the loaded one.
+ *
+ * Returns the scan flags of the segments, NULL if no checkpoint was found
+ * or an ERR_PTR() on failure.
+ */
+static u8 *ssr_zn_ckpt_load(struct logical_block_dev *dev, int m, u64 *max_seq)
+{
+	struct ssr_zmember *zm = &dev->zn[m];
+	struct ssr_zckpt *hdr = zm->ckpt_buf;
+	u64 seqs[SSR_ZCKPT_SLOTS] = {};
+	u32 body_crcs[SSR_ZCKPT_SLOTS];
+	__le64 *map, *seq;
+	unsigned int i, slot;
+	sector_t s;
+	__le32 *crcs;
+	u8 *scan;
+	int err;
+
+	for (slot = 0; slot < SSR_ZCKPT_SLOTS; slot++) {
+		err = ssr_member_io(&dev->members[m], REQ_OP_READ,
+				    zm->ckpt_start + slot * zm->ckpt_sectors, hdr,
+				    KERNEL_SECTOR_SIZE);
+		if (err)
+			return ERR_PTR(err);
+
+		if (ssr_zn_ckpt_check(zm, hdr)) {
+			seqs[slot] = le64_to_cpu(hdr->seq);
+			body_crcs[slot] = le32_to_cpu(hdr->body_crc);
+			zm->ckpt_seq = max_t(u64, zm->ckpt_seq, seqs[slot]);
+		}
+	}
+
+	for (i = 0; i < SSR_ZCKPT_SLOTS; i++) {
+		slot = (seqs[1] > seqs[0]) ^ i;
+		if (!seqs[slot])
+			continue;
+
+		err = ssr_zn_ckpt_read(dev, m, slot, body_crcs[slot]);
+		if (err == -EBADMSG) {
+			pr_err("ssr_zn_ckpt_load: %s: checkpoint %llu is corrupted\n",
+			       dev->members[m].name, (unsigned long long)seqs[slot]);
+			continue;
+		}
+		if (err)
+			return ERR_PTR(err);
+
+		scan = ssr_zn_ckpt_body(zm, &map, &seq, &crcs);
+		for (s = 0; s < LOGICAL_DISK_SECTORS; s++) {
+			zm->map[s] = le64_to_cpu(map[s]);
+			zm->seqs[s] = le64_to_cpu(seq[s]);
+			zm->crcs[s] = le32_to_cpu(crcs[s]);
+			*max_seq = max_t(u64, *max_seq, zm->seqs[s]);
+		}
+
+		zm->ckpt_slot = (slot + 1) % SSR_ZCKPT_SLOTS;
+
+		return scan;
+	}
+
+	return NULL;
+}
+
+/**
+ * ssr_zn_emulate - Lays out the segments and the checkpoint slots of a member
+ * @dev: Logical device
+ * @m: Member index
+ *
+ * Segments of log_segment_kb stand in for zones, the checkpoint slots take
+ * the end of the member. Their size is derived from the number of segments
+ * before the slots are taken out, so it only depends on the capacity.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_emulate(struct logical_block_dev *dev, int m)
+{
+	struct ssr_member *member = &dev->members[m];
+	struct ssr_zmember *zm = &dev->zn[m];
+	sector_t capacity = bdev_nr_sectors(member->bdev);
+	sector_t slots;
+
+	if (!is_power_of_2(log_segment_kb) || log_segment_kb < 256) {
+		pr_err("log_segment_kb: %u is not a power of two of at least 256\n",
+		       log_segment_kb);
+		return -EINVAL;
+	}
+
+	zm->emulated = true;
+	zm->zone_shift = ilog2(log_segment_kb * 2);
+	zm->ckpt_sectors = 1 + DIV_ROUND_UP(ssr_zckpt_body_len(capacity >> zm->zone_shift),
+					    KERNEL_SECTOR_SIZE);
+
+	/* plus the superblock, see ssr_sb_log_sector() */
+	slots = SSR_ZCKPT_SLOTS * zm->ckpt_sectors + 1;
+	if (capacity <= slots) {
+		pr_err("ssr_zn_init: %s: too small for the checkpoints\n", member->name);
+		return -ENOSPC;
+	}
+
+	zm->nr_zones = (capacity - slots) >> zm->zone_shift;
+	zm->ckpt_start = (sector_t)zm->nr_zones << zm->zone_shift;
+	mutex_init(&zm->append_mutex);
+	dev->zn_emulated = true;
+
+	zm->ckpt_buf = kvzalloc(zm->ckpt_sectors * KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	if (!zm->ckpt_buf)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/**
+ * ssr_zn_init_member - Loads the zones and the map of one member
+ * @dev: Logical device
+ * @m: Member index
+ * @rec: Scratch buffer of one sector
+ * @max_seq: Updated with the newest record found
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_init_member(struct logical_block_dev *dev, int m,
+			      struct ssr_zrec *rec, u64 *max_seq)
+{
+	struct ssr_member *member = &dev->members[m];
+	struct block_device *bdev = member->bdev;
+	struct ssr_zmember *zm = &dev->zn[m];
+	sector_t zone_sectors, s, usable = 0;
+	u8 *scan = NULL;
+	unsigned int i;
+	int err;
+
+	if (!bdev) {
+		pr_err("ssr_zn_init: built-in members cannot use the log-structured layout\n");
+		return -EINVAL;
+	}
+
+	if (bdev_is_zoned(bdev)) {
+		if (bdev_max_zone_append_sectors(bdev) < 1 + SSR_ZREC_SECTORS) {
+			pr_err("ssr_zn_init: %s: zone append limit too small\n", member->name);
+			return -EINVAL;
+		}
+
+		zm->nr_zones = bdev_nr_zones(bdev);
+		zm->zone_shift = ilog2(bdev_zone_sectors(bdev));
+	} else if (log_segment_kb) {
+		err = ssr_zn_emulate(dev, m);
+		if (err)
+			return err;
+	} else {
+		pr_err("ssr_zn_init: %s: members must be all zoned or all regular\n",
+		       member->name);
+		return -EINVAL;
+	}
+
+	zone_sectors = 1ULL << zm->zone_shift;
+	zm->open = zm->nr_zones;
+
+	zm->zones = kvcalloc(zm->nr_zones, sizeof(*zm->zones), GFP_KERNEL);
+	zm->map = kvmalloc_array(LOGICAL_DISK_SECTORS, sizeof(*zm->map), GFP_KERNEL);
+	zm->crcs = kvcalloc(LOGICAL_DISK_SECTORS, sizeof(*zm->crcs), GFP_KERNEL);
+	zm->seqs = kvcalloc(LOGICAL_DISK_SECTORS, sizeof(*zm->seqs), GFP_KERNEL);
+	if (!zm->zones || !zm->map || !zm->crcs || !zm->seqs)
+		return -ENOMEM;
+
+	memset(zm->map, 0xff, LOGICAL_DISK_SECTORS * sizeof(*zm->map));
+
+	if (zm->emulated) {
+		scan = ssr_zn_ckpt_load(dev, m, max_seq);
+		if (IS_ERR(scan)) {
+			pr_err("ssr_zn_init: %s: checkpoint read failed\n", member->name);
+			return PTR_ERR(scan);
+		}
+
+		/* every segment is scanned unless the checkpoint covers it */
+		for (i = 0; i < zm->nr_zones; i++) {
+			struct ssr_zone *z = &zm->zones[i];
+
+			z->start = (sector_t)i << zm->zone_shift;
+			z->capacity = zone_sectors;
+			z->alloc = zone_sectors;
+			z->usable = true;
+			z->full = true;
+		}
+	} else {
+		err = blkdev_report_zones(bdev, 0, zm->nr_zones, ssr_zn_report_cb, zm);
+		if (err < 0) {
+			pr_err("blkdev_report_zones: failure\n");
+			return err;
+		}
+	}
+
+	for (i = 0; i < zm->nr_zones; i++) {
+		struct ssr_zone *z = &zm->zones[i];
+
+		if (!z->usable)
+			continue;
+
+		usable += z->capacity;
+
+		if (!z->full) {
+			zm->nr_free++;
+			continue;
+		}
+
+		if (scan && !scan[i])
+			continue;
+
+		err = ssr_zn_scan_zone(dev, m, i, rec, max_seq);
+		if (err) {
+			pr_err("ssr_zn_init: %s: scan of zone %u failed\n", member->name, i);
+			return err;
+		}
+
+		/* the tail of a segment is not reused before the segment is reset */
+		if (zm->emulated) {
+			if (z->alloc) {
+				z->alloc = z->capacity;
+			} else {
+				z->full = false;
+				zm->nr_free++;
+			}
+			continue;
+		}
+
+		if (z->alloc < z->capacity) {
+			err = blkdev_zone_mgmt(bdev, REQ_OP_ZONE_FINISH, z->start, zone_sectors);
+			if (err)
+				return err;
+			z->alloc = z->capacity;
+		}
+	}
+
+	if (usable < SSR_ZN_MIN_SECTORS(zone_sectors)) {
+		pr_err("ssr_zn_init: %s: %llu usable sectors, %llu needed\n", member->name,
+		       (unsigned long long)usable,
+		       (unsigned long long)SSR_ZN_MIN_SECTORS(zone_sectors));
+		return -ENOSPC;
+	}
+
+	for (s = 0; s < LOGICAL_DISK_SECTORS; s++)
+		if (zm->map[s] != SSR_ZN_UNMAPPED)
+			zm->zones[ssr_zn_zone(zm, zm->map[s])].valid++;
+
+	return 0;
+}
+
+/**
+ * ssr_zn_free - Releases the zoned state of a logical device
+ * @dev: Logical device
+ */
+static void ssr_zn_free(struct logical_block_dev *dev)
+{
+	int m;
+
+	if (!dev->zn)
+		return;
+
+	cancel_work_sync(&dev->zn_gc_work);
+	cancel_delayed_work_sync(&dev->zn_ckpt_work);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		kvfree(dev->zn[m].ckpt_buf);
+		kvfree(dev->zn[m].zones);
+		kvfree(dev->zn[m].map);
+		kvfree(dev->zn[m].crcs);
+		kvfree(dev->zn[m].seqs);
+	}
+
+	kfree(dev->zn);
+	dev->zn = NULL;
+}
+
+static void ssr_zn_gc_worker(struct work_struct *work);
+static void ssr_zn_ckpt_worker(struct work_struct *work);
+
+/**
+ * ssr_zn_init - Sets up the log-structured layout
+ * @dev: Logical device
+ *
+ * The in-memory map of each zoned member is rebuilt by scanning the record
+ * headers of its zones, so nothing but the records is ever written. Regular
+ * members also checkpoint their map periodically, so only the segments
+ * written since the last checkpoint are scanned.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_init(struct logical_block_dev *dev)
+{
+	struct ssr_zrec *rec;
+	u64 max_seq = 0;
+	int m, err;
+
+	spin_lock_init(&dev->zn_lock);
+	init_waitqueue_head(&dev->zn_wait);
+	init_rwsem(&dev->zn_reset_sem);
+	INIT_WORK(&dev->zn_gc_work, ssr_zn_gc_worker);
+	mutex_init(&dev->zn_ckpt_mutex);
+	INIT_DELAYED_WORK(&dev->zn_ckpt_work, ssr_zn_ckpt_worker);
+	dev->zn_emulated = false;
+
+	dev->zn = kcalloc(SSR_NUM_MEMBERS, sizeof(*dev->zn), GFP_KERNEL);
+	rec = kmalloc(KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	if (!dev->zn || !rec) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		err = ssr_zn_init_member(dev, m, rec, &max_seq);
+		if (err)
+			goto out_free;
+	}
+
+	atomic64_set(&dev->zn_seq, max_seq);
+	kfree(rec);
+
+	/* the first run checkpoints what the load scan found */
+	dev->zn_ckpt_at = U64_MAX;
+	if (dev->zn_emulated)
+		queue_delayed_work(ssr_wq, &dev->zn_ckpt_work,
+				   max_t(unsigned int, log_checkpoint_s, 1) * HZ);
+
+	return 0;
+
+out_free:
+	kfree(rec);
+	ssr_zn_free(dev);
+	return err;
+}
+
+/**
+ * ssr_zn_alloc - Reserves room for a record in the open zone of a member
+ * @dev: Logical device
+ * @zm: Zoned state of the member
+ * @len: Size of the record in sectors
+ * @gc: Whether the garbage collector allocates, which may use the reserve
+ * @zi: Output, zone the record goes to
+ * @pos: Output, start of the reserved room
+ * @finish: Output, set to a zone left behind that must be finished
+ *
+ * Zone append places the record anywhere below the reserved room, so
+ * concurrent appends to the open zone never overflow it. Segments of
+ * regular members are written at @pos instead.
+ *
+ * Returns 0 on success or -ENOSPC if no zone is free.
+ */
+static int ssr_zn_alloc(struct logical_block_dev *dev, struct ssr_zmember *zm,
+			unsigned int len, bool gc, unsigned int *zi, sector_t *pos,
+			unsigned int *finish)
+{
+	struct ssr_zone *z;
+	unsigned int i;
+
+	spin_lock(&dev->zn_lock);
+
+	if (zm->open < zm->nr_zones) {
+		z = &zm->zones[zm->open];
+		if (z->alloc + len <= z->capacity)
+			goto found;
+
+		z->full = true;
+		if (!z->inflight && z->alloc < z->capacity) {
+			/* held until finished, so the collector leaves it alone */
+			z->alloc = z->capacity;
+			z->inflight++;
+			*finish = zm->open;
+		}
+		zm->open = zm->nr_zones;
+	}
+
+	if (zm->nr_free <= (gc ? 0 : SSR_ZN_GC_RESERVE)) {
+		spin_unlock(&dev->zn_lock);
+		queue_work(ssr_wq, &dev->zn_gc_work);
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < zm->nr_zones; i++) {
+		z = &zm->zones[i];
+		if (z->usable && !z->full && !z->alloc)
+			break;
+	}
+
+	zm->nr_free--;
+	zm->open = i;
+	if (zm->nr_free <= SSR_ZN_GC_LOW)
+		queue_work(ssr_wq, &dev->zn_gc_work);
+
+found:
+	*pos = z->start + z->alloc;
+	z->alloc += len;
+	z->inflight++;
+	*zi = zm->open;
+
+	spin_unlock(&dev->zn_lock);
+
+	return 0;
+}
+
+/**
+ * ssr_zn_put - Drops the reference an append or a finish holds on a zone
+ * @dev: Logical device
+ * @zm: Zoned state of the member
+ * @zi: Zone index
+ * @failed: Whether the append failed, leaving the write pointer unknown
+ *
+ * Returns a zone that must now be finished, or nr_zones.
+ */
+static unsigned int ssr_zn_put(struct logical_block_dev *dev, struct ssr_zmember *zm,
+			       unsigned int zi, bool failed)
+{
+	struct ssr_zone *z = &zm->zones[zi];
+	unsigned int finish = zm->nr_zones;
+
+	spin_lock(&dev->zn_lock);
+
+	z->inflight--;
+
+	if (failed && !z->full) {
+		z->full = true;
+		if (zm->open == zi)
+			zm->open = zm->nr_zones;
+	}
+
+	if (z->full && !z->inflight && z->alloc < z->capacity) {
+		z->alloc = z->capacity;
+		z->inflight++;
+		finish = zi;
+	}
+
+	spin_unlock(&dev->zn_lock);
+
+	return finish;
+}
+
+/**
+ * ssr_zn_finish - Finishes a zone that will not be appended to anymore
+ * @dev: Logical device
+ * @m: Member index
+ * @zi: Zone index, nr_zones for none
+ *
+ * A partially written zone stays open on the member otherwise and counts
+ * against its open and active zone limits. Segments of regular members
+ * have no state on the member.
+ */
+static void ssr_zn_finish(struct logical_block_dev *dev, int m, unsigned int zi)
+{
+	struct ssr_zmember *zm = &dev->zn[m];
+	int err;
+
+	if (zi >= zm->nr_zones)
+		return;
+
+	if (!zm->emulated) {
+		err = blkdev_zone_mgmt(dev->members[m].bdev, REQ_OP_ZONE_FINISH,
+				       zm->zones[zi].start, 1ULL << zm->zone_shift);
+		if (err)
+			pr_err("ssr_zn_finish: %s: zone %u (%d)\n",
+			       dev->members[m].name, zi, err);
+	}
+
+	spin_lock(&dev->zn_lock);
+	zm->zones[zi].inflight--;
+	spin_unlock(&dev->zn_lock);
+}
+
+/**
+ * ssr_zn_append - Appends a record to a member with zone append
+ * @dev: Logical device
+ * @m: Member index
+ * @rec: Header sector of the record, filled in except for its CRC
+ * @data: Payload of the record, NULL for a record without data
+ * @flags: REQ_* flags to propagate to the member write
+ * @gc: Whether the garbage collector appends
+ * @loc: Output, member sector the header was written to
+ *
+ * Writers wait for the garbage collector when no zone is free; the collector
+ * itself uses the reserved zones and fails instead. On success the zone
+ * stays referenced until ssr_zn_commit(), so a checkpoint never misses a
+ * record the map does not point to yet.
+ *
+ * Appends to a segment of a regular member are plain writes, serialized so
+ * they reach it in order: the load scan stops at the first hole, and a
+ * record made durable by a FUA write must not follow one that is not.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_append(struct logical_block_dev *dev, int m, struct ssr_zrec *rec,
+			 char *data, blk_opf_t flags, bool gc, sector_t *loc)
+{
+	struct ssr_member *member = &dev->members[m];
+	struct ssr_zmember *zm = &dev->zn[m];
+	size_t len = data ? le32_to_cpu(rec->nr) * KERNEL_SECTOR_SIZE : 0;
+	unsigned int zi, finish;
+	struct bio *bio;
+	sector_t pos;
+	int err;
+
+	rec->crc = 0;
+	rec->crc = cpu_to_le32(crc32(0, rec, KERNEL_SECTOR_SIZE));
+
+	if (zm->emulated)
+		mutex_lock(&zm->append_mutex);
+
+	for (;;) {
+		finish = zm->nr_zones;
+		err = ssr_zn_alloc(dev, zm, 1 + len / KERNEL_SECTOR_SIZE, gc, &zi, &pos,
+				   &finish);
+		ssr_zn_finish(dev, m, finish);
+		if (err != -ENOSPC || gc)
+			break;
+
+		if (zm->emulated)
+			mutex_unlock(&zm->append_mutex);
+		wait_event_timeout(dev->zn_wait,
+				   READ_ONCE(zm->nr_free) > SSR_ZN_GC_RESERVE, HZ);
+		if (zm->emulated)
+			mutex_lock(&zm->append_mutex);
+	}
+
+	if (err)
+		goto out_unlock;
+
+	if (zm->emulated) {
+		if (flags & REQ_FUA)
+			flags |= REQ_PREFLUSH;
+		bio = bio_alloc(member->bdev,
+				1 + DIV_ROUND_UP(offset_in_page(data) + len, PAGE_SIZE),
+				REQ_OP_WRITE | flags, GFP_NOIO);
+		bio->bi_iter.bi_sector = pos;
+	} else {
+		bio = bio_alloc(member->bdev,
+				1 + DIV_ROUND_UP(offset_in_page(data) + len, PAGE_SIZE),
+				REQ_OP_ZONE_APPEND | flags, GFP_NOIO);
+		bio->bi_iter.bi_sector = zm->zones[zi].start;
+	}
+	ssr_bio_add_buf(bio, rec, KERNEL_SECTOR_SIZE);
+	if (data)
+		ssr_bio_add_buf(bio, data, len);
+
+	err = submit_bio_wait(bio);
+	if (!err)
+		*loc = zm->emulated ? pos : bio->bi_iter.bi_sector;
+	bio_put(bio);
+
+	if (err)
+		ssr_zn_finish(dev, m, ssr_zn_put(dev, zm, zi, true));
+
+out_unlock:
+	if (zm->emulated)
+		mutex_unlock(&zm->append_mutex);
+	return err;
+}
+
+/**
+ * ssr_zn_commit - Points the map of a member at an appended record
+ * @dev: Logical device
+ * @m: Member index
+ * @rec: Header of the record
+ * @loc: Member sector of the header
+ * @expect: For the garbage collector, the entries the sectors must still
+ *	    have, since a newer write wins over a relocation; NULL otherwise
+ *
+ * Drops the reference ssr_zn_append() left on the zone of the record.
+ */
+static void ssr_zn_commit(struct logical_block_dev *dev, int m, struct ssr_zrec *rec,
+			  sector_t loc, const sector_t *expect)
+{
+	struct ssr_zmember *zm = &dev->zn[m];
+	bool zero = le32_to_cpu(rec->flags) & SSR_ZREC_ZERO;
+	sector_t sector = le64_to_cpu(rec->sector);
+	unsigned int i, nr = le32_to_cpu(rec->nr);
+
+	spin_lock(&dev->zn_lock);
+
+	for (i = 0; i < nr; i++) {
+		sector_t s = sector + i, old = zm->map[s];
+
+		if (expect && old != expect[i])
+			continue;
+
+		if (old != SSR_ZN_UNMAPPED)
+			zm->zones[ssr_zn_zone(zm, old)].valid--;
+
+		zm->map[s] = zero ? loc | SSR_ZN_ZERO : loc + 1 + i;
+		zm->crcs[s] = zero ? ssr_zero_crc : le32_to_cpu(rec->crcs[i]);
+		zm->seqs[s] = le64_to_cpu(rec->seq);
+		zm->zones[ssr_zn_zone(zm, loc)].valid++;
+	}
+
+	spin_unlock(&dev->zn_lock);
+
+	ssr_zn_finish(dev, m, ssr_zn_put(dev, zm, ssr_zn_zone(zm, loc), false));
+}
+
+/**
+ * ssr_zn_write_member - Writes a range of sectors to one zoned member
+ * @dev: Logical device
+ * @m: Member index
+ * @sector: First sector of the range
+ * @nr: Number of sectors in the range
+ * @data: Payload of the range, NULL to write zeroes
+ * @sums: CRC32 of each sector of @data
+ * @seq: Sequence number of the write
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_write_member(struct logical_block_dev *dev, int m, sector_t sector,
+			       unsigned int nr, char *data, const u32 *sums, u64 seq,
+			       blk_opf_t flags)
+{
+	struct ssr_zrec *rec;
+	unsigned int done, n, i;
+	sector_t loc;
+	int err = 0;
+
+	rec = kmalloc(KERNEL_SECTOR_SIZE, GFP_NOIO);
+	if (!rec)
+		return -ENOMEM;
+
+	for (done = 0; done < nr; done += n) {
+		n = min_t(unsigned int, nr - done, SSR_ZREC_SECTORS);
+
+		memset(rec, 0, KERNEL_SECTOR_SIZE);
+		rec->magic = cpu_to_le32(SSR_ZREC_MAGIC);
+		rec->flags = cpu_to_le32(data ? 0 : SSR_ZREC_ZERO);
+		rec->seq = cpu_to_le64(seq);
+		rec->sector = cpu_to_le64(sector + done);
+		rec->nr = cpu_to_le32(n);
+		if (data)
+			for (i = 0; i < n; i++)
+				rec->crcs[i] = cpu_to_le32(sums[done + i]);
+
+		err = ssr_zn_append(dev, m, rec,
+				    data ? data + done * KERNEL_SECTOR_SIZE : NULL,
+				    flags, false, &loc);
+		if (err)
+			break;
+
+		ssr_zn_commit(dev, m, rec, loc, NULL);
+	}
+
+	kfree(rec);
+
+	return err;
+}
+
+/**
+ * ssr_zn_write - Writes a range of sectors to both zoned members
+ * @dev: Logical device
+ * @sector: First sector of the range
+ * @nr: Number of sectors in the range
+ * @data: Payload of the range, NULL to write zeroes
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * All-zero ranges are written as records without data.
+ *
+ * Returns a blk_status_t: success if at least one member was written.
+ */
+static blk_status_t ssr_zn_write(struct logical_block_dev *dev, sector_t sector,
+				 unsigned int nr, char *data, blk_opf_t flags)
+{
+	u64 seq = atomic64_inc_return(&dev->zn_seq);
+	bool zero = true;
+	int m, err, written = 0;
+	u32 *sums;
+
+	sums = kmalloc_array(nr, sizeof(*sums), GFP_NOIO);
+	if (!sums)
+		return BLK_STS_RESOURCE;
+
+	if (data)
+		zero = ssr_core_sums(data, nr, sums, ssr_zero_crc);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		err = ssr_zn_write_member(dev, m, sector, nr, zero ? NULL : data, sums,
+					  seq, flags);
+		if (err) {
+			pr_err("ssr_zn_write: %s: write of sector %llu failed (%d)\n",
+			       dev->members[m].name, (unsigned long long)sector, err);
+			ssr_member_failed(dev, m, sector, nr);
+			continue;
+		}
+
+		written++;
+	}
+
+	kfree(sums);
+
+	return written ? BLK_STS_OK : BLK_STS_IOERR;
+}
+
+/**
+ * ssr_zn_read_member - Reads the current copy of a range from one member
+ * @dev: Logical device
+ * @m: Member index
+ * @locs: Map entries of the range
+ * @nr: Number of sectors in the range
+ * @buf: Output buffer of @nr sectors
+ *
+ * Sectors that are contiguous on the member are read with one request;
+ * unmapped sectors and tombstones read as zeroes.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_read_member(struct logical_block_dev *dev, int m, const sector_t *locs,
+			      unsigned int nr, char *buf)
+{
+	unsigned int i, j;
+	int err;
+
+	for (i = 0; i < nr; i = j) {
+		j = i + 1;
+
+		/* SSR_ZN_UNMAPPED has the SSR_ZN_ZERO bit set as well */
+		if (locs[i] & SSR_ZN_ZERO) {
+			memset(buf + i * KERNEL_SECTOR_SIZE, 0, KERNEL_SECTOR_SIZE);
+			continue;
+		}
+
+		while (j < nr && locs[j] == locs[i] + (j - i))
+			j++;
+
+		err = ssr_member_io(&dev->members[m], REQ_OP_READ, locs[i],
+				    buf + i * KERNEL_SECTOR_SIZE, (j - i) * KERNEL_SECTOR_SIZE);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+/**
+ * ssr_zn_read - Reads a range of sectors from zoned members, verifying it
+ * @dev: Logical device
+ * @sector: First sector of the range
+ * @nr: Number of sectors in the range
+ * @out: Buffer receiving the verified payload
+ *
+ * Same policy as ssr_read_sectors(), with the CRCs taken from the in-memory
+ * map. A member holding a corrupted copy gets the range appended again.
+ * Zone resets wait for the reads of the zone, so the map entries taken
+ * under zn_reset_sem stay readable.
+ *
+ * Returns a blk_status_t: an error if a sector is corrupted on both members.
+ */
+static blk_status_t ssr_zn_read(struct logical_block_dev *dev, sector_t sector,
+				unsigned int nr, char *out)
+{
+	size_t len = nr * KERNEL_SECTOR_SIZE;
+	size_t crc_len = ssr_crc_window_len(sector, nr);
+	char *data[SSR_NUM_MEMBERS] = { NULL };
+	__le32 *crcs[SSR_NUM_MEMBERS] = { NULL };
+	sector_t *locs[SSR_NUM_MEMBERS] = { NULL };
+	bool valid[SSR_NUM_MEMBERS], dirty[SSR_NUM_MEMBERS] = { false };
+	blk_status_t status = BLK_STS_OK;
+	int m, primary = -1;
+	unsigned int i;
+	u32 *sums = NULL;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		data[m] = kmalloc(len, GFP_NOIO);
+		crcs[m] = kmalloc(crc_len, GFP_NOIO);
+		locs[m] = kmalloc_array(nr, sizeof(*locs[m]), GFP_NOIO);
+		if (!data[m] || !crcs[m] || !locs[m]) {
+			status = BLK_STS_RESOURCE;
+			goto out;
+		}
+	}
+
+	down_read(&dev->zn_reset_sem);
+
+	spin_lock(&dev->zn_lock);
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct ssr_zmember *zm = &dev->zn[m];
+
+		for (i = 0; i < nr; i++) {
+			sector_t s = sector + i;
+
+			locs[m][i] = zm->map[s];
+			*ssr_crc_slot(crcs[m], sector, s) = cpu_to_le32(zm->map[s] == SSR_ZN_UNMAPPED ?
+									ssr_zero_crc : zm->crcs[s]);
+		}
+	}
+	spin_unlock(&dev->zn_lock);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		valid[m] = !ssr_zn_read_member(dev, m, locs[m], nr, data[m]);
+		if (!valid[m]) {
+			pr_err("ssr_zn_read: %s: read of sector %llu failed\n",
+			       dev->members[m].name, (unsigned long long)sector);
+			ssr_member_failed(dev, m, sector, nr);
+		} else if (primary < 0) {
+			primary = m;
+		}
+	}
+
+	up_read(&dev->zn_reset_sem);
+
+	if (primary < 0) {
+		status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (ssr_core_verify_sector(data, crcs, valid, sector, sector + i, dirty) >= 0)
+			continue;
+
+		pr_err("ssr_zn_read: sector %llu is corrupted on all members\n",
+		       (unsigned long long)(sector + i));
+		ssr_event(dev, SSR_EVENT_UNRECOVERABLE, SSR_EVENT_NO_MEMBER, sector + i, 1);
+		status = BLK_STS_IOERR;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (!dirty[m])
+			continue;
+
+		if (!sums) {
+			sums = kmalloc_array(nr, sizeof(*sums), GFP_NOIO);
+			if (!sums)
+				break;
+		}
+
+		pr_info("ssr_zn_read: %s: repairing sectors %llu-%llu\n", dev->members[m].name,
+			(unsigned long long)sector, (unsigned long long)(sector + nr - 1));
+
+		for (i = 0; i < nr; i++)
+			sums[i] = le32_to_cpu(*ssr_crc_slot(crcs[m], sector, sector + i));
+
+		if (ssr_zn_write_member(dev, m, sector, nr, data[m], sums,
+					atomic64_inc_return(&dev->zn_seq), 0)) {
+			pr_err("ssr_zn_read: %s: repair failed\n", dev->members[m].name);
+			ssr_member_failed(dev, m, sector, nr);
+		} else {
+			ssr_event(dev, SSR_EVENT_REPAIRED, m, sector, nr);
+		}
+	}
+
+	if (status == BLK_STS_OK)
+		memcpy(out, data[primary], len);
+
+out:
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		kfree(data[m]);
+		kfree(crcs[m]);
+		kfree(locs[m]);
+	}
+	kfree(sums);
+
+	return status;
+}
+
+/**
+ * ssr_zn_victim - Picks the zone of a member the garbage collector empties
+ * @dev: Logical device
+ * @zm: Zoned state of the member
+ *
+ * Returns the full zone with the fewest live sectors, or nr_zones if no zone
+ * can be emptied without filling a whole zone with its live data.
+ */
+static unsigned int ssr_zn_victim(struct logical_block_dev *dev, struct ssr_zmember *zm)
+{
+	unsigned int i, victim = zm->nr_zones;
+	struct ssr_zone *z;
+
+	spin_lock(&dev->zn_lock);
+
+	for (i = 0; i < zm->nr_zones; i++) {
+		z = &zm->zones[i];
+		if (!z->usable || !z->full || z->inflight)
+			continue;
+		if (victim == zm->nr_zones || z->valid < zm->zones[victim].valid)
+			victim = i;
+	}
+
+	if (victim < zm->nr_zones) {
+		z = &zm->zones[victim];
+		if (z->valid + DIV_ROUND_UP(z->valid, SSR_ZREC_SECTORS) >= z->capacity)
+			victim = zm->nr_zones;
+	}
+
+	spin_unlock(&dev->zn_lock);
+
+	return victim;
+}
+
+/**
+ * ssr_zn_evacuate - Relocates the live sectors of a zone
+ * @dev: Logical device
+ * @m: Member index
+ * @victim: Zone to empty
+ * @rec: Scratch buffer of one sector
+ * @buf: Scratch buffer of SSR_ZREC_SECTORS sectors
+ *
+ * Runs of sectors written by the same record are appended again with their
+ * original sequence number and CRCs, so a relocation never wins over a newer
+ * write at the next load and a corrupted copy stays detectable. Tombstones
+ * are relocated as well, or older data would come back after the reset.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_evacuate(struct logical_block_dev *dev, int m, unsigned int victim,
+			   struct ssr_zrec *rec, char *buf)
+{
+	struct ssr_zmember *zm = &dev->zn[m];
+	sector_t expect[SSR_ZREC_SECTORS];
+	sector_t s = 0, loc;
+	unsigned int n;
+	bool zero;
+	int err;
+
+	while (s < LOGICAL_DISK_SECTORS) {
+		spin_lock(&dev->zn_lock);
+
+		loc = zm->map[s];
+		if (loc == SSR_ZN_UNMAPPED || ssr_zn_zone(zm, loc) != victim) {
+			spin_unlock(&dev->zn_lock);
+			if (!(++s % SSR_CHUNK_SECTORS))
+				cond_resched();
+			continue;
+		}
+
+		zero = loc & SSR_ZN_ZERO;
+
+		memset(rec, 0, KERNEL_SECTOR_SIZE);
+		rec->magic = cpu_to_le32(SSR_ZREC_MAGIC);
+		rec->flags = cpu_to_le32(zero ? SSR_ZREC_ZERO : 0);
+		rec->seq = cpu_to_le64(zm->seqs[s]);
+		rec->sector = cpu_to_le64(s);
+
+		for (n = 0; n < SSR_ZREC_SECTORS && s + n < LOGICAL_DISK_SECTORS; n++) {
+			if (zm->seqs[s + n] != zm->seqs[s] ||
+			    zm->map[s + n] != (zero ? loc : loc + n))
+				break;
+			expect[n] = zm->map[s + n];
+			rec->crcs[n] = cpu_to_le32(zm->crcs[s + n]);
+		}
+		rec->nr = cpu_to_le32(n);
+
+		spin_unlock(&dev->zn_lock);
+
+		if (!zero) {
+			err = ssr_member_io(&dev->members[m], REQ_OP_READ, loc, buf,
+					    n * KERNEL_SECTOR_SIZE);
+			if (err)
+				return err;
+		}
+
+		err = ssr_zn_append(dev, m, rec, zero ? NULL : buf, 0, true, &loc);
+		if (err)
+			return err;
+
+		ssr_zn_commit(dev, m, rec, loc, expect);
+		s += n;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/**
+ * ssr_zn_reset - Resets an emptied zone and makes it free again
+ * @dev: Logical device
+ * @m: Member index
+ * @zi: Zone index
+ *
+ * A segment of a regular member is reset by zeroing its first header, which
+ * ends the load scan there. Older records further in keep their sequence
+ * numbers and never win over the map.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_reset(struct logical_block_dev *dev, int m, unsigned int zi)
+{
+	struct ssr_zmember *zm = &dev->zn[m];
+	struct ssr_zone *z = &zm->zones[zi];
+	int err;
+
+	spin_lock(&dev->zn_lock);
+	err = z->valid ? -EBUSY : 0;
+	spin_unlock(&dev->zn_lock);
+	if (err)
+		return err;
+
+	down_write(&dev->zn_reset_sem);
+	if (zm->emulated)
+		err = blkdev_issue_zeroout(dev->members[m].bdev, z->start, 1, GFP_NOIO, 0);
+	else
+		err = blkdev_zone_mgmt(dev->members[m].bdev, REQ_OP_ZONE_RESET, z->start,
+				       1ULL << zm->zone_shift);
+	up_write(&dev->zn_reset_sem);
+	if (err)
+		return err;
+
+	spin_lock(&dev->zn_lock);
+	z->alloc = 0;
+	z->full = false;
+	zm->nr_free++;
+	spin_unlock(&dev->zn_lock);
+
+	wake_up_all(&dev->zn_wait);
+
+	return 0;
+}
+
+/**
+ * ssr_zn_ckpt_write - Writes a checkpoint of the map of a regular member
+ * @dev: Logical device
+ * @m: Member index
+ *
+ * The segments the next load has to scan are flagged first: the open and
+ * free ones, those with records not committed to the map yet and the
+ * emptied ones about to be reset. Whatever the map points to once they are
+ * flagged is either in the copy or in one of them. The header goes last,
+ * after a flush, so the slot only becomes valid once its body and the
+ * records it points to are durable. Called with zn_ckpt_mutex held.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_zn_ckpt_write(struct logical_block_dev *dev, int m)
+{
+	struct ssr_member *member = &dev->members[m];
+	struct ssr_zmember *zm = &dev->zn[m];
+	struct ssr_zckpt *hdr = zm->ckpt_buf;
+	char *body = zm->ckpt_buf + KERNEL_SECTOR_SIZE;
+	sector_t slot = zm->ckpt_start + zm->ckpt_slot * zm->ckpt_sectors;
+	sector_t s, end, done, nr;
+	__le64 *map, *seqs;
+	unsigned int i;
+	__le32 *crcs;
+	u8 *scan;
+	int err;
+
+	scan = ssr_zn_ckpt_body(zm, &map, &seqs, &crcs);
+
+	spin_lock(&dev->zn_lock);
+	for (i = 0; i < zm->nr_zones; i++) {
+		struct ssr_zone *z = &zm->zones[i];
+
+		scan[i] = !z->full || z->inflight || !z->valid;
+	}
+	spin_unlock(&dev->zn_lock);
+
+	for (s = 0; s < LOGICAL_DISK_SECTORS; s = end) {
+		end = min_t(sector_t, s + SSR_CHUNK_SECTORS, LOGICAL_DISK_SECTORS);
+
+		spin_lock(&dev->zn_lock);
+		for (; s < end; s++) {
+			map[s] = cpu_to_le64(zm->map[s]);
+			seqs[s] = cpu_to_le64(zm->seqs[s]);
+			crcs[s] = cpu_to_le32(zm->crcs[s]);
+		}
+		spin_unlock(&dev->zn_lock);
+
+		cond_resched();
+	}
+
+	for (done = 0; done < zm->ckpt_sectors - 1; done += nr) {
+		nr = min_t(sector_t, zm->ckpt_sectors - 1 - done, SSR_ZCKPT_IO_SECTORS);
+		err = ssr_member_io(member, REQ_OP_WRITE, slot + 1 + done,
+				    body + done * KERNEL_SECTOR_SIZE, nr * KERNEL_SECTOR_SIZE);
+		if (err)
+			return err;
+	}
+
+	memset(hdr, 0, KERNEL_SECTOR_SIZE);
+	hdr->magic = cpu_to_le32(SSR_ZCKPT_MAGIC);
+	hdr->nr_zones = cpu_to_le32(zm->nr_zones);
+	hdr->seq = cpu_to_le64(zm->ckpt_seq + 1);
+	hdr->zone_sectors = cpu_to_le64(1ULL << zm->zone_shift);
+	hdr->body_crc = cpu_to_le32(crc32(0, body, ssr_zckpt_body_len(zm->nr_zones)));
+	hdr->crc = cpu_to_le32(crc32(0, hdr, KERNEL_SECTOR_SIZE));
+
+	err = ssr_member_io(member, REQ_OP_WRITE | REQ_PREFLUSH | REQ_FUA, slot, hdr,
+			    KERNEL_SECTOR_SIZE);
+	if (err)
+		return err;
+
+	zm->ckpt_seq++;
+	zm->ckpt_slot = (zm->ckpt_slot + 1) % SSR_ZCKPT_SLOTS;
+
+	return 0;
+}
+
+/**
+ * ssr_zn_ckpt - Checkpoints the regular members written since the last time
+ * @dev: Logical device
+ */
+static void ssr_zn_ckpt(struct logical_block_dev *dev)
+{
+	u64 seq = atomic64_read(&dev->zn_seq);
+	int m, err = 0;
+
+	mutex_lock(&dev->zn_ckpt_mutex);
+
+	if (seq != dev->zn_ckpt_at) {
+		for (m = 0; m < SSR_NUM_MEMBERS && !err; m++) {
+			if (!dev->zn[m].emulated)
+				continue;
+
+			err = ssr_zn_ckpt_write(dev, m);
+			if (err)
+				pr_err("ssr_zn_ckpt: %s: checkpoint failed (%d)\n",
+				       dev->members[m].name, err);
+		}
+
+		if (!err)
+			dev->zn_ckpt_at = seq;
+	}
+
+	mutex_unlock(&dev->zn_ckpt_mutex);
+}
+
+/**
+ * ssr_zn_ckpt_worker - Periodic checkpoint of the regular members
+ * @work: zn_ckpt_work of the logical device
+ *
+ * Bounds what the next load scans to the segments written in the last
+ * log_checkpoint_s seconds.
+ */
+static void ssr_zn_ckpt_worker(struct work_struct *work)
+{
+	struct logical_block_dev *dev = container_of(to_delayed_work(work),
+						     struct logical_block_dev,
+						     zn_ckpt_work);
+
+	ssr_zn_ckpt(dev);
+	queue_delayed_work(ssr_wq, &dev->zn_ckpt_work,
+			   max_t(unsigned int, READ_ONCE(log_checkpoint_s), 1) * HZ);
+}
+
+/**
+ * ssr_zn_ckpt_stop - Stops the periodic checkpoint and takes a last one
+ * @dev: Logical device
+ */
+static void ssr_zn_ckpt_stop(struct logical_block_dev *dev)
+{
+	if (!dev->zn || !dev->zn_emulated)
+		return;
+
+	cancel_delayed_work_sync(&dev->zn_ckpt_work);
+	ssr_zn_ckpt(dev);
+}
+
+/**
+ * ssr_zn_gc_worker - Garbage collector of the zoned members
+ * @work: zn_gc_work of the logical device
+ *
+ * Queued when the free zones of a member drop to SSR_ZN_GC_LOW. Empties the
+ * zones with the fewest live sectors until enough zones are free again. A
+ * regular member is checkpointed before a segment is reset, or the last
+ * checkpoint could point into it.
+ */
+static void ssr_zn_gc_worker(struct work_struct *work)
+{
+	struct logical_block_dev *dev = container_of(work, struct logical_block_dev,
+						     zn_gc_work);
+	struct ssr_zrec *rec;
+	char *buf;
+	int m, err;
+
+	rec = kmalloc(KERNEL_SECTOR_SIZE, GFP_NOIO);
+	buf = kmalloc(SSR_ZREC_SECTORS * KERNEL_SECTOR_SIZE, GFP_NOIO);
+	if (!rec || !buf)
+		goto out;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct ssr_zmember *zm = &dev->zn[m];
+
+		while (READ_ONCE(zm->nr_free) <= SSR_ZN_GC_LOW) {
+			unsigned int victim = ssr_zn_victim(dev, zm);
+
+			if (victim == zm->nr_zones)
+				break;
+
+			err = ssr_zn_evacuate(dev, m, victim, rec, buf);
+			if (!err && zm->emulated) {
+				mutex_lock(&dev->zn_ckpt_mutex);
+				err = ssr_zn_ckpt_write(dev, m);
+				mutex_unlock(&dev->zn_ckpt_mutex);
+			}
+			if (!err)
+				err = ssr_zn_reset(dev, m, victim);
+			if (err) {
+				pr_err("ssr_zn_gc_worker: %s: zone %u (%d)\n",
+				       dev->members[m].name, victim, err);
+				break;
+			}
+		}
+	}
+
+out:
+	kfree(buf);
+	kfree(rec);
+	wake_up_all(&dev->zn_wait);
+}
+
+/**
+ * ssr_rw - Reads or writes a range of sectors in the layout of the array
+ * @dev: Logical device
+ * @sector: First sector of the range
+ * @nr: Number of sectors in the range
+ * @buffer: Payload of the range, NULL to write zeroes
+ * @write: true for writes
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * The caller holds the range lock covering the range.
+ *
+ * Returns a blk_status_t.
+ */
+static blk_status_t ssr_rw(struct logical_block_dev *dev, sector_t sector, unsigned int nr,
+			   char *buffer, bool write, blk_opf_t flags)
+{
+	if (dev->zn)
+		return write ? ssr_zn_write(dev, sector, nr, buffer, flags) :
+			       ssr_zn_read(dev, sector, nr, buffer);
+
+	if (dev->cmap)
+		return ssr_cmp_rw(dev, sector, nr, buffer, write, flags);
+
+	if (write)
+		return ssr_write_sectors(dev, sector, nr, buffer, NULL, flags);
+
+	return ssr_read_sectors(dev, sector, nr, buffer, NULL);
+}
+
+/**
+ * ssr_tier_write_table - Writes the extent map to both fast members
+ * @tier: Tiering state
+ *
+ * The map is written with a new sequence number, after a flush of the
+ * extents it points to; the copy with the highest valid seq wins at load.
+ *
+ * Returns 0 if at least one fast member was updated.
+ */
+static int ssr_tier_write_table(struct ssr_tier *tier)
+{
+	size_t len = tier->table_sectors * KERNEL_SECTOR_SIZE;
+	int m, written = 0;
+
+	tier->table->seq = cpu_to_le64(++tier->seq);
+	tier->table->crc = 0;
+	tier->table->crc = cpu_to_le32(crc32(0, tier->table, len));
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (ssr_member_io(&tier->fast[m], REQ_OP_WRITE | REQ_PREFLUSH | REQ_FUA,
+				  0, tier->table, len)) {
+			pr_err("ssr_tier_write_table: %s: failure\n", tier->fast[m].name);
+			continue;
+		}
+		written++;
+	}
+
+	return written ? 0 : -EIO;
+}
+
+/**
+ * ssr_tier_move - Moves an extent to the other tier
+ * @dev: Logical device
+ * @e: Extent, a region of the access heatmap
+ * @promote: true to move it to a free slot of the fast members, false to
+ *	     move it back to the members
+ *
+ * The extent is read through ssr_read_sectors() under its range lock, so it
+ * is verified against its CRCs, and repaired if needed, before it is
+ * copied. The CRCs stay in the CRC area of the members. The map is switched
+ * and persisted only once the copy is flushed; until then the old location
+ * stays valid. An extent that cannot be moved is pinned to its tier until
+ * the module is reloaded.
+ *
+ * Returns true if the extent was moved.
+ */
+static bool ssr_tier_move(struct logical_block_dev *dev, unsigned int e, bool promote)
+{
+	struct ssr_tier *tier = &dev->tier;
+	sector_t start = (sector_t)e << tier->shift;
+	unsigned int nr = min_t(sector_t, 1U << tier->shift, LOGICAL_DISK_SECTORS - start);
+	__le32 old = tier->map[e];
+	unsigned int off, slot = 0;
+	struct ssr_range range;
+	char *buf;
+	int m, err = 0;
+
+	if (promote)
+		slot = find_first_zero_bit(tier->slots, tier->nr_slots);
+
+	buf = vmalloc(nr * KERNEL_SECTOR_SIZE);
+	if (!buf)
+		return false;
+
+	ssr_range_lock(dev, &range, start, nr);
+
+	for (off = 0; off < nr && !err; off += SSR_MAX_SECTORS)
+		if (ssr_read_sectors(dev, start + off, min_t(unsigned int, nr - off, SSR_MAX_SECTORS),
+				     buf + off * KERNEL_SECTOR_SIZE, NULL) != BLK_STS_OK)
+			err = -EIO;
+	if (err)
+		goto out_pin;
+
+	WRITE_ONCE(tier->map[e], promote ? cpu_to_le32(slot + 1) : 0);
+
+	for (m = 0; m < SSR_NUM_MEMBERS && !err; m++) {
+		for (off = 0; off < nr && !err; off += SSR_MAX_SECTORS)
+			err = ssr_member_io(&dev->members[m], REQ_OP_WRITE, start + off,
+					    buf + off * KERNEL_SECTOR_SIZE,
+					    min_t(unsigned int, nr - off, SSR_MAX_SECTORS) * KERNEL_SECTOR_SIZE);
+		if (!err)
+			err = ssr_member_flush(&dev->members[m]);
+	}
+
+	if (!err)
+		err = ssr_tier_write_table(tier);
+
+	if (err) {
+		WRITE_ONCE(tier->map[e], old);
+		goto out_pin;
+	}
+
+	if (promote) {
+		set_bit(slot, tier->slots);
+		tier->nr_fast++;
+	} else {
+		clear_bit(le32_to_cpu(old) - 1, tier->slots);
+		tier->nr_fast--;
+	}
+	WRITE_ONCE(tier->migrated, tier->migrated + nr);
+
+	ssr_range_unlock(dev, &range);
+	vfree(buf);
+
+	return true;
+
+out_pin:
+	ssr_range_unlock(dev, &range);
+	vfree(buf);
+
+	pr_err("ssr_tier_move: extent %u: failure, pinned to its tier\n", e);
+	set_bit(e, tier->pinned);
+
+	return false;
+}
+
+/**
+ * ssr_tier_worker - Moves extents between the tiers by heat
+ * @work: work of the tiering state
+ *
+ * One extent per run: the hottest extent on the members goes to a free slot
+ * of the fast members. Without a free slot, the coldest extent there goes
+ * back first, once the hottest one outside is SSR_TIER_HYSTERESIS times
+ * hotter. Runs that move an extent are spaced to keep to tier_rate.
+ */
+static void ssr_tier_worker(struct work_struct *work)
+{
+	struct ssr_tier *tier = container_of(to_delayed_work(work), struct ssr_tier, work);
+	struct logical_block_dev *dev = container_of(tier, struct logical_block_dev, tier);
+	unsigned long delay = HZ;
+	u64 hot_heat = 0, cold_heat = U64_MAX;
+	int hot = -1, cold = -1;
+	bool moved = false;
+	unsigned int e;
+
+	for (e = 0; e < tier->nr_extents; e++) {
+		struct ssr_heat_rec rec;
+		u64 heat;
+
+		if (test_bit(e, tier->pinned))
+			continue;
+
+		ssr_heat_get(&dev->heat, e, &rec);
+		heat = rec.reads + rec.writes;
+
+		if (tier->map[e] && heat < cold_heat) {
+			cold_heat = heat;
+			cold = e;
+		} else if (!tier->map[e] && heat > hot_heat) {
+			hot_heat = heat;
+			hot = e;
+		}
+	}
+
+	if (hot >= 0 && tier->nr_fast < tier->nr_slots)
+		moved = ssr_tier_move(dev, hot, true);
+	else if (hot >= 0 && cold >= 0 && hot_heat > SSR_TIER_HYSTERESIS * cold_heat)
+		moved = ssr_tier_move(dev, cold, false);
+
+	if (moved)
+		delay = max(msecs_to_jiffies((KERNEL_SECTOR_SIZE << tier->shift) / 1024 *
+					     1000 / max(READ_ONCE(tier_rate), 1U)), 1UL);
+
+	queue_delayed_work(ssr_wq, &tier->work, delay);
+}
+
+/**
+ * ssr_tier_load - Reads the extent map of a fast member
+ * @tier: Tiering state
+ * @m: Fast member
+ * @buf: Buffer of tier->table_sectors sectors
+ *
+ * Returns 1 if @buf holds a valid map of this geometry, 0 if the member has
+ * no map, or a negative error code.
+ */
+static int ssr_tier_load(struct ssr_tier *tier, int m, struct ssr_tier_header *buf)
+{
+	size_t len = tier->table_sectors * KERNEL_SECTOR_SIZE;
+	u32 crc;
+
+	if (ssr_member_io(&tier->fast[m], REQ_OP_READ, 0, buf, len)) {
+		pr_err("ssr_tier_load: %s: read failure\n", tier->fast[m].name);
+		return 0;
+	}
+
+	if (le32_to_cpu(buf->magic) != SSR_TIER_MAGIC)
+		return 0;
+
+	crc = le32_to_cpu(buf->crc);
+	buf->crc = 0;
+	if (crc32(0, buf, len) != crc) {
+		pr_warn("ssr_tier_load: %s: extent map corrupted\n", tier->fast[m].name);
+		return 0;
+	}
+
+	if (le32_to_cpu(buf->extent_sectors) != 1U << tier->shift ||
+	    le32_to_cpu(buf->nr_extents) != tier->nr_extents) {
+		pr_err("ssr_tier_load: %s: extent map of another heat_region_kb\n",
+		       tier->fast[m].name);
+		return -EINVAL;
+	}
+
+	return 1;
+}
+
+/**
+ * ssr_tier_init - Loads or creates the extent map of the fast members
+ * @dev: Logical device, fast members opened
+ *
+ * Extents are the regions of the access heatmap. Each fast member holds the
+ * map and as many extent slots as both of them have room for.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_tier_init(struct logical_block_dev *dev)
+{
+	struct ssr_tier *tier = &dev->tier;
+	struct ssr_tier_header *buf;
+	sector_t capacity;
+	unsigned int e, slot;
+	u64 best = 0;
+	bool found = false;
+	int m, err;
+
+	if (dev->zn || dev->cmap) {
+		pr_err("ssr_tier_init: tiering needs the plain layout\n");
+		return -EINVAL;
+	}
+
+	if (!dev->heat.cpu) {
+		pr_err("ssr_tier_init: tiering needs the access heatmap\n");
+		return -EINVAL;
+	}
+
+	tier->shift = dev->heat.shift;
+	tier->nr_extents = dev->heat.nr_regions;
+	tier->table_sectors = 1 + DIV_ROUND_UP(tier->nr_extents * sizeof(*tier->map),
+					       KERNEL_SECTOR_SIZE);
+	tier->data_start = round_up(tier->table_sectors, 4096 / KERNEL_SECTOR_SIZE);
+
+	capacity = bdev_nr_sectors(tier->fast[0].bdev);
+	for (m = 1; m < SSR_NUM_MEMBERS; m++)
+		capacity = min(capacity, bdev_nr_sectors(tier->fast[m].bdev));
+
+	if (capacity < tier->data_start + (1ULL << tier->shift)) {
+		pr_err("ssr_tier_init: fast members too small for one extent\n");
+		return -EINVAL;
+	}
+
+	tier->nr_slots = min_t(sector_t, (capacity - tier->data_start) >> tier->shift,
+			       tier->nr_extents);
+
+	tier->table = kvzalloc(tier->table_sectors * KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	buf = kvmalloc(tier->table_sectors * KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	tier->slots = bitmap_zalloc(tier->nr_slots, GFP_KERNEL);
+	tier->pinned = bitmap_zalloc(tier->nr_extents, GFP_KERNEL);
+	if (!tier->table || !buf || !tier->slots || !tier->pinned) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+	tier->map = (__le32 *)((char *)tier->table + KERNEL_SECTOR_SIZE);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		err = ssr_tier_load(tier, m, buf);
+		if (err < 0)
+			goto out_free;
+
+		if (err && (!found || le64_to_cpu(buf->seq) > best)) {
+			memcpy(tier->table, buf, tier->table_sectors * KERNEL_SECTOR_SIZE);
+			best = le64_to_cpu(buf->seq);
+			found = true;
+		}
+	}
+
+	tier->seq = best;
+	tier->nr_fast = 0;
+
+	for (e = 0; e < tier->nr_extents; e++) {
+		slot = le32_to_cpu(tier->map[e]);
+		if (!slot)
+			continue;
+
+		if (slot > tier->nr_slots || test_and_set_bit(slot - 1, tier->slots)) {
+			pr_err("ssr_tier_init: extent %u has an invalid slot %u\n", e, slot);
+			err = -EINVAL;
+			goto out_free;
+		}
+		tier->nr_fast++;
+	}
+
+	if (!found) {
+		tier->table->magic = cpu_to_le32(SSR_TIER_MAGIC);
+		tier->table->extent_sectors = cpu_to_le32(1U << tier->shift);
+		tier->table->nr_extents = cpu_to_le32(tier->nr_extents);
+
+		err = ssr_tier_write_table(tier);
+		if (err < 0)
+			goto out_free;
+	}
+
+	kvfree(buf);
+
+	INIT_DELAYED_WORK(&tier->work, ssr_tier_worker);
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		dev->members[m].tier = tier;
+		dev->members[m].fast = &tier->fast[m];
+	}
+
+	pr_info("ssr_tier_init: %u of %u extents on the fast tier, %u slots\n",
+		tier->nr_fast, tier->nr_extents, tier->nr_slots);
+
+	return 0;
+
+out_free:
+	kvfree(buf);
+	kvfree(tier->table);
+	bitmap_free(tier->slots);
+	bitmap_free(tier->pinned);
+	tier->table = NULL;
+	tier->map = NULL;
+	return err;
+}
+
+/**
+ * ssr_tier_free - Stops the migrations and releases the extent map
+ * @dev: Logical device
+ *
+ * The fast members stay open, ssr_tier_close() closes them.
+ */
+static void ssr_tier_free(struct logical_block_dev *dev)
+{
+	struct ssr_tier *tier = &dev->tier;
+	int m;
+
+	if (!tier->table)
+		return;
+
+	cancel_delayed_work_sync(&tier->work);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		dev->members[m].fast = NULL;
+		dev->members[m].tier = NULL;
+	}
+
+	kvfree(tier->table);
+	bitmap_free(tier->slots);
+	bitmap_free(tier->pinned);
+	tier->table = NULL;
+	tier->map = NULL;
+}
+
+/**
+ * ssr_rlog_write_header - Writes the replication log header to both members
+ * @dev: Logical device
+ *
+ * The caller holds rlog_mutex or is the only user of the log.
+ *
+ * Returns 0 if at least one member was updated.
+ */
+static int ssr_rlog_write_header(struct logical_block_dev *dev)
+{
+	struct ssr_rlog_header *hdr;
+	int m, written = 0;
+
+	hdr = kzalloc(KERNEL_SECTOR_SIZE, GFP_NOIO);
+	if (!hdr)
+		return -ENOMEM;
+
+	hdr->magic = cpu_to_le32(SSR_RLOG_MAGIC);
+	hdr->replica = cpu_to_le32(dev->replica.bdev->bd_dev);
+	hdr->shipped = cpu_to_le64(dev->rlog_shipped);
+	hdr->sync_cursor = cpu_to_le64(dev->rlog_cursor);
+	hdr->crc = cpu_to_le32(crc32(0, hdr, KERNEL_SECTOR_SIZE));
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (!ssr_member_io(&dev->members[m], REQ_OP_WRITE | REQ_FUA,
+				   SSR_RLOG_HEADER_SECTOR, hdr, KERNEL_SECTOR_SIZE))
+			written++;
+
+	kfree(hdr);
+
+	return written ? 0 : -EIO;
+}
+
+/**
+ * ssr_rlog_load - Reads the replication log back from a member
+ * @dev: Logical device
+ * @m: Member to read from
+ * @hdr: Buffer of one sector for the header
+ *
+ * Returns 0 if the member holds a valid log for the current replica.
+ */
+static int ssr_rlog_load(struct logical_block_dev *dev, struct ssr_member *m,
+			 struct ssr_rlog_header *hdr)
+{
+	u32 crc;
+
+	if (ssr_member_io(m, REQ_OP_READ, SSR_RLOG_HEADER_SECTOR, hdr, KERNEL_SECTOR_SIZE))
+		return -EIO;
+
+	crc = le32_to_cpu(hdr->crc);
+	hdr->crc = 0;
+	if (le32_to_cpu(hdr->magic) != SSR_RLOG_MAGIC ||
+	    crc != crc32(0, hdr, KERNEL_SECTOR_SIZE) ||
+	    le32_to_cpu(hdr->replica) != dev->replica.bdev->bd_dev)
+		return -EINVAL;
+
+	return ssr_member_io(m, REQ_OP_READ, SSR_RLOG_FIRST_SECTOR, dev->rlog,
+			     SSR_RLOG_SECTORS * KERNEL_SECTOR_SIZE);
+}
+
+/**
+ * ssr_rlog_room - Tells whether a write may be appended to the replication log
+ * @dev: Logical device
+ * @nr: Number of sectors of the write
+ *
+ * Reserved entries count as appended. A write always fits an empty log, so
+ * one larger than the lag limit cannot wait forever.
+ */
+static bool ssr_rlog_room(struct logical_block_dev *dev, unsigned int nr)
+{
+	u64 lag = atomic64_read(&dev->rlog_lag);
+
+	return READ_ONCE(dev->rlog_head) + READ_ONCE(dev->rlog_reserved) -
+	       READ_ONCE(dev->rlog_shipped) < SSR_RLOG_ENTRIES &&
+	       (!lag || lag + nr <= (u64)READ_ONCE(replica_lag_kb) * 2);
+}
+
+/**
+ * ssr_rlog_reserve - Reserves an entry of the replication log for a write
+ * @dev: Logical device
+ * @nr: Number of sectors of the write
+ *
+ * Called before the write takes its range lock, and followed by
+ * ssr_rlog_append() under it. Writers wait here while the replica lags
+ * behind by more than replica_lag_kb; the shipper takes range locks, so a
+ * writer holding one must not wait for it.
+ */
+static void ssr_rlog_reserve(struct logical_block_dev *dev, unsigned int nr)
+{
+	mutex_lock(&dev->rlog_mutex);
+	while (!ssr_rlog_room(dev, nr)) {
+		mutex_unlock(&dev->rlog_mutex);
+		wait_event(dev->rlog_wait, ssr_rlog_room(dev, nr));
+		mutex_lock(&dev->rlog_mutex);
+	}
+
+	WRITE_ONCE(dev->rlog_reserved, dev->rlog_reserved + 1);
+	atomic64_add(nr, &dev->rlog_lag);
+	mutex_unlock(&dev->rlog_mutex);
+}
+
+/**
+ * ssr_rlog_append - Records the intent of a write in the replication log
+ * @dev: Logical device
+ * @sector: First sector of the write
+ * @nr: Number of sectors of the write
+ *
+ * Consumes the entry taken by ssr_rlog_reserve(). Called under the range
+ * lock of the write, before its member writes, and written with REQ_FUA: a
+ * crash at any point of the write leaves an entry behind, and the range is
+ * shipped again on load. The shipper reads the range under its range lock,
+ * so it sees the data of the write, not the data before it. Log sectors are
+ * shared by several entries, so they are written under rlog_mutex: a stale
+ * copy of a sector must never land after a newer one. A log that cannot be
+ * written on either member no longer describes the replica, which is copied
+ * over again.
+ */
+static void ssr_rlog_append(struct logical_block_dev *dev, sector_t sector,
+			    unsigned int nr)
+{
+	struct ssr_rlog_entry *e;
+	unsigned int slot, log_sector;
+	int m, written = 0;
+
+	mutex_lock(&dev->rlog_mutex);
+
+	slot = (dev->rlog_head + 1) % SSR_RLOG_ENTRIES;
+	e = &dev->rlog[slot];
+	e->seq = cpu_to_le64(dev->rlog_head + 1);
+	e->sector = cpu_to_le32(sector);
+	e->nr = cpu_to_le32(nr);
+
+	log_sector = slot / SSR_RLOG_ENTRIES_PER_SECTOR;
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (!ssr_member_io(&dev->members[m], REQ_OP_WRITE | REQ_FUA,
+				   SSR_RLOG_FIRST_SECTOR + log_sector,
+				   &dev->rlog[log_sector * SSR_RLOG_ENTRIES_PER_SECTOR],
+				   KERNEL_SECTOR_SIZE))
+			written++;
+
+	if (written) {
+		smp_store_release(&dev->rlog_head, dev->rlog_head + 1);
+	} else {
+		pr_err_ratelimited("ssr_rlog_append: failure, copying %s again\n",
+				   dev->replica.name);
+		e->seq = 0;
+		dev->rlog_cursor = 0;
+		atomic64_sub(nr, &dev->rlog_lag);
+	}
+
+	WRITE_ONCE(dev->rlog_reserved, dev->rlog_reserved - 1);
+	mutex_unlock(&dev->rlog_mutex);
+
+	if (!written)
+		wake_up_all(&dev->rlog_wait);
+
+	queue_delayed_work(ssr_wq, &dev->rlog_work, 0);
+}
+
+/**
+ * ssr_rlog_ship - Copies a range of the array to the replica
+ * @dev: Logical device
+ * @sector: First sector of the range
+ * @nr: Number of sectors, at most SSR_MAX_SECTORS
+ * @buffer: Buffer of SSR_MAX_SECTORS sectors
+ *
+ * The current, verified data is shipped rather than the data the log entry
+ * was written with, so the replica converges whatever order entries ship in.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_rlog_ship(struct logical_block_dev *dev, sector_t sector,
+			 unsigned int nr, char *buffer)
+{
+	struct ssr_range range;
+	blk_status_t status;
+
+	ssr_range_lock(dev, &range, sector, nr);
+	status = ssr_rw(dev, sector, nr, buffer, false, 0);
+	ssr_range_unlock(dev, &range);
+
+	if (status != BLK_STS_OK)
+		return blk_status_to_errno(status);
+
+	return ssr_member_io(&dev->replica, REQ_OP_WRITE, sector, buffer,
+			     nr * KERNEL_SECTOR_SIZE);
+}
+
+/**
+ * ssr_rlog_worker - Ships the replication log to the replica
+ * @work: Work structure embedded in the logical device
+ *
+ * Ships up to replica_batch_kb of logged writes, then of the initial copy,
+ * flushes the replica once for the whole batch and only then records the
+ * new position in the log header. Failures are retried a second later.
+ */
+static void ssr_rlog_worker(struct work_struct *work)
+{
+	struct logical_block_dev *dev = container_of(to_delayed_work(work),
+						     struct logical_block_dev, rlog_work);
+	unsigned long budget = max_t(unsigned long, READ_ONCE(replica_batch_kb) * 2UL,
+				     SSR_MAX_SECTORS);
+	u64 head = smp_load_acquire(&dev->rlog_head);
+	u64 shipped = dev->rlog_shipped;
+	sector_t start, cursor;
+	unsigned long sectors = 0, lag = 0;
+	char *buffer;
+	int err = 0;
+
+	buffer = kmalloc(SSR_MAX_SECTORS * KERNEL_SECTOR_SIZE, GFP_NOIO);
+	if (!buffer) {
+		err = -ENOMEM;
+		goto retry;
+	}
+
+	/* the log first, it is what writers wait for */
+	while (shipped < head && sectors < budget) {
+		struct ssr_rlog_entry *e = &dev->rlog[(shipped + 1) % SSR_RLOG_ENTRIES];
+		unsigned int nr = le32_to_cpu(e->nr);
+
+		err = ssr_rlog_ship(dev, le32_to_cpu(e->sector), nr, buffer);
+		if (err)
+			break;
+		shipped++;
+		sectors += nr;
+		lag += nr;
+	}
+
+	start = cursor = READ_ONCE(dev->rlog_cursor);
+	while (!err && cursor < LOGICAL_DISK_SECTORS && sectors < budget) {
+		err = ssr_rlog_ship(dev, cursor, SSR_MAX_SECTORS, buffer);
+		if (err)
+			break;
+		cursor += SSR_MAX_SECTORS;
+		sectors += SSR_MAX_SECTORS;
+	}
+
+	kfree(buffer);
+
+	if (sectors) {
+		int ret = blkdev_issue_flush(dev->replica.bdev);
+
+		if (ret) {
+			err = ret;
+			goto retry;
+		}
+
+		mutex_lock(&dev->rlog_mutex);
+		WRITE_ONCE(dev->rlog_shipped, shipped);
+		if (dev->rlog_cursor == start) {
+			dev->rlog_cursor = cursor;
+			if (!start && cursor)
+				ssr_event(dev, SSR_EVENT_REPLICA_SYNC_STARTED, SSR_EVENT_REPLICA,
+					  0, LOGICAL_DISK_SECTORS);
+			if (start < LOGICAL_DISK_SECTORS && cursor == LOGICAL_DISK_SECTORS) {
+				pr_info("ssr_rlog_worker: %s is in sync\n", dev->replica.name);
+				ssr_event(dev, SSR_EVENT_REPLICA_IN_SYNC, SSR_EVENT_REPLICA,
+					  0, LOGICAL_DISK_SECTORS);
+			}
+		}
+		ssr_rlog_write_header(dev);
+		mutex_unlock(&dev->rlog_mutex);
+
+		atomic64_sub(lag, &dev->rlog_lag);
+		wake_up_all(&dev->rlog_wait);
+	}
+
+	if (err)
+		goto retry;
+
+	if (smp_load_acquire(&dev->rlog_head) != shipped ||
+	    READ_ONCE(dev->rlog_cursor) < LOGICAL_DISK_SECTORS)
+		queue_delayed_work(ssr_wq, &dev->rlog_work, 0);
+	return;
+
+retry:
+	pr_err_ratelimited("ssr_rlog_worker: %s: failure (%d)\n", dev->replica.name, err);
+	queue_delayed_work(ssr_wq, &dev->rlog_work, HZ);
+}
+
+/**
+ * ssr_rlog_scan - Finds the logged writes a loaded log has not shipped yet
+ * @dev: Logical device, with its log and shipped position loaded
+ *
+ * Entries newer than the shipped position are shipped again; a missing one
+ * means its write cannot be accounted for, so the replica is copied over
+ * again.
+ */
+static void ssr_rlog_scan(struct logical_block_dev *dev)
+{
+	u64 seq;
+
+	dev->rlog_head = dev->rlog_shipped;
+
+	for (seq = dev->rlog_shipped + 1; ; seq++) {
+		struct ssr_rlog_entry *e = &dev->rlog[seq % SSR_RLOG_ENTRIES];
+
+		if (le64_to_cpu(e->seq) != seq)
+			break;
+		dev->rlog_head = seq;
+		atomic64_add(le32_to_cpu(e->nr), &dev->rlog_lag);
+	}
+
+	for (seq = 0; seq < SSR_RLOG_ENTRIES; seq++)
+		if (le64_to_cpu(dev->rlog[seq].seq) > dev->rlog_head) {
+			pr_warn("ssr_rlog_scan: replication log has a hole, copying %s again\n",
+				dev->replica.name);
+			dev->rlog_cursor = 0;
+			break;
+		}
+}
+
+/**
+ * ssr_rlog_init - Loads or creates the replication log of the replica
+ * @dev: Logical device
+ *
+ * See ssr_rlog_scan() for a loaded log. A log written for another device,
+ * or no log at all, starts with a full copy.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_rlog_init(struct logical_block_dev *dev)
+{
+	struct ssr_rlog_header *hdr;
+	int m, err = -EINVAL;
+
+	if (dev->zn) {
+		pr_err("ssr_rlog_init: zoned members cannot hold a replication log\n");
+		return -EINVAL;
+	}
+
+	if (bdev_nr_sectors(dev->replica.bdev) < LOGICAL_DISK_SECTORS) {
+		pr_err("ssr_rlog_init: %s is too small\n", dev->replica.name);
+		return -EINVAL;
+	}
+
+	mutex_init(&dev->rlog_mutex);
+	init_waitqueue_head(&dev->rlog_wait);
+	atomic64_set(&dev->rlog_lag, 0);
+	dev->rlog_reserved = 0;
+	INIT_DELAYED_WORK(&dev->rlog_work, ssr_rlog_worker);
+
+	dev->rlog = vzalloc(SSR_RLOG_SECTORS * KERNEL_SECTOR_SIZE);
+	if (!dev->rlog)
+		return -ENOMEM;
+
+	hdr = kmalloc(KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	if (!hdr) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS && err; m++)
+		err = ssr_rlog_load(dev, &dev->members[m], hdr);
+
+	if (!err) {
+		dev->rlog_shipped = le64_to_cpu(hdr->shipped);
+		dev->rlog_cursor = min_t(u64, le64_to_cpu(hdr->sync_cursor),
+					 LOGICAL_DISK_SECTORS);
+		ssr_rlog_scan(dev);
+
+		kfree(hdr);
+		return 0;
+	}
+
+	pr_info("ssr_rlog_init: starting a full copy to %s\n", dev->replica.name);
+
+	memset(dev->rlog, 0, SSR_RLOG_SECTORS * KERNEL_SECTOR_SIZE);
+	dev->rlog_head = 0;
+	dev->rlog_shipped = 0;
+	dev->rlog_cursor = 0;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		ssr_member_io(&dev->members[m], REQ_OP_WRITE, SSR_RLOG_FIRST_SECTOR,
+			      dev->rlog, SSR_RLOG_SECTORS * KERNEL_SECTOR_SIZE);
+
+	kfree(hdr);
+
+	err = ssr_rlog_write_header(dev);
+	if (err < 0) {
+		pr_err("ssr_rlog_init: failure\n");
+		goto out_free;
+	}
+
+	return 0;
+
+out_free:
+	vfree(dev->rlog);
+	dev->rlog = NULL;
+	return err;
+}
+
+/**
+ * ssr_atomic_write - Writes a range so that it is either all old or all new
+ * @dev: Logical device
+ * @sector: First sector of the write
+ * @nr: Number of sectors, at most atomic_write_kb
+ * @buffer: Payload of the write
+ *
+ * The range goes to a journal slot first, header and data in one FUA write
+ * per member, then in place. Once the in-place copies and their CRCs are
+ * flushed the slot is invalidated. A crash in between leaves a valid slot
+ * that ssr_jrnl_init() writes in place again. The caller holds the range
+ * lock, so no other write to the range can come after the slot.
+ *
+ * A write that fails is invalidated as well: the caller got the error and
+ * may write the range again, and a replay at the next load would put the
+ * failed payload back over that newer data.
+ *
+ * Returns a blk_status_t.
+ */
+static blk_status_t ssr_atomic_write(struct logical_block_dev *dev, sector_t sector,
+				     unsigned int nr, char *buffer)
+{
+	size_t len = nr * KERNEL_SECTOR_SIZE;
+	blk_status_t status;
+	char *rec;
+	int slot;
+
+	rec = kzalloc(KERNEL_SECTOR_SIZE + len, GFP_NOIO);
+	if (!rec)
+		return BLK_STS_RESOURCE;
+
+	((struct ssr_jrec *)rec)->sector = cpu_to_le64(sector);
+	memcpy(rec + KERNEL_SECTOR_SIZE, buffer, len);
+
+	if (ssr_jrnl_write(dev, rec, nr, &slot)) {
+		status = BLK_STS_IOERR;
+		goto out;
+	}
+
+	status = ssr_write_sectors(dev, sector, nr, buffer, NULL, 0);
+	if (status == BLK_STS_OK)
+		status = ssr_flush(dev);
+
+out:
+	ssr_jrnl_put(dev, slot, (struct ssr_jrec *)rec);
+	kfree(rec);
+
+	return status;
+}
+
+/**
+ * ssr_jrnl_replay - Writes the atomic write of a valid journal slot in place
+ * @dev: Logical device
+ * @slot: Slot index
+ * @rec: Buffer of a whole slot
+ *
+ * Both members hold the record; the first valid copy is used. In the
+ * compressed layout the record is a chunk write: its payload is stored and
+ * mapped again.
+ *
+ * Returns true if the slot held a record.
+ */
+static bool ssr_jrnl_replay(struct logical_block_dev *dev, int slot, char *rec)
+{
+	struct ssr_jrec *hdr = (struct ssr_jrec *)rec;
+	blk_status_t status;
+	unsigned int nr;
+	sector_t sector;
+	u32 crc, len;
+	int m;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (ssr_member_io(&dev->members[m], REQ_OP_READ, ssr_jrnl_slot_sector(slot),
+				  rec, SSR_JRNL_SLOT_SECTORS * KERNEL_SECTOR_SIZE))
+			continue;
+
+		crc = le32_to_cpu(hdr->crc);
+		hdr->crc = 0;
+		nr = le32_to_cpu(hdr->nr);
+		sector = le64_to_cpu(hdr->sector);
+		len = le32_to_cpu(hdr->cmp_len);
+		if (le32_to_cpu(hdr->magic) != SSR_JRNL_MAGIC ||
+		    crc != crc32(0, hdr, KERNEL_SECTOR_SIZE) ||
+		    !nr || nr > SSR_MAX_SECTORS || sector + nr > LOGICAL_DISK_SECTORS ||
+		    le32_to_cpu(hdr->data_crc) != crc32(0, rec + KERNEL_SECTOR_SIZE,
+							 nr * KERNEL_SECTOR_SIZE))
+			continue;
+
+		/* a chunk write of the compressed layout: the whole chunk changed */
+		if (!len != !dev->cmap ||
+		    (len && (!IS_ALIGNED(sector, SSR_CHUNK_SECTORS) ||
+			     DIV_ROUND_UP(len, KERNEL_SECTOR_SIZE) != nr))) {
+			pr_err("ssr_jrnl_replay: slot %d: record of another layout\n", slot);
+			return false;
+		}
+		if (len)
+			nr = SSR_CHUNK_SECTORS;
+
+		pr_info("ssr_jrnl_replay: completing atomic write of sectors %llu-%llu\n",
+			(unsigned long long)sector, (unsigned long long)(sector + nr - 1));
+
+		if (dev->rlog) {
+			ssr_rlog_reserve(dev, nr);
+			ssr_rlog_append(dev, sector, nr);
+		}
+
+		if (len) {
+			status = ssr_cmp_store(dev, sector / SSR_CHUNK_SECTORS,
+					       rec + KERNEL_SECTOR_SIZE, len, REQ_FUA);
+		} else {
+			status = ssr_init_ahead(dev, sector, nr);
+			if (status == BLK_STS_OK)
+				status = ssr_write_sectors(dev, sector, nr,
+							   rec + KERNEL_SECTOR_SIZE, NULL, REQ_FUA);
+		}
+
+		if (status != BLK_STS_OK) {
+			pr_err("ssr_jrnl_replay: slot %d: failure\n", slot);
+			return false;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * ssr_jrnl_init - Completes interrupted atomic writes and enables them
+ * @dev: Logical device
+ *
+ * The journal is replayed whatever atomic_write_kb is set to, so turning
+ * atomic writes off never loses one that was cut by a crash.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_jrnl_init(struct logical_block_dev *dev)
+{
+	char *rec;
+	int slot;
+
+	init_waitqueue_head(&dev->jrnl_wait);
+	dev->jrnl_busy = 0;
+	dev->atomic = false;
+
+	if (atomic_write_kb &&
+	    (!is_power_of_2(atomic_write_kb) ||
+	     atomic_write_kb > SSR_MAX_SECTORS * KERNEL_SECTOR_SIZE / 1024)) {
+		pr_err("ssr_jrnl_init: atomic_write_kb must be a power of two up to %u\n",
+		       SSR_MAX_SECTORS * KERNEL_SECTOR_SIZE / 1024);
+		return -EINVAL;
+	}
+
+	rec = kmalloc(SSR_JRNL_SLOT_SECTORS * KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	if (!rec)
+		return -ENOMEM;
+
+	for (slot = 0; slot < SSR_JRNL_SLOTS; slot++)
+		if (ssr_jrnl_replay(dev, slot, rec))
+			ssr_jrnl_clear(dev, slot, (struct ssr_jrec *)rec);
+
+	kfree(rec);
+
+	/* compressed chunk writes use the journal, REQ_ATOMIC ones are not supported */
+	dev->atomic = atomic_write_kb && !dev->cmap;
+
+	return 0;
+}
+
+/**
+ * ssr_rw_integrity - Reads or writes a bio carrying an integrity payload
+ * @dev: Logical device, plain layout
+ * @bio_from_up: Read or write request with an integrity payload
+ * @buffer: Linear buffer of bio_sectors(@bio_from_up) sectors
+ * @flags: REQ_* flags to propagate to the member writes
+ *
+ * Writes store the CRCs of the payload instead of computing them; reads
+ * return the CRCs their data was verified against. The caller holds the
+ * range lock covering the bio.
+ *
+ * Returns a blk_status_t.
+ */
+static blk_status_t ssr_rw_integrity(struct logical_block_dev *dev, struct bio *bio_from_up,
+				     char *buffer, blk_opf_t flags)
+{
+	sector_t sector = bio_from_up->bi_iter.bi_sector;
+	unsigned int nr = bio_sectors(bio_from_up);
+	blk_status_t status;
+	u32 *pi;
+
+	pi = kmalloc_array(nr, sizeof(*pi), GFP_NOIO);
+	if (!pi)
+		return BLK_STS_RESOURCE;
+
+	if (bio_op(bio_from_up) == REQ_OP_READ) {
+		status = ssr_read_sectors(dev, sector, nr, buffer, pi);
+		if (status == BLK_STS_OK) {
+			ssr_copy_bio(bio_from_up, buffer, true);
+			status = ssr_copy_integrity(bio_from_up, pi, true);
+		}
+	} else {
+		status = ssr_copy_integrity(bio_from_up, pi, false);
+		if (status == BLK_STS_OK) {
+			ssr_copy_bio(bio_from_up, buffer, false);
+			status = ssr_write_sectors(dev, sector, nr, buffer, pi, flags);
+		}
+	}
+
+	kfree(pi);
+
+	return status;
+}
+
+/**
+ * ssr_handle_bio - Handles a read or write request for an array
+ * @dev: Logical device
+ * @bio_from_up: Bio structure representing the request, in array sectors
+ *
+ * This function is executed in a workqueue context. ssr_wq runs requests
+ * concurrently on all CPUs; requests touching the same chunk are serialized
+ * by the range lock.
+ */
+static void ssr_handle_bio(struct logical_block_dev *dev, struct bio *bio_from_up)
+{
+	sector_t sector = bio_from_up->bi_iter.bi_sector;
+	unsigned int nr = bio_sectors(bio_from_up);
+	blk_opf_t flags = bio_from_up->bi_opf & REQ_FUA;
+	blk_status_t status = BLK_STS_OK;
+	struct ssr_range range;
+	unsigned int done, n;
+	char *buffer;
+
+	if (bio_from_up->bi_opf & REQ_PREFLUSH)
+		status = ssr_flush(dev);
+
+	if (status != BLK_STS_OK || !nr)
+		goto out;
+
+	/* write intent: logged before any member write, see ssr_rlog_append() */
+	if (dev->rlog && op_is_write(bio_op(bio_from_up)))
+		ssr_rlog_reserve(dev, nr);
+
+	ssr_range_lock(dev, &range, sector, nr);
+
+	if (dev->rlog && op_is_write(bio_op(bio_from_up)))
+		ssr_rlog_append(dev, sector, nr);
+
+	if (op_is_write(bio_op(bio_from_up))) {
+		status = ssr_init_ahead(dev, sector, nr);
+		if (status != BLK_STS_OK)
+			goto unlock;
+	}
+
+	switch (bio_op(bio_from_up)) {
+	case REQ_OP_READ:
+	case REQ_OP_WRITE:
+		buffer = kmalloc(nr * KERNEL_SECTOR_SIZE, GFP_NOIO);
+		if (!buffer) {
+			status = BLK_STS_RESOURCE;
+			break;
+		}
+
+		if (dev->integrity && bio_integrity(bio_from_up) &&
+		    !(bio_from_up->bi_opf & REQ_ATOMIC)) {
+			status = ssr_rw_integrity(dev, bio_from_up, buffer, flags);
+		} else if (bio_op(bio_from_up) == REQ_OP_READ) {
+			status = ssr_rw(dev, sector, nr, buffer, false, 0);
+			if (status == BLK_STS_OK)
+				ssr_copy_bio(bio_from_up, buffer, true);
+		} else {
+			ssr_copy_bio(bio_from_up, buffer, false);
+			if (dev->atomic && (bio_from_up->bi_opf & REQ_ATOMIC))
+				status = ssr_atomic_write(dev, sector, nr, buffer);
+			else
+				status = ssr_rw(dev, sector, nr, buffer, true, flags);
+		}
+
+		kfree(buffer);
+		break;
+	case REQ_OP_WRITE_ZEROES:
+		/* the queue limits do not split write-zeroes at extent boundaries */
+		for (done = 0; done < nr && status == BLK_STS_OK; done += n) {
+			n = nr - done;
+			if (dev->tier.table)
+				n = min_t(sector_t, n, ssr_tier_span(&dev->tier, sector + done));
+			status = ssr_rw(dev, sector + done, n, NULL, true, flags);
+		}
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+	}
+
+unlock:
+	ssr_range_unlock(dev, &range);
+
+	if (op_is_write(bio_op(bio_from_up)))
+		ssr_cbt_mark(&dev->cbt, sector, nr);
+
+out:
+	bio_from_up->bi_status = status;
+	bio_endio(bio_from_up);
+}
+
+/**
+ * ssr_handle_requests - Handles read and write requests for the RAID logical block device
+ * @work: Work structure containing the request data
+ */
+static void ssr_handle_requests(struct work_struct *work)
+{
+	struct ssr_work *ssrwork = container_of(work, struct ssr_work, work);
+	struct logical_block_dev *dev = ssrwork->dev;
+	struct bio *bio_from_up = ssrwork->bio_from_up;
+
+	mempool_free(ssrwork, ssr_work_pool);
+
+	ssr_handle_bio(dev, bio_from_up);
+}
+
+/**
+ * ssr_trace_init - Allocates the I/O trace ring
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_trace_init(void)
+{
+	unsigned long entries;
+
+	mutex_init(&ssr_trace.mutex);
+
+	if (!trace_entries)
+		return 0;
+
+	entries = roundup_pow_of_two(trace_entries);
+	ssr_trace.ring = vzalloc(array_size(entries, sizeof(*ssr_trace.ring)));
+	if (!ssr_trace.ring)
+		return -ENOMEM;
+
+	ssr_trace.mask = entries - 1;
+
+	return 0;
+}
+
+/**
+ * ssr_trace_bio - Appends a request to the I/O trace ring
+ * @bio: Request, after splitting
+ *
+ * Writers only share the head counter. A slot is invalidated while it is
+ * filled and published with the position of its record, so the reader can
+ * tell complete records from records being written or overwritten.
+ */
+static void ssr_trace_bio(struct bio *bio)
+{
+	struct ssr_trace_rec *rec;
+	u64 idx;
+
+	if (!ssr_trace.ring)
+		return;
+
+	idx = atomic64_fetch_inc(&ssr_trace.head);
+	rec = &ssr_trace.ring[idx & ssr_trace.mask];
+
+	WRITE_ONCE(rec->seq, 0);
+	smp_wmb();
+
+	rec->time_ns = ktime_get_ns();
+	rec->sector = bio->bi_iter.bi_sector;
+	rec->nr_sectors = bio_sectors(bio);
+	rec->flags = 0;
+	if (bio->bi_opf & REQ_FUA)
+		rec->flags |= SSR_TRACE_FUA;
+	if (bio->bi_opf & REQ_PREFLUSH)
+		rec->flags |= SSR_TRACE_PREFLUSH;
+
+	switch (bio_op(bio)) {
+	case REQ_OP_READ:
+		rec->op = SSR_TRACE_READ;
+		break;
+	case REQ_OP_WRITE_ZEROES:
+		rec->op = SSR_TRACE_WRITE_ZEROES;
+		break;
+	default:
+		rec->op = bio_sectors(bio) ? SSR_TRACE_WRITE : SSR_TRACE_FLUSH;
+	}
+
+	smp_store_release(&rec->seq, idx + 1);
+}
+
+/**
+ * ssr_trace_read - Consuming read of the I/O trace ring
+ * @file: debugfs file
+ * @ubuf: User buffer, receives whole struct ssr_trace_rec records
+ * @count: Size of @ubuf
+ * @ppos: Unused, the ring has a single read position
+ *
+ * Returns the number of bytes read, 0 if no record is pending, or a negative
+ * error code.
+ */
+static ssize_t ssr_trace_read(struct file *file, char __user *ubuf, size_t count,
+			      loff_t *ppos)
+{
+	struct ssr_trace_rec rec;
+	size_t copied = 0;
+	int err = 0;
+
+	if (!ssr_trace.ring)
+		return -ENODEV;
+
+	mutex_lock(&ssr_trace.mutex);
+
+	while (copied + sizeof(rec) <= count) {
+		struct ssr_trace_rec *slot = &ssr_trace.ring[ssr_trace.tail & ssr_trace.mask];
+		u64 seq = smp_load_acquire(&slot->seq);
+
+		if (seq > ssr_trace.tail + 1) {
+			/* lapped by the writers, resume at the oldest record left */
+			u64 oldest = atomic64_read(&ssr_trace.head) - ssr_trace.mask - 1;
+
+			ssr_trace.dropped += oldest - ssr_trace.tail;
+			ssr_trace.tail = oldest;
+			continue;
+		}
+
+		if (seq != ssr_trace.tail + 1)
+			break;
+
+		rec = *slot;
+		smp_rmb();
+		if (READ_ONCE(slot->seq) != seq)
+			continue;
+
+		if (copy_to_user(ubuf + copied, &rec, sizeof(rec))) {
+			err = -EFAULT;
+			break;
+		}
+
+		copied += sizeof(rec);
+		ssr_trace.tail++;
+	}
+
+	mutex_unlock(&ssr_trace.mutex);
+
+	return copied ? copied : err;
+}
+
+static const struct file_operations ssr_trace_fops = {
+	.owner = THIS_MODULE,
+	.read = ssr_trace_read,
+	.llseek = noop_llseek,
+};
+
+/**
+ * ssr_bench_run - Runs the microbenchmarks of the request and CRC engine
+ * @dev: Array the read benchmark runs on, NULL to leave it out
+ * @report: Called with the name and the result of each benchmark
+ * @priv: Argument of @report
+ *
+ * Measures the average cost in ns of one operation over SSR_BENCH_LOOPS
+ * runs on the calling CPU: CRC of a sector, fused CRC/zero pass of a full
+ * request, verification of a sector with and without a repair,
+ * construction of a full-size member bio and a 4 KiB read through the
+ * whole read path of @dev. The last one is best run on built-in members
+ * (null_members=ram) to leave the disks out.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_bench_run(struct logical_block_dev *dev,
+			 void (*report)(void *priv, const char *name, u64 ns), void *priv)
+{
+	size_t len = SSR_MAX_SECTORS * KERNEL_SECTOR_SIZE;
+	char *data[SSR_NUM_MEMBERS] = { NULL };
+	__le32 *crcs[SSR_NUM_MEMBERS] = { NULL };
+	bool valid[SSR_NUM_MEMBERS], dirty[SSR_NUM_MEMBERS] = { false };
+	struct ssr_range range;
+	u32 *sums, acc = 0;
+	char name[32];
+	unsigned int i;
+	int m, err = -ENOMEM;
+	u64 start;
+
+	sums = kmalloc_array(SSR_MAX_SECTORS, sizeof(*sums), GFP_KERNEL);
+	if (!sums)
+		return -ENOMEM;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		data[m] = kmalloc(len, GFP_KERNEL);
+		crcs[m] = kmalloc(ssr_crc_window_len(0, SSR_MAX_SECTORS), GFP_KERNEL);
+		if (!data[m] || !crcs[m])
+			goto out;
+
+		get_random_bytes(data[m], len);
+		if (m)
+			memcpy(data[m], data[0], len);
+		valid[m] = true;
+	}
+
+	ssr_core_sums(data[0], SSR_MAX_SECTORS, sums, ssr_zero_crc);
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		for (i = 0; i < SSR_MAX_SECTORS; i++)
+			*ssr_crc_slot(crcs[m], 0, i) = cpu_to_le32(sums[i]);
+
+	start = ktime_get_ns();
+	for (i = 0; i < SSR_BENCH_LOOPS; i++)
+		acc ^= crc32(0, data[0] + (i % SSR_MAX_SECTORS) * KERNEL_SECTOR_SIZE,
+			     KERNEL_SECTOR_SIZE);
+	OPTIMIZER_HIDE_VAR(acc);
+	report(priv, "crc32_sector_ns", div_u64(ktime_get_ns() - start, SSR_BENCH_LOOPS));
+
+	start = ktime_get_ns();
+	for (i = 0; i < SSR_BENCH_LOOPS; i++)
+		ssr_core_sums(data[0], SSR_MAX_SECTORS, sums, ssr_zero_crc);
+	snprintf(name, sizeof(name), "sums_%u_sectors_ns", SSR_MAX_SECTORS);
+	report(priv, name, div_u64(ktime_get_ns() - start, SSR_BENCH_LOOPS));
+
+	start = ktime_get_ns();
+	for (i = 0; i < SSR_BENCH_LOOPS; i++)
+		ssr_core_verify_sector(data, crcs, valid, 0, i % SSR_MAX_SECTORS, dirty);
+	report(priv, "verify_sector_ns", div_u64(ktime_get_ns() - start, SSR_BENCH_LOOPS));
+
+	/* corrupt the second copy every time, the verification repairs it */
+	start = ktime_get_ns();
+	for (i = 0; i < SSR_BENCH_LOOPS; i++) {
+		data[1][(i % SSR_MAX_SECTORS) * KERNEL_SECTOR_SIZE] ^= 0xff;
+		ssr_core_verify_sector(data, crcs, valid, 0, i % SSR_MAX_SECTORS, dirty);
+	}
+	report(priv, "verify_repair_sector_ns",
+	       div_u64(ktime_get_ns() - start, SSR_BENCH_LOOPS));
+
+	start = ktime_get_ns();
+	for (i = 0; i < SSR_BENCH_LOOPS; i++) {
+		struct bio *bio = bio_alloc(NULL, DIV_ROUND_UP(len, PAGE_SIZE), REQ_OP_READ,
+					    GFP_KERNEL);
+
+		ssr_bio_add_buf(bio, data[0], len);
+		bio_put(bio);
+	}
+	snprintf(name, sizeof(name), "bio_build_%zuk_ns", len / 1024);
+	report(priv, name, div_u64(ktime_get_ns() - start, SSR_BENCH_LOOPS));
+
+	if (dev) {
+		unsigned int nr = PAGE_SIZE / KERNEL_SECTOR_SIZE;
+
+		start = ktime_get_ns();
+		for (i = 0; i < SSR_BENCH_LOOPS; i++) {
+			ssr_range_lock(dev, &range, 0, nr);
+			ssr_rw(dev, 0, nr, data[0], false, 0);
+			ssr_range_unlock(dev, &range);
+			cond_resched();
+		}
+		report(priv, "read_4k_ns", div_u64(ktime_get_ns() - start, SSR_BENCH_LOOPS));
+	}
+
+	err = 0;
+out:
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		kfree(data[m]);
+		kfree(crcs[m]);
+	}
+	kfree(sums);
+
+	return err;
+}
+
+/**
+ * ssr_bench_print - Prints the result of a microbenchmark to debugfs
+ * @priv: seq_file of debugfs ssr/bench
+ * @name: Name of the benchmark
+ * @ns: Average cost of one operation in ns
+ */
+static void ssr_bench_print(void *priv, const char *name, u64 ns)
+{
+	seq_printf(priv, "%s %llu\n", name, ns);
+}
+
+/**
+ * ssr_bench_show - Prints the microbenchmarks of the request and CRC engine
+ * @s: seq_file of debugfs ssr/bench
+ * @unused: Unused
+ *
+ * See ssr_bench_run(); the read benchmark runs on /dev/ssr if it exists.
+ */
+static int ssr_bench_show(struct seq_file *s, void *unused)
+{
+	struct logical_block_dev *dev = &logical_raid_block_device;
+
+	return ssr_bench_run(dev->gd ? dev : NULL, ssr_bench_print, s);
+}
+DEFINE_SHOW_ATTRIBUTE(ssr_bench);
+
+/**
+ * ssr_debugfs_init - Creates the debugfs directory of the module
+ *
+ * Failures are not fatal, debugfs is for debugging only.
+ */
+static void ssr_debugfs_init(void)
+{
+	ssr_debugfs = debugfs_create_dir(LOGICAL_DEV_NAME, NULL);
+	debugfs_create_file("bench", 0400, ssr_debugfs, NULL, &ssr_bench_fops);
+
+	if (ssr_trace.ring) {
+		debugfs_create_file("trace", 0400, ssr_debugfs, NULL, &ssr_trace_fops);
+		debugfs_create_u64("trace_dropped", 0400, ssr_debugfs, &ssr_trace.dropped);
+	}
+}
+
+/**
+ * ssr_debugfs_exit - Removes the debugfs directory and frees the trace ring
+ */
+static void ssr_debugfs_exit(void)
+{
+	debugfs_remove_recursive(ssr_debugfs);
+	vfree(ssr_trace.ring);
+	ssr_trace.ring = NULL;
+}
+
+/**
+ * ssr_queue_work - Hands a request to the workqueue or to a polling thread
+ * @ssrwork: Work structure of the request
+ *
+ * With polling threads, the submitting CPU picks a ring and the thread is
+ * only woken up if it backed off to sleep.
+ */
+static void ssr_queue_work(struct ssr_work *ssrwork)
+{
+	struct ssr_poller *p;
+
+	if (!ssr_nr_pollers) {
+		queue_work(ssr_wq, &ssrwork->work);
+		return;
+	}
+
+	p = &ssr_pollers[raw_smp_processor_id() % ssr_nr_pollers];
+	if (llist_add(&ssrwork->node, &p->ring) && wq_has_sleeper(&p->wait))
+		wake_up(&p->wait);
+}
+
+/**
+ * ssr_poll_thread - Busy-polling submission thread
+ * @data: Poller the thread runs
+ *
+ * Runs the requests of its ring in submission order, polling the member
+ * completions (see ssr_member_io()). After poll_idle_us without requests the
+ * thread sleeps until the next one is queued.
+ *
+ * Returns 0.
+ */
+static int ssr_poll_thread(void *data)
+{
+	struct ssr_poller *p = data;
+	u64 busy = ktime_get_ns();
+
+	while (!kthread_should_stop() || !llist_empty(&p->ring)) {
+		struct llist_node *list = llist_del_all(&p->ring);
+		struct ssr_work *ssrwork, *next;
+
+		if (!list) {
+			if (ktime_get_ns() - busy < READ_ONCE(poll_idle_us) * NSEC_PER_USEC) {
+				cpu_relax();
+				cond_resched();
+				continue;
+			}
+
+			wait_event_idle(p->wait, !llist_empty(&p->ring) || kthread_should_stop());
+			busy = ktime_get_ns();
+			continue;
+		}
+
+		/* the work function frees the work structure of /dev/ssr requests */
+		list = llist_reverse_order(list);
+		llist_for_each_entry_safe(ssrwork, next, list, node)
+			ssrwork->work.func(&ssrwork->work);
+
+		busy = ktime_get_ns();
+	}
+
+	return 0;
+}
+
+/**
+ * ssr_poll_stop - Stops the polling threads
+ *
+ * Each thread runs the requests left in its ring before it exits.
+ */
+static void ssr_poll_stop(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ssr_nr_pollers; i++)
+		kthread_stop(ssr_pollers[i].task);
+
+	ssr_nr_pollers = 0;
+	kfree(ssr_pollers);
+	ssr_pollers = NULL;
+}
+
+/**
+ * ssr_poll_start - Starts one polling thread on each CPU of poll_cpus
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_poll_start(void)
+{
+	cpumask_var_t mask;
+	unsigned int cpu, i = 0;
+	int err;
+
+	if (!poll_cpus || !*poll_cpus)
+		return 0;
+
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
+
+	err = cpulist_parse(poll_cpus, mask);
+	if (err)
+		goto out;
+
+	cpumask_and(mask, mask, cpu_online_mask);
+	if (cpumask_empty(mask)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	ssr_pollers = kcalloc(cpumask_weight(mask), sizeof(*ssr_pollers), GFP_KERNEL);
+	if (!ssr_pollers) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for_each_cpu(cpu, mask) {
+		struct ssr_poller *p = &ssr_pollers[i];
+
+		init_llist_head(&p->ring);
+		init_waitqueue_head(&p->wait);
+		p->task = kthread_run_on_cpu(ssr_poll_thread, p, cpu, "ssr_poll/%u");
+		if (IS_ERR(p->task)) {
+			err = PTR_ERR(p->task);
+			ssr_nr_pollers = i;
+			ssr_poll_stop();
+			goto out;
+		}
+		i++;
+	}
+
+	ssr_nr_pollers = i;
+
+out:
+	free_cpumask_var(mask);
+	return err;
+}
+
+/**
+ * ssr_submit_bio - Submits a bio request to the RAID logical block device
+ * @bio_from_up: Bio structure representing the request
+ *
+ * This function splits the bio to the size limits of the logical device
+ * and queues it for processing on ssr_wq.
+ */
+static void ssr_submit_bio(struct bio *bio_from_up)
+{
+	struct logical_block_dev *dev = bio_from_up->bi_bdev->bd_disk->private_data;
+	struct ssr_work *ssrwork;
+
+	bio_from_up = bio_split_to_limits(bio_from_up);
+	if (!bio_from_up)
+		return;
+
+	if (bio_end_sector(bio_from_up) > LOGICAL_DISK_SECTORS) {
+		bio_io_error(bio_from_up);
+		return;
+	}
+
+	if (bio_from_up->bi_opf & REQ_NOWAIT) {
+		/* a write the replication log cannot take now would wait for the shipper */
+		if (dev->rlog && op_is_write(bio_op(bio_from_up)) &&
+		    !ssr_rlog_room(dev, bio_sectors(bio_from_up))) {
+			bio_wouldblock_error(bio_from_up);
+			return;
+		}
+
+		ssrwork = mempool_alloc(ssr_work_pool, GFP_NOWAIT);
+		if (!ssrwork) {
+			bio_wouldblock_error(bio_from_up);
+			return;
+		}
+	} else {
+		ssrwork = mempool_alloc(ssr_work_pool, GFP_NOIO);
+	}
+
+	ssr_trace_bio(bio_from_up);
+	ssr_heat_mark(&dev->heat, bio_from_up);
+
+	if (op_is_write(bio_op(bio_from_up)))
+		ssr_cbt_mark(&dev->cbt, bio_from_up->bi_iter.bi_sector,
+			     bio_sectors(bio_from_up));
+
+	INIT_WORK(&ssrwork->work, ssr_handle_requests);
+	ssrwork->dev = dev;
+	ssrwork->bio_from_up = bio_from_up;
+	ssr_queue_work(ssrwork);
+}
+
+/*
+ * Memory accounting of the caches and maps, exported in /sys/block/ssr/ssr/
+ */
+static ssize_t crc_cache_entries_show(struct device *d, struct device_attribute *attr,
+				      char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->crc_cache_nr));
+}
+static DEVICE_ATTR_RO(crc_cache_entries);
+
+static ssize_t crc_cache_bytes_show(struct device *d, struct device_attribute *attr,
+				    char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->crc_cache_nr) *
+			  sizeof(struct ssr_crc_entry) +
+			  SSR_NUM_MEMBERS * SSR_CRC_SECTORS * sizeof(*dev->crc_cache[0]));
+}
+static DEVICE_ATTR_RO(crc_cache_bytes);
+
+static ssize_t crc_cache_hits_show(struct device *d, struct device_attribute *attr,
+				   char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%lld\n", atomic64_read(&dev->crc_cache_hits));
+}
+static DEVICE_ATTR_RO(crc_cache_hits);
+
+static ssize_t crc_cache_misses_show(struct device *d, struct device_attribute *attr,
+				     char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%lld\n", atomic64_read(&dev->crc_cache_misses));
+}
+static DEVICE_ATTR_RO(crc_cache_misses);
+
+static ssize_t cbt_bytes_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%zu\n", 2 * BITS_TO_LONGS(dev->cbt.nr_bits) *
+			  sizeof(unsigned long));
+}
+static DEVICE_ATTR_RO(cbt_bytes);
+
+static ssize_t unwritten_map_bytes_show(struct device *d, struct device_attribute *attr,
+					char *buf)
+{
+	return sysfs_emit(buf, "%zu\n", BITS_TO_LONGS(LOGICAL_DISK_SECTORS) *
+			  sizeof(unsigned long));
+}
+static DEVICE_ATTR_RO(unwritten_map_bytes);
+
+static ssize_t cmap_bytes_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%zu\n", dev->cmap ?
+			  (size_t)SSR_CMAP_SECTORS * KERNEL_SECTOR_SIZE : 0);
+}
+static DEVICE_ATTR_RO(cmap_bytes);
+
+static ssize_t zone_map_bytes_show(struct device *d, struct device_attribute *attr,
+				   char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+	size_t bytes = 0;
+	int m;
+
+	if (dev->zn)
+		for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+			bytes += dev->zn[m].nr_zones * sizeof(struct ssr_zone) +
+				 LOGICAL_DISK_SECTORS * (sizeof(sector_t) + sizeof(u32) +
+							 sizeof(u64));
+			if (dev->zn[m].emulated)
+				bytes += dev->zn[m].ckpt_sectors * KERNEL_SECTOR_SIZE;
+		}
+
+	return sysfs_emit(buf, "%zu\n", bytes);
+}
+static DEVICE_ATTR_RO(zone_map_bytes);
+
+static ssize_t replica_lag_bytes_show(struct device *d, struct device_attribute *attr,
+				      char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%llu\n", dev->rlog ?
+			  (u64)atomic64_read(&dev->rlog_lag) * KERNEL_SECTOR_SIZE : 0);
+}
+static DEVICE_ATTR_RO(replica_lag_bytes);
+
+static ssize_t replica_synced_bytes_show(struct device *d, struct device_attribute *attr,
+					 char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%llu\n", dev->rlog ?
+			  (u64)READ_ONCE(dev->rlog_cursor) * KERNEL_SECTOR_SIZE : 0);
+}
+static DEVICE_ATTR_RO(replica_synced_bytes);
+
+static ssize_t tier_fast_bytes_show(struct device *d, struct device_attribute *attr,
+				    char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%llu\n", dev->tier.table ?
+			  ((u64)READ_ONCE(dev->tier.nr_fast) * KERNEL_SECTOR_SIZE) <<
+			  dev->tier.shift : 0);
+}
+static DEVICE_ATTR_RO(tier_fast_bytes);
+
+static ssize_t tier_migrated_bytes_show(struct device *d, struct device_attribute *attr,
+					char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%llu\n", READ_ONCE(dev->tier.migrated) * KERNEL_SECTOR_SIZE);
+}
+static DEVICE_ATTR_RO(tier_migrated_bytes);
+
+static ssize_t qd_caps_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+	struct logical_block_dev *dev = dev_to_disk(d)->private_data;
+
+	return sysfs_emit(buf, "%u %u\n", ssr_qd_cap(&dev->members[0]),
+			  ssr_qd_cap(&dev->members[1]));
+}
+static DEVICE_ATTR_RO(qd_caps);
+
+static struct attribute *ssr_attrs[] = {
+	&dev_attr_crc_cache_entries.attr,
+	&dev_attr_crc_cache_bytes.attr,
+	&dev_attr_crc_cache_hits.attr,
+	&dev_attr_crc_cache_misses.attr,
+	&dev_attr_cbt_bytes.attr,
+	&dev_attr_unwritten_map_bytes.attr,
+	&dev_attr_cmap_bytes.attr,
+	&dev_attr_zone_map_bytes.attr,
+	&dev_attr_replica_lag_bytes.attr,
+	&dev_attr_replica_synced_bytes.attr,
+	&dev_attr_tier_fast_bytes.attr,
+	&dev_attr_tier_migrated_bytes.attr,
+	&dev_attr_qd_caps.attr,
+	NULL,
+};
+
+static const struct attribute_group ssr_attr_group = {
+	.name = "ssr",
+	.attrs = ssr_attrs,
+};
+
+static const struct attribute_group *ssr_attr_groups[] = {
+	&ssr_attr_group,
+	NULL,
+};
+
+/**
+ * ssr_csum_get - Copies the stored CRCs of a range of sectors to user space
+ * @dev: Logical device
+ * @uinfo: User pointer to a struct ssr_csum_info
+ *
+ * The CRCs come from the CRC cache or the CRC area, one chunk at a time
+ * under its range lock, so they match the data of completed writes.
+ * Unwritten sectors read as zeroes and report the CRC of a zero sector, as
+ * in ssr_read_sectors(); that includes those the initializer has not
+ * reached yet, and no other sector past its cursor. Faulty members are left
+ * out of the mismatch count, and only supply the CRCs when no healthy
+ * member can.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_csum_get(struct logical_block_dev *dev, struct ssr_csum_info __user *uinfo)
+{
+	__le32 *crcs[SSR_NUM_MEMBERS], *out;
+	struct ssr_csum_info info;
+	sector_t sector, end;
+	int m, err = 0;
+
+	if (copy_from_user(&info, uinfo, sizeof(info)))
+		return -EFAULT;
+
+	/* the compressed and zoned layouts keep no per-sector CRC area */
+	if (dev->zn || dev->cmap)
+		return -EOPNOTSUPP;
+
+	if (info.sector >= LOGICAL_DISK_SECTORS ||
+	    info.nr_sectors > LOGICAL_DISK_SECTORS - info.sector)
+		return -EINVAL;
+
+	crcs[0] = kmalloc_array(SSR_NUM_MEMBERS + 1, KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	if (!crcs[0])
+		return -ENOMEM;
+	for (m = 1; m < SSR_NUM_MEMBERS; m++)
+		crcs[m] = crcs[0] + m * SSR_CRCS_PER_SECTOR;
+	out = crcs[0] + SSR_NUM_MEMBERS * SSR_CRCS_PER_SECTOR;
+
+	info.digest = 0;
+	info.mismatches = 0;
+	end = info.sector + info.nr_sectors;
+
+	for (sector = info.sector; sector < end; ) {
+		unsigned int nr = min_t(sector_t, end - sector,
+					SSR_CHUNK_SECTORS - sector % SSR_CHUNK_SECTORS);
+		bool valid[SSR_NUM_MEMBERS];
+		struct ssr_range range;
+		unsigned int i;
+		int primary = -1;
+
+		ssr_range_lock(dev, &range, sector, nr);
+
+		for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+			valid[m] = !ssr_crc_load(dev, m, sector, nr, crcs[m]);
+			if (valid[m] && !test_bit(m, &dev->state) && primary < 0)
+				primary = m;
+		}
+
+		for (m = 0; m < SSR_NUM_MEMBERS && primary < 0; m++)
+			if (valid[m])
+				primary = m;
+
+		for (i = 0; primary >= 0 && i < nr; i++) {
+			__le32 crc = *ssr_crc_slot(crcs[primary], sector, sector + i);
+
+			if (test_bit(sector + i, dev->unwritten)) {
+				out[i] = cpu_to_le32(ssr_zero_crc);
+				continue;
+			}
+
+			for (m = 0; m < SSR_NUM_MEMBERS; m++)
+				if (m != primary && valid[m] && !test_bit(m, &dev->state) &&
+				    *ssr_crc_slot(crcs[m], sector, sector + i) != crc) {
+					info.mismatches++;
+					break;
+				}
+
+			out[i] = crc;
+		}
+
+		ssr_range_unlock(dev, &range);
+
+		if (primary < 0) {
+			pr_err("ssr_csum_get: CRCs of sector %llu unreadable on all members\n",
+			       (unsigned long long)sector);
+			err = -EIO;
+			break;
+		}
+
+		info.digest = crc32(info.digest, out, nr * sizeof(*out));
+
+		if (info.crcs &&
+		    copy_to_user(u64_to_user_ptr(info.crcs) +
+				 (sector - info.sector) * sizeof(*out),
+				 out, nr * sizeof(*out))) {
+			err = -EFAULT;
+			break;
+		}
+
+		sector += nr;
+	}
+
+	kfree(crcs[0]);
+
+	if (!err && copy_to_user(uinfo, &info, sizeof(info)))
+		return -EFAULT;
+
+	return err;
+}
+
+/**
+ * ssr_block_ioctl - block_device ioctl operation
+ * @bdev: block_device structure containing the device information
+ * @mode: mode in which the device was opened
+ * @cmd: ioctl command
+ * @arg: ioctl argument
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_block_ioctl(struct block_device *bdev, blk_mode_t mode,
+			   unsigned int cmd, unsigned long arg)
+{
+	struct logical_block_dev *dev = bdev->bd_disk->private_data;
+	void __user *argp = (void __user *)arg;
+
+	switch (cmd) {
+	case SSR_IOCTL_CBT_ROTATE:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		ssr_cbt_rotate(&dev->cbt);
+		return 0;
+	case SSR_IOCTL_CBT_GET:
+		return ssr_cbt_get(&dev->cbt, argp);
+	case SSR_IOCTL_CSUM_GET:
+		return ssr_csum_get(dev, argp);
+	}
+
+	return -ENOTTY;
+}
+
+/**
+ * ssr_block_ops - Block device operations for the RAID logical block device
+ *
+ * This structure defines the operations that can be performed on the
+ * RAID logical block device, including open, release, and submit_bio.
+ */
+static const struct block_device_operations ssr_block_ops = {
+	.owner = THIS_MODULE,
+	.open = ssr_block_open,
+	.release = ssr_block_release,
+	.ioctl = ssr_block_ioctl,
+	.submit_bio = ssr_submit_bio,
+};
+
+/**
+ * ssr_init_state - Initializes the array state of a logical device
+ * @dev: Logical device, members already opened
+ * @create: true to create a new array, see ssr_sb_check()
+ *
+ * Sets up everything the engine needs independently of how the array is
+ * exposed: change tracking, the access heatmap, the unwritten map, the CRC
+ * cache, the range lock, the compressed map and the superblock. Zoned
+ * members get the log-structured layout instead of the last two; on
+ * regular members it keeps a superblock too. The superblock records the
+ * layout, and the members are refused if it does not match the configured
+ * one. Shared by the ssr disk and the device-mapper target.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_init_state(struct logical_block_dev *dev, bool create)
+{
+	u64 layout;
+	int err;
+
+	dev->size = LOGICAL_DISK_SIZE;
+
+	spin_lock_init(&dev->event_lock);
+	INIT_LIST_HEAD(&dev->events);
+	INIT_WORK(&dev->event_work, ssr_event_worker);
+
+	err = ssr_cbt_init(&dev->cbt);
+	if (err < 0) {
+		pr_err("ssr_cbt_init: failure\n");
+		goto out;
+	}
+
+	err = ssr_heat_init(&dev->heat);
+	if (err < 0) {
+		pr_err("ssr_heat_init: failure\n");
+		goto out_cbt;
+	}
+
+	dev->unwritten = bitmap_zalloc(LOGICAL_DISK_SECTORS, GFP_KERNEL);
+	if (!dev->unwritten) {
+		pr_err("bitmap_zalloc: failure\n");
+		err = -ENOMEM;
+		goto out_heat;
+	}
+
+	err = ssr_crc_cache_init(dev);
+	if (err < 0) {
+		pr_err("ssr_crc_cache_init: failure\n");
+		goto out_unwritten;
+	}
+
+	spin_lock_init(&dev->range_lock);
+	INIT_LIST_HEAD(&dev->ranges);
+	init_waitqueue_head(&dev->range_wait);
+
+	if (log_segment_kb || ssr_member_zoned(&dev->members[0]) ||
+	    ssr_member_zoned(&dev->members[1])) {
+		if (compress) {
+			pr_err("ssr_init_state: compression is not supported with the log-structured layout\n");
+			err = -EINVAL;
+			goto out_crc_cache;
+		}
+
+		if (dev->meta_file) {
+			pr_err("ssr_init_state: the log-structured layout keeps its metadata in the log\n");
+			err = -EINVAL;
+			goto out_crc_cache;
+		}
+
+		/* zoned disks tell the layout themselves, regular ones a superblock */
+		if (dev->members[0].bdev && dev->members[1].bdev &&
+		    !ssr_member_zoned(&dev->members[0]) && !ssr_member_zoned(&dev->members[1])) {
+			err = ssr_sb_check(dev, SSR_SB_LOG, create);
+			if (!err)
+				err = ssr_sb_init(dev, SSR_SB_LOG, create);
+			if (err < 0) {
+				pr_err("ssr_sb_init: failure\n");
+				goto out_crc_cache;
+			}
+		} else {
+			mutex_init(&dev->sb_mutex);
+			dev->sb_flags = 0;
+			dev->init_cursor = LOGICAL_DISK_SECTORS;
+		}
+
+		err = ssr_zn_init(dev);
+		if (err < 0) {
+			pr_err("ssr_zn_init: failure\n");
+			goto out_crc_cache;
+		}
+
+		INIT_DELAYED_WORK(&dev->init_work, ssr_init_worker);
+
+		return 0;
+	}
+
+	layout = (compress ? SSR_SB_COMPRESSED : 0) | (dev->meta_file ? SSR_SB_META_DEV : 0) |
+		 (dev->tier.names ? SSR_SB_TIERED : 0);
+
+	/* before anything is written to the members */
+	err = ssr_sb_check(dev, layout, create);
+	if (err < 0) {
+		pr_err("ssr_sb_check: failure\n");
+		goto out_crc_cache;
+	}
+
+	if (compress) {
+		err = ssr_cmap_init(dev, create);
+		if (err < 0) {
+			pr_err("ssr_cmap_init: failure\n");
+			goto out_crc_cache;
+		}
+	}
+
+	err = ssr_sb_init(dev, layout, create);
+	if (err < 0) {
+		pr_err("ssr_sb_init: failure\n");
+		goto out_cmap;
+	}
+
+	INIT_DELAYED_WORK(&dev->init_work, ssr_init_worker);
+
+	return 0;
+
+out_cmap:
+	vfree(dev->cmap);
+	dev->cmap = NULL;
+out_crc_cache:
+	ssr_crc_cache_free(dev);
+out_unwritten:
+	bitmap_free(dev->unwritten);
+out_heat:
+	ssr_heat_free(&dev->heat);
+out_cbt:
+	ssr_cbt_free(&dev->cbt);
+out:
+	return err;
+}
+
+/**
+ * ssr_free_state - Releases the array state of a logical device
+ * @dev: Logical device
+ *
+ * Counterpart of ssr_init_state(). The initializer must be stopped and no
+ * request may be in flight.
+ */
+static void ssr_free_state(struct logical_block_dev *dev)
+{
+	ssr_event_stop(dev);
+	if (dev->rlog) {
+		cancel_delayed_work_sync(&dev->rlog_work);
+		vfree(dev->rlog);
+		dev->rlog = NULL;
+	}
+	ssr_tier_free(dev);
+	ssr_zn_free(dev);
+	vfree(dev->cmap);
+	ssr_crc_cache_free(dev);
+	bitmap_free(dev->unwritten);
+	ssr_heat_free(&dev->heat);
+	ssr_cbt_free(&dev->cbt);
+}
+
+/**
+ * create_block_device - Initializes and creates the logical block device
+ * @dev: Pointer to the logical_block_dev structure representing the device
+ *
+ * This function sets up the logical block device, including allocation of the
+ * gendisk with its queue limits, initializing the gendisk structure, and adding
+ * the disk to the system.
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int create_block_device(struct logical_block_dev *dev)
+{
+	struct queue_limits lim = {
+		.logical_block_size = KERNEL_SECTOR_SIZE,
+		.max_hw_sectors = SSR_MAX_SECTORS,
+		.max_write_zeroes_sectors = SSR_MAX_SECTORS,
+		.features = BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA | BLK_FEAT_NOWAIT,
+	};
+	int err;
+
+	err = ssr_init_state(dev, lazy_init);
+	if (err < 0)
+		return err;
+
+	/* before anything that writes data, which may be on the fast tier */
+	if (dev->tier.names) {
+		err = ssr_tier_init(dev);
+		if (err < 0)
+			goto out_state;
+	}
+
+	if (dev->replica.bdev) {
+		err = ssr_rlog_init(dev);
+		if (err < 0)
+			goto out_state;
+	}
+
+	/* the zoned layout has no journal */
+	if (!dev->zn) {
+		err = ssr_jrnl_init(dev);
+		if (err < 0)
+			goto out_state;
+	}
+
+	if (dev->atomic) {
+		lim.atomic_write_hw_max = atomic_write_kb * 1024;
+		lim.atomic_write_hw_unit_min = KERNEL_SECTOR_SIZE;
+		lim.atomic_write_hw_unit_max = atomic_write_kb * 1024;
+#ifdef BLK_FEAT_ATOMIC_WRITES
+		lim.features |= BLK_FEAT_ATOMIC_WRITES;
+#endif
+	}
 
-static struct workqueue_struct *ssr_wq;
+	if (dev->cmap)
+		lim.chunk_sectors = SSR_CHUNK_SECTORS;
+	else if (dev->tier.table)
+		lim.chunk_sectors = 1U << dev->tier.shift;
 
-static struct logical_block_dev logical_raid_block_device;
+#ifdef CONFIG_BLK_DEV_INTEGRITY
+	/* opaque to the block layer: it neither generates nor verifies the CRCs */
+	if (integrity && !dev->zn && !dev->cmap) {
+		lim.integrity.tuple_size = sizeof(__le32);
+		lim.integrity.interval_exp = SECTOR_SHIFT;
+		lim.integrity.csum_type = BLK_INTEGRITY_CSUM_NONE;
+		lim.integrity.flags = BLK_INTEGRITY_NOVERIFY | BLK_INTEGRITY_NOGENERATE;
+		dev->integrity = true;
+	}
+#endif
+
+	dev->gd = blk_alloc_disk(&lim, NUMA_NO_NODE);
+
+	if (IS_ERR(dev->gd)) {
+		pr_err("blk_alloc_disk: failure\n");
+		err = PTR_ERR(dev->gd);
+		dev->gd = NULL;
+		goto out_state;
+	}
+
+	dev->gd->major = SSR_MAJOR;
+	dev->gd->first_minor = SSR_FIRST_MINOR;
+	dev->gd->minors = SSR_NUM_MINORS;
+	dev->gd->fops = &ssr_block_ops;
+	dev->gd->private_data = dev;
+	snprintf(dev->gd->disk_name, DISK_NAME_LEN, LOGICAL_DEV_NAME);
+	set_capacity(dev->gd, LOGICAL_DISK_SECTORS);
+
+	err = device_add_disk(NULL, dev->gd, ssr_attr_groups);
+	if (err) {
+		pr_err("device_add_disk: failure\n");
+		goto out_put_disk;
+	}
+
+	ssr_event_start(dev, dev->gd);
+
+	if (dev->heat.cpu)
+		dev->heat.dentry = debugfs_create_file("heatmap", 0400, ssr_debugfs,
+						       &dev->heat, &ssr_heat_fops);
+
+	if (dev->sb_flags & SSR_SB_INITIALIZING)
+		queue_delayed_work(ssr_wq, &dev->init_work, 0);
+	if (dev->rlog)
+		queue_delayed_work(ssr_wq, &dev->rlog_work, 0);
+	if (dev->tier.table)
+		queue_delayed_work(ssr_wq, &dev->tier.work, HZ);
 
-static struct block_device *phys_bdev_vdb;
-static struct block_device *phys_bdev_vdc;
+	return 0;
+
+out_put_disk:
+	put_disk(dev->gd);
+	dev->gd = NULL;
+out_state:
+	ssr_free_state(dev);
+	return err;
+}
 
 /**
- * ssr_block_open - block_device open operation
- * @bdev: block_device structure containing the device information
- * @mode: mode in which the device is to be opened
+ * open_disk - Opens a physical block device by its name
+ * @name: Name of the physical block device to open
  *
- * This function is called when the block device is opened.
- * Currently, it performs no specific action and always returns 0.
+ * This function opens the specified block device with read and write permissions,
+ * and exclusive access. It returns the file representing the opened device, or
+ * NULL if the device could not be opened; file_bdev() gives its block_device.
+ *
+ * Returns a pointer to the bdev file on success, or NULL on failure.
  */
-static int ssr_block_open(struct block_device *bdev, fmode_t mode)
+static struct file *open_disk(const char *name)
 {
-	return 0;
+	struct file *bdev_file;
+
+	bdev_file = bdev_file_open_by_path(name, BLK_OPEN_READ | BLK_OPEN_WRITE,
+					   &logical_raid_block_device, NULL);
+	if (IS_ERR(bdev_file))
+		return NULL;
+
+	return bdev_file;
 }
 
 /**
- * ssr_block_release - block_device release operation
- * @gd: gendisk structure containing the disk information
- * @mode: mode in which the device was opened
+ * close_disk - Closes a previously opened block device
+ * @bdev_file: bdev file returned by open_disk()
  *
- * This function is called when the block device is released.
- * Currently, it performs no specific action.
+ * This function releases the block device that was previously opened with
+ * open_disk(), freeing any associated resources.
  */
-static void ssr_block_release(struct gendisk *gd, fmode_t mode)
+static void close_disk(struct file *bdev_file)
 {
+	fput(bdev_file);
 }
 
 /**
- * process_device - Processes the read/write requests on a given device
- * @bio_from_up: Bio structure representing the original request
- * @data_bio_from_down: Bio structure representing the data part from physical device sector
- * @crc32_bio_from_down: Bio structure representing the CRC32 part from physical device sector
- *
- * This function processes the bio segments, calculates CRC32 checksums,
- * and verifies their integrity. It handles both read and write operations.
+ * ssr_member_close - Releases a member of /dev/ssr
+ * @m: Member, a disk or a built-in member
  */
-static void process_device(struct bio *bio_from_up, struct bio *data_bio_from_down, struct bio *crc32_bio_from_down)
+static void ssr_member_close(struct ssr_member *m)
 {
-	int dir = bio_data_dir(bio_from_up);
-
-	struct bio_vec data_bvec, crc32_bvec;
-	struct bvec_iter data_iter;
-	u32 crc_vdb, crc_vdc;
-
-	bio_for_each_segment(data_bvec, data_bio_from_down, data_iter) {
-
-		size_t size;
-		unsigned long data_offset;
-		unsigned long crc32_offset;
-		char *data_buffer, *crc32_buffer;
-
-		crc32_bvec = bio_iter_iovec(crc32_bio_from_down, data_iter);
+	if (m->null)
+		ssr_null_free(m);
+	else
+		close_disk(m->bdev_file);
+}
 
-		size = data_bvec.bv_len;
-		data_offset = data_bvec.bv_offset;
-		crc32_offset = crc32_bvec.bv_offset;
+/**
+ * ssr_tier_open - Opens the fast members named by fast_disks
+ * @tier: Tiering state
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_tier_open(struct ssr_tier *tier)
+{
+	char *p, *name;
+	int m;
 
-		data_buffer = kmap_atomic(data_bvec.bv_page);
-		crc32_buffer = kmap_atomic(crc32_bvec.bv_page);
+	tier->names = kstrdup(fast_disks, GFP_KERNEL);
+	if (!tier->names)
+		return -ENOMEM;
 
-		crc_vdb = crc32(0, data_buffer + data_offset, size);
-		crc_vdc = crc32(0, crc32_buffer + crc32_offset, size);
+	p = tier->names;
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		name = strsep(&p, ",");
+		if (!name || !*name || (m == SSR_NUM_MEMBERS - 1 && p)) {
+			pr_err("ssr_tier_open: fast_disks must name %d devices\n",
+			       SSR_NUM_MEMBERS);
+			goto out_close;
+		}
 
-		if (crc_vdb != crc_vdc) {
-			kunmap_atomic(data_buffer);
-			kunmap_atomic(crc32_buffer);
-			return;
+		tier->fast[m].name = name;
+		tier->fast[m].bdev_file = open_disk(name);
+		if (!tier->fast[m].bdev_file) {
+			pr_err("open_disk: No such device (%s)\n", name);
+			goto out_close;
 		}
+		tier->fast[m].bdev = file_bdev(tier->fast[m].bdev_file);
+	}
 
-		if (dir == REQ_OP_READ) {
-			char *buffer_from_up = kmap_atomic(data_bvec.bv_page);
+	return 0;
 
-			memcpy(buffer_from_up + data_offset, data_buffer + data_offset, size);
-			memcpy(buffer_from_up + crc32_offset, crc32_buffer + crc32_offset, size);
+out_close:
+	while (m--)
+		close_disk(tier->fast[m].bdev_file);
+	memset(tier->fast, 0, sizeof(tier->fast));
+	kfree(tier->names);
+	tier->names = NULL;
+	return -EINVAL;
+}
 
-			kunmap_atomic(buffer_from_up);
+/**
+ * ssr_tier_close - Closes the fast members
+ * @tier: Tiering state, opened or not
+ */
+static void ssr_tier_close(struct ssr_tier *tier)
+{
+	int m;
 
-		} else if (dir == REQ_OP_WRITE) {
-			memcpy(data_buffer + data_offset, data_buffer + data_offset, size);
-			memcpy(crc32_buffer + crc32_offset, data_buffer + crc32_offset, size);
-		}
+	if (!tier->names)
+		return;
 
-		kunmap_atomic(data_buffer);
-		kunmap_atomic(crc32_buffer);
-	}
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		close_disk(tier->fast[m].bdev_file);
+	memset(tier->fast, 0, sizeof(tier->fast));
+	kfree(tier->names);
+	tier->names = NULL;
 }
 
 /**
- * ssr_handle_requests - Handles read and write requests for the RAID logical block device
- * @work: Work structure containing the request data
+ * delete_block_device - Cleans up and deletes the logical block device
+ * @dev: Pointer to the logical_block_dev structure representing the device
  *
- * This function is executed in a workqueue context. It handles bio
- * requests by processing them for both primary and CRC32 verification.
+ * This function deletes the logical block device by removing the gendisk structure
+ * and cleaning up the request queue.
  */
-static void ssr_handle_requests(struct work_struct *work)
+static void delete_block_device(struct logical_block_dev *dev)
 {
-	struct ssr_work *ssrwork = container_of(work, struct ssr_work, work);
-	struct bio *bio_from_up = ssrwork->bio_from_up;
-	struct bio *data_bio_from_down = ssrwork->data_bio_from_down;
-	struct bio *crc32_bio_from_down = ssrwork->crc32_bio_from_down;
-
-	data_bio_from_down->bi_disk = phys_bdev_vdb->bd_disk;
-	crc32_bio_from_down->bi_disk = phys_bdev_vdb->bd_disk;
-
-	process_device(bio_from_up, data_bio_from_down, crc32_bio_from_down);
-
-	data_bio_from_down->bi_disk = phys_bdev_vdc->bd_disk;
-	crc32_bio_from_down->bi_disk = phys_bdev_vdc->bd_disk;
+	if (dev->gd) {
+		del_gendisk(dev->gd);
+		put_disk(dev->gd);
+	}
 
-	process_device(bio_from_up, data_bio_from_down, crc32_bio_from_down);
+	ssr_free_state(dev);
+}
 
-	submit_bio_wait(crc32_bio_from_down);
-	submit_bio_wait(data_bio_from_down);
+#if IS_ENABLED(CONFIG_BLK_DEV_DM)
+/**
+ * ssr_dm_handle_requests - Handles a request of a device-mapper array
+ * @work: Work structure in the per-bio data of the request
+ *
+ * Unlike ssr_handle_requests(), the work structure belongs to the bio and is
+ * released by device-mapper.
+ */
+static void ssr_dm_handle_requests(struct work_struct *work)
+{
+	struct ssr_work *ssrwork = container_of(work, struct ssr_work, work);
 
-	kfree(ssrwork);
-	bio_endio(bio_from_up);
+	ssr_handle_bio(ssrwork->dev, ssrwork->bio_from_up);
 }
 
 /**
- * ssr_submit_bio - Submits a bio request to the RAID logical block device
- * @bio_from_up: Bio structure representing the request
+ * ssr_dm_ctr - Constructs an ssr device-mapper target
+ * @ti: Target being constructed
+ * @argc: Number of table arguments
+ * @argv: Table arguments, "<dev1> <dev2> [create]"
  *
- * This function allocates bio structures for data and CRC32 operations,
- * maps the bio segments, and queues the request for processing.
+ * The members are used with the same layout as the ssr disk, so a target
+ * can be pointed at members previously used by the ssr disk and vice versa.
+ * "create" initializes a new array like the lazy_init parameter does, and
+ * is refused over an existing one unless the force parameter is set.
  *
- * Returns a blk_qc_t value indicating the status of the request.
+ * Returns 0 on success or a negative error code on failure.
  */
-static blk_qc_t ssr_submit_bio(struct bio *bio_from_up)
+static int ssr_dm_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
-	struct bio *data_bio_from_down, *crc32_bio_from_down;
-	struct bio_vec bvec;
-	struct bvec_iter iter;
-	struct ssr_work *ssrwork;
-	struct page *data_page, *crc32_page;
-	struct completion comp;
-	int ret = BLK_QC_T_NONE;
-	int dir = bio_data_dir(bio_from_up);
+	struct logical_block_dev *dev;
+	bool create = false;
+	int err, m;
 
-	data_bio_from_down = bio_alloc(GFP_NOIO, bio_from_up->bi_vcnt);
-
-	if (!data_bio_from_down) {
-		ret = BLK_STS_RESOURCE;
-		goto out;
+	if (argc == SSR_NUM_MEMBERS + 1 && !strcmp(argv[SSR_NUM_MEMBERS], "create")) {
+		create = true;
+	} else if (argc != SSR_NUM_MEMBERS) {
+		ti->error = "Invalid argument count";
+		return -EINVAL;
 	}
 
-	crc32_bio_from_down = bio_alloc(GFP_NOIO, bio_from_up->bi_vcnt);
-
-	if (!crc32_bio_from_down) {
-		ret = BLK_STS_RESOURCE;
-		goto crc32_bio_fail;
+	if (ti->len > LOGICAL_DISK_SECTORS) {
+		ti->error = "Target larger than the array";
+		return -EINVAL;
 	}
 
-	bio_for_each_segment(bvec, bio_from_up, iter) {
-		sector_t sector = iter.bi_sector;
-		unsigned long offset = bvec.bv_offset;
-		size_t len = bvec.bv_len;
-		char *buffer_from_up = kmap(bvec.bv_page);
-
-		data_bio_from_down->bi_iter.bi_sector = sector;
-		crc32_bio_from_down->bi_iter.bi_sector = sector;
-
-		data_bio_from_down->bi_opf = dir;
-		crc32_bio_from_down->bi_opf = dir;
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev) {
+		ti->error = "Cannot allocate array";
+		return -ENOMEM;
+	}
 
-		data_page = alloc_page(GFP_NOIO);
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		struct dm_dev *dm_dev;
 
-		if (!data_page) {
-			ret = BLK_STS_RESOURCE;
-			goto data_page_fail;
+		err = dm_get_device(ti, argv[m], dm_table_get_mode(ti->table), &dm_dev);
+		if (err) {
+			ti->error = "Member lookup failed";
+			goto out_put_device;
 		}
 
-		crc32_page = alloc_page(GFP_NOIO);
+		dev->members[m].name = dm_dev->name;
+		dev->members[m].bdev = dm_dev->bdev;
+		dev->members[m].dm_dev = dm_dev;
 
-		if (!crc32_page) {
-			ret = BLK_STS_RESOURCE;
-			goto crc32_page_fail;
+		if (bdev_nr_sectors(dm_dev->bdev) <= SSR_SB_SECTOR) {
+			ti->error = "Member too small";
+			err = -EINVAL;
+			m++;
+			goto out_put_device;
 		}
 
-		bio_add_page(data_bio_from_down, data_page, len, offset);
+		if (bdev_is_zoned(dm_dev->bdev)) {
+			ti->error = "Zoned members are only supported by /dev/ssr";
+			err = -EINVAL;
+			m++;
+			goto out_put_device;
+		}
+	}
 
-		bio_add_page(crc32_bio_from_down, crc32_page, len, offset);
+	err = ssr_init_state(dev, create);
+	if (err < 0) {
+		ti->error = "Cannot initialize array";
+		goto out_put_device;
+	}
 
-		ssrwork = kmalloc(sizeof(*ssrwork), GFP_KERNEL);
-		if (!ssrwork) {
-			ret = BLK_STS_RESOURCE;
-			goto ssrwork_failed;
-		}
+	err = dm_set_target_max_io_len(ti, SSR_MAX_SECTORS);
+	if (err) {
+		ti->error = "Cannot set max io len";
+		goto out_state;
+	}
 
-		INIT_WORK(&ssrwork->work, ssr_handle_requests);
-		ssrwork->bio_from_up = bio_from_up;
-		ssrwork->data_bio_from_down = data_bio_from_down;
-		ssrwork->crc32_bio_from_down = crc32_bio_from_down;
-		ssrwork->buffer_from_up = buffer_from_up + offset;
-		queue_work(ssr_wq, &ssrwork->work);
+	ti->num_flush_bios = 1;
+	ti->num_discard_bios = 0;
+	ti->num_write_zeroes_bios = 1;
+	ti->per_io_data_size = sizeof(struct ssr_work);
+	ti->private = dev;
 
-		kunmap(bvec.bv_page);
+	ssr_event_start(dev, dm_disk(dm_table_get_md(ti->table)));
 
-		return ret;
-	}
+	return 0;
 
-ssrwork_failed:
-crc32_page_fail:
-	__free_page(crc32_page);
-data_page_fail:
-	bio_put(crc32_bio_from_down);
-crc32_bio_fail:
-	bio_put(data_bio_from_down);
-out:
-	bio_endio(bio_from_up);
-	return ret;
+out_state:
+	ssr_free_state(dev);
+out_put_device:
+	while (m--)
+		dm_put_device(ti, dev->members[m].dm_dev);
+	kfree(dev);
+	return err;
 }
 
 /**
- * ssr_block_ops - Block device operations for the RAID logical block device
+ * ssr_dm_dtr - Destroys an ssr device-mapper target
+ * @ti: Target being destroyed
  *
- * This structure defines the operations that can be performed on the
- * RAID logical block device, including open, release, and submit_bio.
+ * The target was suspended before, so the initializer is already stopped.
  */
-static const struct block_device_operations ssr_block_ops = {
-	.owner = THIS_MODULE,
-	.open = ssr_block_open,
-	.release = ssr_block_release,
-	.submit_bio = ssr_submit_bio,
-};
+static void ssr_dm_dtr(struct dm_target *ti)
+{
+	struct logical_block_dev *dev = ti->private;
+	int m;
+
+	cancel_delayed_work_sync(&dev->init_work);
+	ssr_free_state(dev);
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		dm_put_device(ti, dev->members[m].dm_dev);
+	kfree(dev);
+}
 
 /**
- * create_block_device - Initializes and creates the logical block device
- * @dev: Pointer to the logical_block_dev structure representing the device
+ * ssr_dm_map - Maps a bio of an ssr device-mapper target
+ * @ti: Target
+ * @bio: Bio to map, already split to SSR_MAX_SECTORS boundaries
  *
- * This function sets up the logical block device, including allocation of the
- * request queue, setting the logical block size, initializing the gendisk structure,
- * and adding the disk to the system.
+ * The bio is handled by ssr_wq like a request to the ssr disk.
  *
- * Returns 0 on success or a negative error code on failure.
+ * Returns DM_MAPIO_SUBMITTED.
  */
-static int create_block_device(struct logical_block_dev *dev)
+static int ssr_dm_map(struct dm_target *ti, struct bio *bio)
 {
-	int err;
-
-	dev->size = LOGICAL_DISK_SIZE;
+	struct logical_block_dev *dev = ti->private;
+	struct ssr_work *ssrwork = dm_per_bio_data(bio, sizeof(struct ssr_work));
 
-	dev->queue = blk_alloc_queue(NUMA_NO_NODE);
+	if (bio_sectors(bio))
+		bio->bi_iter.bi_sector = dm_target_offset(ti, bio->bi_iter.bi_sector);
 
-	if (!dev->queue) {
-		pr_err("blk_alloc_queue: failure\n");
-		err = -ENOMEM;
-		goto out_vmalloc;
-	}
+	ssr_trace_bio(bio);
+	ssr_heat_mark(&dev->heat, bio);
 
-	blk_queue_logical_block_size(dev->queue, KERNEL_SECTOR_SIZE);
-	dev->queue->queuedata = dev;
+	if (op_is_write(bio_op(bio)))
+		ssr_cbt_mark(&dev->cbt, bio->bi_iter.bi_sector, bio_sectors(bio));
 
-	dev->gd = alloc_disk(SSR_NUM_MINORS);
+	INIT_WORK(&ssrwork->work, ssr_dm_handle_requests);
+	ssrwork->dev = dev;
+	ssrwork->bio_from_up = bio;
+	ssr_queue_work(ssrwork);
 
-	if (!dev->gd) {
-		pr_err("alloc_disk: failure\n");
-		err = -ENOMEM;
-		goto out_alloc_disk;
-	}
+	return DM_MAPIO_SUBMITTED;
+}
 
-	dev->gd->major = SSR_MAJOR;
-	dev->gd->first_minor = SSR_FIRST_MINOR;
-	dev->gd->fops = &ssr_block_ops;
-	dev->gd->queue = dev->queue;
-	dev->gd->private_data = dev;
-	snprintf(dev->gd->disk_name, DISK_NAME_LEN, LOGICAL_DEV_NAME);
-	set_capacity(dev->gd, LOGICAL_DISK_SECTORS);
+/**
+ * ssr_dm_postsuspend - Stops the initializer of a suspended target
+ * @ti: Target
+ *
+ * The cursor and the map of regular members in the log-structured layout
+ * are persisted, so the next table picks up where this one left.
+ */
+static void ssr_dm_postsuspend(struct dm_target *ti)
+{
+	struct logical_block_dev *dev = ti->private;
 
-	add_disk(dev->gd);
+	cancel_delayed_work_sync(&dev->init_work);
+	if (dev->sb_flags & SSR_SB_INITIALIZING)
+		ssr_sb_write(dev);
+	ssr_zn_ckpt_stop(dev);
+}
 
-	return 0;
+/**
+ * ssr_dm_resume - Restarts the initializer of a resumed target
+ * @ti: Target
+ */
+static void ssr_dm_resume(struct dm_target *ti)
+{
+	struct logical_block_dev *dev = ti->private;
 
-out_alloc_disk:
-	blk_cleanup_queue(dev->queue);
-out_vmalloc:
-	return err;
+	if (dev->sb_flags & SSR_SB_INITIALIZING)
+		queue_delayed_work(ssr_wq, &dev->init_work, 0);
+	if (dev->zn && dev->zn_emulated)
+		queue_delayed_work(ssr_wq, &dev->zn_ckpt_work,
+				   max_t(unsigned int, log_checkpoint_s, 1) * HZ);
 }
 
 /**
- * open_disk - Opens a physical block device by its name
- * @name: Name of the physical block device to open
+ * ssr_dm_status - Reports the table or the state of an ssr target
+ * @ti: Target
+ * @type: STATUSTYPE_INFO or STATUSTYPE_TABLE
+ * @status_flags: Unused
+ * @result: Output buffer
+ * @maxlen: Size of @result
  *
- * This function opens the specified block device with read and write permissions,
- * and exclusive access. It returns a pointer to the block_device structure representing
- * the opened device, or NULL if the device could not be opened.
+ * INFO is "<crc cache hits> <crc cache misses> <initialized sectors>".
+ */
+static void ssr_dm_status(struct dm_target *ti, status_type_t type,
+			  unsigned int status_flags, char *result, unsigned int maxlen)
+{
+	struct logical_block_dev *dev = ti->private;
+	unsigned int sz = 0;
+
+	switch (type) {
+	case STATUSTYPE_INFO:
+		DMEMIT("%lld %lld %llu",
+		       atomic64_read(&dev->crc_cache_hits),
+		       atomic64_read(&dev->crc_cache_misses),
+		       (unsigned long long)READ_ONCE(dev->init_cursor));
+		break;
+	case STATUSTYPE_TABLE:
+		DMEMIT("%s %s", dev->members[0].name, dev->members[1].name);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * ssr_dm_iterate_devices - Calls @fn for every member of an ssr target
+ * @ti: Target
+ * @fn: Callback
+ * @data: Callback data
  *
- * Returns a pointer to the block_device structure on success, or NULL on failure.
+ * Metadata lives past the data area, so only the data area is reported.
  */
-static struct block_device *open_disk(char *name)
+static int ssr_dm_iterate_devices(struct dm_target *ti,
+				  iterate_devices_callout_fn fn, void *data)
 {
-	struct block_device *bdev;
+	struct logical_block_dev *dev = ti->private;
+	int m, ret = 0;
 
-	bdev = blkdev_get_by_path(name, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
-							  THIS_MODULE);
-	if (IS_ERR(bdev))
-		return NULL;
+	for (m = 0; m < SSR_NUM_MEMBERS && !ret; m++)
+		ret = fn(ti, dev->members[m].dm_dev, 0, ti->len, data);
 
-	return bdev;
+	return ret;
 }
 
 /**
- * close_disk - Closes a previously opened block device
- * @bdev: Pointer to the block_device structure representing the device
- *
- * This function releases the block device that was previously opened with
- * open_disk(), freeing any associated resources.
+ * ssr_dm_io_hints - Advertises the limits of an ssr target
+ * @ti: Target
+ * @limits: Queue limits of the mapped device
  */
-static void close_disk(struct block_device *bdev)
+static void ssr_dm_io_hints(struct dm_target *ti, struct queue_limits *limits)
 {
-	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	struct logical_block_dev *dev = ti->private;
+
+	limits->logical_block_size = KERNEL_SECTOR_SIZE;
+	limits->max_write_zeroes_sectors = SSR_MAX_SECTORS;
+	limits->max_hw_discard_sectors = 0;
+	if (dev->cmap)
+		limits->chunk_sectors = SSR_CHUNK_SECTORS;
 }
 
+static struct target_type ssr_dm_target = {
+	.name = LOGICAL_DEV_NAME,
+	.version = {1, 0, 0},
+	.module = THIS_MODULE,
+	.features = DM_TARGET_NOWAIT,
+	.ctr = ssr_dm_ctr,
+	.dtr = ssr_dm_dtr,
+	.map = ssr_dm_map,
+	.postsuspend = ssr_dm_postsuspend,
+	.resume = ssr_dm_resume,
+	.status = ssr_dm_status,
+	.iterate_devices = ssr_dm_iterate_devices,
+	.io_hints = ssr_dm_io_hints,
+};
+#endif
+
 /**
- * delete_block_device - Cleans up and deletes the logical block device
- * @dev: Pointer to the logical_block_dev structure representing the device
+ * ssr_disk_open - Opens the member disks and creates /dev/ssr on top of them
+ * @dev: Logical device
  *
- * This function deletes the logical block device by removing the gendisk structure
- * and cleaning up the request queue.
+ * Returns 0 on success or a negative error code on failure: -ENODEV if a
+ * member disk does not exist.
  */
-static void delete_block_device(struct logical_block_dev *dev)
+static int ssr_disk_open(struct logical_block_dev *dev)
 {
-	if (dev->gd) {
-		del_gendisk(dev->gd);
-		put_disk(dev->gd);
+	int err = 0;
+	int m;
+
+	if (null_members && strcmp(null_members, "ram") && strcmp(null_members, "discard")) {
+		pr_err("ssr_disk_open: null_members must be \"ram\" or \"discard\"\n");
+		return -EINVAL;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (null_members) {
+			err = ssr_null_init(&dev->members[m], ssr_null_names[m]);
+			if (err < 0) {
+				pr_err("ssr_null_init: failure\n");
+				goto out_open_disk;
+			}
+			continue;
+		}
+
+		dev->members[m].name = ssr_member_names[m];
+		dev->members[m].bdev_file = open_disk(ssr_member_names[m]);
+		if (dev->members[m].bdev_file == NULL) {
+			pr_err("open_disk: No such device (%s)\n",
+				   ssr_member_names[m]);
+			err = -ENODEV;
+			goto out_open_disk;
+		}
+		dev->members[m].bdev = file_bdev(dev->members[m].bdev_file);
+	}
+
+	if (meta_dev) {
+		dev->meta_file = open_disk(meta_dev);
+		if (dev->meta_file == NULL) {
+			pr_err("open_disk: No such device (%s)\n", meta_dev);
+			err = -EINVAL;
+			goto out_open_disk;
+		}
+
+		if (bdev_nr_sectors(file_bdev(dev->meta_file)) <
+		    SSR_NUM_MEMBERS * SSR_META_SECTORS) {
+			pr_err("ssr_disk_open: %s is too small for the metadata\n", meta_dev);
+			err = -EINVAL;
+			goto out_open_meta;
+		}
+
+		for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+			dev->members[m].meta_bdev = file_bdev(dev->meta_file);
+			dev->members[m].meta_offset = m * SSR_META_SECTORS;
+		}
 	}
 
-	if (dev->queue)
-		blk_cleanup_queue(dev->queue);
+	if (replica) {
+		dev->replica.name = replica;
+		dev->replica.bdev_file = open_disk(replica);
+		if (dev->replica.bdev_file == NULL) {
+			pr_err("open_disk: No such device (%s)\n", replica);
+			err = -EINVAL;
+			goto out_open_meta;
+		}
+		dev->replica.bdev = file_bdev(dev->replica.bdev_file);
+	}
+
+	if (fast_disks) {
+		err = ssr_tier_open(&dev->tier);
+		if (err < 0)
+			goto out_open_replica;
+	}
+
+	err = create_block_device(dev);
+	if (err < 0)
+		goto out_open_fast;
+
+	return 0;
+
+out_open_fast:
+	ssr_tier_close(&dev->tier);
+out_open_replica:
+	if (dev->replica.bdev_file)
+		close_disk(dev->replica.bdev_file);
+out_open_meta:
+	if (dev->meta_file)
+		close_disk(dev->meta_file);
+	m = SSR_NUM_MEMBERS;
+out_open_disk:
+	while (m--)
+		ssr_member_close(&dev->members[m]);
+	return err;
+}
+
+/**
+ * ssr_disk_close - Deletes /dev/ssr and closes the disks under it
+ * @dev: Logical device, its background work stopped
+ */
+static void ssr_disk_close(struct logical_block_dev *dev)
+{
+	int m;
+
+	delete_block_device(dev);
+	ssr_tier_close(&dev->tier);
+	if (dev->replica.bdev_file)
+		close_disk(dev->replica.bdev_file);
+	if (dev->meta_file)
+		close_disk(dev->meta_file);
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		ssr_member_close(&dev->members[m]);
 }
 
 /**
  * ssr_init - Module initialization function
  *
  * This function is called when the module is loaded. It creates the workqueue,
- * registers the block device, and initializes the logical block device.
+ * registers the block device, opens the member disks and initializes the
+ * logical block device on top of them, then registers the "ssr"
+ * device-mapper target. The target does not need /dev/ssr: when the member
+ * disks do not exist, it is registered alone.
  *
  * Returns 0 on success or a negative error code on failure.
  */
 static int __init ssr_init(void)
 {
+	struct logical_block_dev *dev = &logical_raid_block_device;
 	int err = 0;
 
-	ssr_wq = create_singlethread_workqueue("ssr_workqueue");
+	ssr_zero_crc = crc32(0, page_address(ZERO_PAGE(0)), KERNEL_SECTOR_SIZE);
+
+	ssr_wq = alloc_workqueue("ssr_workqueue", WQ_MEM_RECLAIM, 0);
 	if (!ssr_wq) {
-		pr_err("create_singlethread_workqueue: failure\n");
+		pr_err("alloc_workqueue: failure\n");
+		return -ENOMEM;
+	}
+
+	ssr_work_pool = mempool_create_kmalloc_pool(SSR_WORK_POOL_MIN, sizeof(struct ssr_work));
+	if (!ssr_work_pool) {
+		pr_err("mempool_create_kmalloc_pool: failure\n");
+		destroy_workqueue(ssr_wq);
 		return -ENOMEM;
 	}
 
+	err = ssr_trace_init();
+	if (err < 0) {
+		pr_err("ssr_trace_init: failure\n");
+		mempool_destroy(ssr_work_pool);
+		destroy_workqueue(ssr_wq);
+		return err;
+	}
+
+	ssr_debugfs_init();
+
+	err = ssr_poll_start();
+	if (err < 0) {
+		pr_err("ssr_poll_start: failure\n");
+		ssr_debugfs_exit();
+		mempool_destroy(ssr_work_pool);
+		destroy_workqueue(ssr_wq);
+		return err;
+	}
+
 	err = register_blkdev(SSR_MAJOR, LOGICAL_DEV_NAME);
 	if (err < 0) {
 		pr_err("register_blkdev: unable to register\n");
+		ssr_poll_stop();
+		ssr_debugfs_exit();
+		mempool_destroy(ssr_work_pool);
 		destroy_workqueue(ssr_wq);
 		return err;
 	}
 
-	err = create_block_device(&logical_raid_block_device);
-	if (err < 0)
-		goto out_register_blkdev;
+	err = ssr_disk_open(dev);
+	if (err == -ENODEV && IS_ENABLED(CONFIG_BLK_DEV_DM))
+		pr_info("ssr_init: no member disks, only the dm target is available\n");
+	else if (err < 0)
+		goto out_register;
 
-	phys_bdev_vdb = open_disk(PHYSICAL_DISK1_NAME);
-	if (phys_bdev_vdb == NULL) {
-		pr_err("open_disk: No such device (%s)\n",
-			   PHYSICAL_DISK1_NAME);
-		err = -EINVAL;
-		goto out_block_device;
+#if IS_ENABLED(CONFIG_BLK_DEV_DM)
+	err = dm_register_target(&ssr_dm_target);
+	if (err < 0) {
+		pr_err("dm_register_target: failure\n");
+		goto out_disk_open;
 	}
+#endif
 
-	phys_bdev_vdc = open_disk(PHYSICAL_DISK2_NAME);
-	if (phys_bdev_vdc == NULL) {
-		pr_err("open_disk: No such device (%s)\n",
-			   PHYSICAL_DISK2_NAME);
-		err = -EINVAL;
-		goto out_vdb_open_disk;
-	}
+	/* the in-kernel policy keeps working without BPF */
+	if (ssr_policy_register() < 0)
+		pr_warn("ssr_policy_register: BPF read policies are unavailable\n");
 
 	return 0;
 
-out_vdb_open_disk:
-	close_disk(phys_bdev_vdb);
-out_block_device:
-	delete_block_device(&logical_raid_block_device);
-out_register_blkdev:
+#if IS_ENABLED(CONFIG_BLK_DEV_DM)
+out_disk_open:
+	if (dev->gd) {
+		cancel_delayed_work_sync(&dev->init_work);
+		ssr_disk_close(dev);
+	}
+#endif
+out_register:
 	unregister_blkdev(SSR_MAJOR, LOGICAL_DEV_NAME);
+	ssr_poll_stop();
+	ssr_debugfs_exit();
+	mempool_destroy(ssr_work_pool);
 	destroy_workqueue(ssr_wq);
 	return err;
 }
@@ -439,16 +7614,45 @@ out_register_blkdev:
  */
 static void __exit ssr_exit(void)
 {
+	struct logical_block_dev *dev = &logical_raid_block_device;
+	bool disk = dev->gd;
+
+#if IS_ENABLED(CONFIG_BLK_DEV_DM)
+	dm_unregister_target(&ssr_dm_target);
+#endif
+
+	if (disk) {
+		cancel_delayed_work_sync(&dev->init_work);
+		if (dev->sb_flags & SSR_SB_INITIALIZING)
+			ssr_sb_write(dev);
+
+		if (dev->rlog) {
+			cancel_delayed_work_sync(&dev->rlog_work);
+			ssr_rlog_write_header(dev);
+		}
+
+		if (dev->tier.table)
+			cancel_delayed_work_sync(&dev->tier.work);
+
+		ssr_zn_ckpt_stop(dev);
+	}
+
+	ssr_poll_stop();
 	flush_workqueue(ssr_wq);
+	mempool_destroy(ssr_work_pool);
 	destroy_workqueue(ssr_wq);
 
-	delete_block_device(&logical_raid_block_device);
-	close_disk(phys_bdev_vdb);
-	close_disk(phys_bdev_vdc);
+	if (disk)
+		ssr_disk_close(dev);
 
 	unregister_blkdev(SSR_MAJOR, LOGICAL_DEV_NAME);
+	ssr_debugfs_exit();
 }
 
+#if IS_ENABLED(CONFIG_SSR_KUNIT_TEST)
+#include "ssr_test.c"
+#endif
+
 module_init(ssr_init);
 module_exit(ssr_exit);
 
@@ -5,6 +5,8 @@
 #ifndef SSR_H_
 #define SSR_H_	1
 
+#include <linux/types.h>
+
 #define SSR_MAJOR	240
 #define SSR_FIRST_MINOR		0
 #define SSR_NUM_MINORS	1
@@ -20,7 +22,100 @@
 #define LOGICAL_DISK_SIZE	(95 * 1024 * 1024)
 #define LOGICAL_DISK_SECTORS	((LOGICAL_DISK_SIZE) / (KERNEL_SECTOR_SIZE))
 
+/* CRC area - one little-endian CRC32 per sector, right after the data */
+#define SSR_CRC_SIZE		4
+#define SSR_CRCS_PER_SECTOR	((KERNEL_SECTOR_SIZE) / (SSR_CRC_SIZE))
+#define SSR_CRC_FIRST_SECTOR	(LOGICAL_DISK_SECTORS)
+#define SSR_CRC_SECTORS		((LOGICAL_DISK_SECTORS) / (SSR_CRCS_PER_SECTOR))
+
 /* sync data */
 #define SSR_IOCTL_SYNC	1
 
+/* changed-block tracking */
+#define SSR_IOCTL_CBT_ROTATE	2
+#define SSR_IOCTL_CBT_GET	3
+
+/*
+ * Argument of SSR_IOCTL_CBT_GET. The bitmap describes the last closed
+ * epoch: bit i is set if the granularity-sized region i was written
+ * during that epoch. On input nr_bits is the capacity of the buffer at
+ * bitmap (in bits, rounded up to whole __u32 words); on output it is the
+ * size of the bitmap. Pass bitmap = 0 to only query the geometry.
+ * Epochs are numbered from 1; epoch 0 means that no epoch was closed since
+ * the module was loaded, the bitmap is empty and a full backup is needed.
+ * The bitmaps are kept in memory only: generation is drawn at random on
+ * each load, and a tool that finds another generation than at its previous
+ * run missed writes and needs a full backup too.
+ */
+struct ssr_cbt_info {
+	__u64 epoch;
+	__u32 granularity;
+	__u32 nr_bits;
+	__u64 bitmap;
+	__u64 generation;
+};
+
+/* stored checksums */
+#define SSR_IOCTL_CSUM_GET	4
+
+/*
+ * Argument of SSR_IOCTL_CSUM_GET: the stored CRC32 of each sector of
+ * [sector, sector + nr_sectors), taken from the CRC area without reading
+ * the data. If crcs is set, it receives nr_sectors little-endian CRCs.
+ * digest is the CRC32 of those CRCs, so two ranges can be compared on a
+ * single word. mismatches counts the sectors whose CRC differs between the
+ * members that are not faulty; only reading them tells which copy is right.
+ */
+struct ssr_csum_info {
+	__u64 sector;
+	__u32 nr_sectors;
+	__u32 digest;
+	__u64 crcs;
+	__u32 mismatches;
+	__u32 reserved;
+};
+
+/*
+ * I/O trace records, read from <debugfs>/ssr/trace while the module is
+ * loaded with trace_entries set. seq is the 1-based position of the
+ * request in the trace, so gaps are records the reader was too slow for.
+ */
+#define SSR_TRACE_READ		0
+#define SSR_TRACE_WRITE		1
+#define SSR_TRACE_WRITE_ZEROES	2
+#define SSR_TRACE_FLUSH		3
+
+#define SSR_TRACE_FUA		(1 << 0)
+#define SSR_TRACE_PREFLUSH	(1 << 1)
+
+struct ssr_trace_rec {
+	__u64 seq;
+	__u64 time_ns;	/* CLOCK_MONOTONIC */
+	__u64 sector;
+	__u32 nr_sectors;
+	__u8 op;
+	__u8 flags;
+	__u16 reserved;
+};
+
+/*
+ * Access heatmap, read from <debugfs>/ssr/heatmap: a struct ssr_heat_header
+ * followed by nr_regions struct ssr_heat_rec, region i covering bytes
+ * [i * region_size, (i + 1) * region_size) of the array. The counts are
+ * requests, estimated from one request in sample, and are halved every
+ * halflife_s seconds.
+ */
+struct ssr_heat_header {
+	__u64 time_ns;	/* CLOCK_MONOTONIC */
+	__u32 region_size;
+	__u32 nr_regions;
+	__u32 halflife_s;
+	__u32 sample;
+};
+
+struct ssr_heat_rec {
+	__u64 reads;
+	__u64 writes;
+};
+
 #endif
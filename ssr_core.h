@@ -0,0 +1,350 @@
+/* SPDX-License-Identifier: GPL-2.0+ */
+
+/*
+ * Simple Software Raid - on-disk layout and mirror/CRC core
+ *
+ * Shared by the kernel module and the userspace ublk target, so both
+ * implementations agree on the layout and on how copies are verified and
+ * repaired. Everything here is pure computation on buffers; the callers do
+ * the member I/O.
+ */
+
+#ifndef SSR_CORE_H_
+#define SSR_CORE_H_	1
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/crc32.h>
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint64_t sector_t;
+
+#define cpu_to_le32(x)		htole32(x)
+#define le32_to_cpu(x)		le32toh(x)
+#define cpu_to_le64(x)		htole64(x)
+#define le64_to_cpu(x)		le64toh(x)
+
+#define DIV_ROUND_UP(n, d)	(((n) + (d) - 1) / (d))
+#define round_down(x, y)	((x) - ((x) % (y)))
+#define round_up(x, y)		round_down((x) + (y) - 1, (y))
+#define IS_ALIGNED(x, a)	(((x) % (a)) == 0)
+
+/* same polynomial and conventions as the kernel's crc32_le() */
+u32 crc32(u32 seed, const void *buf, size_t len);
+
+static inline const void *memchr_inv(const void *p, int c, size_t len)
+{
+	const unsigned char *s = p;
+
+	for (; len; s++, len--)
+		if (*s != (unsigned char)c)
+			return s;
+
+	return NULL;
+}
+#endif
+
+#include "ssr.h"
+
+#define SSR_NUM_MEMBERS		2
+
+/* largest request handled at once, bounds the per-request buffers */
+#define SSR_MAX_SECTORS		128
+
+/* unit of range locking and of compression, one CRC sector worth of data */
+#define SSR_CHUNK_SECTORS	(SSR_CRCS_PER_SECTOR)
+#define SSR_CHUNK_BYTES		((SSR_CHUNK_SECTORS) * (KERNEL_SECTOR_SIZE))
+#define SSR_NUM_CHUNKS		((LOGICAL_DISK_SECTORS) / (SSR_CHUNK_SECTORS))
+
+/* compressed extent map, right after the CRC area */
+#define SSR_CMAP_MAGIC			0x5a525353	/* "SSRZ" */
+#define SSR_CMAP_FIRST_SECTOR		((SSR_CRC_FIRST_SECTOR) + (SSR_CRC_SECTORS))
+#define SSR_CMAP_ENTRIES_PER_SECTOR	((KERNEL_SECTOR_SIZE) / sizeof(struct ssr_cmap_entry))
+#define SSR_CMAP_SECTORS		DIV_ROUND_UP(SSR_NUM_CHUNKS, SSR_CMAP_ENTRIES_PER_SECTOR)
+
+/* superblock, right after the compressed extent map */
+#define SSR_SB_MAGIC		0x53525353	/* "SSRS" */
+#define SSR_SB_VERSION		1
+#define SSR_SB_SECTOR		((SSR_CMAP_FIRST_SECTOR) + 1 + (SSR_CMAP_SECTORS))
+
+/* superblock flags */
+#define SSR_SB_INITIALIZING	(1ULL << 0)	/* sectors >= init_cursor not initialized */
+#define SSR_SB_COMPRESSED	(1ULL << 2)	/* data in compressed chunks, see the cmap */
+#define SSR_SB_META_DEV		(1ULL << 3)	/* metadata on a separate device */
+#define SSR_SB_TIERED		(1ULL << 4)	/* extents may be on a fast member pair */
+#define SSR_SB_LOG		(1ULL << 5)	/* log-structured, see ssr_sb_log_sector() */
+
+/* flags describing the layout, an array is only loaded with the same ones */
+#define SSR_SB_LAYOUT		(SSR_SB_COMPRESSED | SSR_SB_META_DEV | SSR_SB_TIERED | \
+				 SSR_SB_LOG)
+
+/* replication log of the async replica, right after the superblock */
+#define SSR_RLOG_MAGIC			0x52525353	/* "SSRR" */
+#define SSR_RLOG_HEADER_SECTOR		((SSR_SB_SECTOR) + 1)
+#define SSR_RLOG_FIRST_SECTOR		((SSR_RLOG_HEADER_SECTOR) + 1)
+#define SSR_RLOG_SECTORS		256
+#define SSR_RLOG_ENTRIES_PER_SECTOR	((KERNEL_SECTOR_SIZE) / sizeof(struct ssr_rlog_entry))
+#define SSR_RLOG_ENTRIES		((SSR_RLOG_SECTORS) * (SSR_RLOG_ENTRIES_PER_SECTOR))
+
+/*
+ * journal of atomic writes, right after the replication log: each slot is a
+ * header sector followed by the data of up to SSR_MAX_SECTORS sectors
+ */
+#define SSR_JRNL_MAGIC		0x4a525353	/* "SSRJ" */
+#define SSR_JRNL_FIRST_SECTOR	((SSR_RLOG_FIRST_SECTOR) + (SSR_RLOG_SECTORS))
+#define SSR_JRNL_SLOTS		16
+#define SSR_JRNL_SLOT_SECTORS	(1 + (SSR_MAX_SECTORS))
+#define SSR_JRNL_SECTORS	((SSR_JRNL_SLOTS) * (SSR_JRNL_SLOT_SECTORS))
+
+/*
+ * metadata of a member: everything after its data. With an external
+ * metadata device, member m keeps it at m * SSR_META_SECTORS on that device.
+ */
+#define SSR_META_END		((SSR_JRNL_FIRST_SECTOR) + (SSR_JRNL_SECTORS))
+#define SSR_META_SECTORS	((SSR_META_END) - (SSR_CRC_FIRST_SECTOR))
+
+/*
+ * hot/cold tiering: each fast member starts with a header sector followed by
+ * the extent map, its data slots start at the next 4 KiB boundary
+ */
+#define SSR_TIER_MAGIC		0x54525353	/* "SSRT" */
+
+/*
+ * zoned members: the data is a log of records, each a header sector
+ * followed by the data of up to SSR_ZREC_SECTORS sectors
+ */
+#define SSR_ZREC_MAGIC		0x4c525353	/* "SSRL" */
+#define SSR_ZREC_SECTORS	64
+
+/* record flags */
+#define SSR_ZREC_ZERO		(1U << 0)	/* no data, the sectors read as zeroes */
+
+/*
+ * regular members in the log-structured layout: the records go to segments
+ * emulating zones, followed by two checkpoint slots of the map. A slot is a
+ * header sector followed by the map, the seqs and the CRCs of every
+ * logical sector, then one byte per segment, set if the segment may hold
+ * records the checkpoint does not reflect. The superblock comes last
+ */
+#define SSR_ZCKPT_MAGIC		0x43525353	/* "SSRC" */
+#define SSR_ZCKPT_SLOTS		2
+
+struct ssr_cmap_header {
+	__le32 magic;
+	__le32 chunk_sectors;
+};
+
+/* len == 0: chunk reads as zeroes, len == SSR_CHUNK_BYTES: stored raw */
+struct ssr_cmap_entry {
+	__le32 len;
+	__le32 crc;
+};
+
+/* the crc covers the whole sector, fields after it read as 0 in older ones */
+struct ssr_superblock {
+	__le32 magic;
+	__le32 version;
+	__le64 flags;
+	__le64 init_cursor;
+	__le32 crc;
+	__le32 log_segment_kb;	/* segment size of the log-structured layout */
+	/* chunks past init_cursor that were initialized ahead of it, one bit each */
+	__u8 init_ahead[DIV_ROUND_UP(SSR_NUM_CHUNKS, 8)];
+};
+
+struct ssr_rlog_header {
+	__le32 magic;
+	__le32 replica;		/* dev_t of the replica the log is shipped to */
+	__le64 shipped;		/* entries up to this seq are on the replica */
+	__le64 sync_cursor;	/* sectors below it were copied to the replica */
+	__le32 crc;
+};
+
+/* entry seq lives in slot seq % SSR_RLOG_ENTRIES, seq 0 is never used */
+struct ssr_rlog_entry {
+	__le64 seq;
+	__le32 sector;
+	__le32 nr;
+};
+
+/* a slot holds a pending atomic write while its header is valid */
+struct ssr_jrec {
+	__le32 magic;
+	__le32 nr;
+	__le64 sector;
+	__le32 data_crc;
+	__le32 crc;	/* of the header sector, computed with crc = 0 */
+	__le32 cmp_len;	/* compressed layout: payload length of the chunk at sector */
+};
+
+/* map entry e is 1 + the fast slot of extent e, 0 if it is on the members */
+struct ssr_tier_header {
+	__le32 magic;
+	__le32 extent_sectors;
+	__le64 seq;
+	__le32 nr_extents;
+	__le32 crc;	/* of the header sector and the map, computed with crc = 0 */
+};
+
+/* the newest record of a sector, by seq, holds its current data */
+struct ssr_zrec {
+	__le32 magic;
+	__le32 flags;
+	__le64 seq;
+	__le64 sector;
+	__le32 nr;
+	__le32 crc;	/* of the header sector, computed with crc = 0 */
+	__le32 crcs[SSR_ZREC_SECTORS];
+};
+
+/* the newest valid slot, by seq, is loaded */
+struct ssr_zckpt {
+	__le32 magic;
+	__le32 nr_zones;
+	__le64 seq;
+	__le64 zone_sectors;
+	__le32 body_crc;
+	__le32 crc;	/* of the header sector, computed with crc = 0 */
+};
+
+/**
+ * ssr_zckpt_body_len - Size of the body of a checkpoint slot
+ * @nr_zones: Number of segments of the member
+ */
+static inline size_t ssr_zckpt_body_len(unsigned int nr_zones)
+{
+	return (size_t)LOGICAL_DISK_SECTORS * (sizeof(__le64) + sizeof(__le64) +
+					       sizeof(__le32)) + nr_zones;
+}
+
+/**
+ * ssr_sb_log_sector - Superblock sector of a member in the log-structured layout
+ * @capacity: Size of the member in sectors
+ *
+ * The segments cover SSR_SB_SECTOR, so the superblock goes to the last
+ * sector of the member, after the checkpoint slots.
+ */
+static inline sector_t ssr_sb_log_sector(sector_t capacity)
+{
+	return capacity - 1;
+}
+
+/**
+ * ssr_crc_sector - Member sector holding the CRC of a logical sector
+ * @sector: Logical sector
+ */
+static inline sector_t ssr_crc_sector(sector_t sector)
+{
+	return SSR_CRC_FIRST_SECTOR + sector / SSR_CRCS_PER_SECTOR;
+}
+
+/**
+ * ssr_crc_window_len - Size of the CRC sectors covering a data range
+ * @sector: First data sector
+ * @nr: Number of data sectors
+ *
+ * The CRCs of @sector ... @sector + @nr - 1 are read and written as whole
+ * sectors of the CRC area, starting at ssr_crc_sector(@sector).
+ */
+static inline size_t ssr_crc_window_len(sector_t sector, unsigned int nr)
+{
+	return (ssr_crc_sector(sector + nr - 1) - ssr_crc_sector(sector) + 1) *
+		KERNEL_SECTOR_SIZE;
+}
+
+/**
+ * ssr_crc_slot - Slot of a sector's CRC inside a CRC window
+ * @crcs: CRC window read starting at ssr_crc_sector(@start)
+ * @start: First data sector the window was read for
+ * @sector: Data sector whose CRC is wanted
+ */
+static inline __le32 *ssr_crc_slot(__le32 *crcs, sector_t start, sector_t sector)
+{
+	return &crcs[sector - round_down(start, SSR_CRCS_PER_SECTOR)];
+}
+
+/**
+ * ssr_core_sums - CRC pass of a write, fused with the zero check
+ * @data: Payload of @nr sectors
+ * @nr: Number of sectors
+ * @sums: Output, CRC32 of each sector
+ * @zero_crc: CRC32 of an all-zero sector
+ *
+ * A sector can only be all-zero if its CRC equals @zero_crc, so non-zero
+ * data never pays for the memchr_inv().
+ *
+ * Returns true if every sector of @data is zero.
+ */
+static inline bool ssr_core_sums(const char *data, unsigned int nr, u32 *sums, u32 zero_crc)
+{
+	bool zero = true;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		const char *p = data + i * KERNEL_SECTOR_SIZE;
+
+		sums[i] = crc32(0, p, KERNEL_SECTOR_SIZE);
+		if (zero && (sums[i] != zero_crc || memchr_inv(p, 0, KERNEL_SECTOR_SIZE)))
+			zero = false;
+	}
+
+	return zero;
+}
+
+/**
+ * ssr_core_verify_sector - Verifies one sector on every member
+ * @data: Data window of each member, starting at @start
+ * @crcs: CRC window of each member, read for @start
+ * @valid: Members whose windows were read successfully
+ * @start: First sector of the windows
+ * @sector: Sector to verify
+ * @dirty: Set for members whose copy was repaired in their windows
+ *
+ * The first copy matching its CRC wins. Every other valid member whose copy
+ * does not match gets the good data and CRC copied into its windows, so the
+ * caller only has to write the dirty windows back.
+ *
+ * Returns the member holding a good copy, or -1 if no copy is good.
+ */
+static inline int ssr_core_verify_sector(char *data[SSR_NUM_MEMBERS],
+					 __le32 *crcs[SSR_NUM_MEMBERS],
+					 const bool valid[SSR_NUM_MEMBERS],
+					 sector_t start, sector_t sector,
+					 bool dirty[SSR_NUM_MEMBERS])
+{
+	size_t off = (sector - start) * KERNEL_SECTOR_SIZE;
+	bool ok[SSR_NUM_MEMBERS];
+	int m, good = -1;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		ok[m] = valid[m] &&
+			crc32(0, data[m] + off, KERNEL_SECTOR_SIZE) ==
+			le32_to_cpu(*ssr_crc_slot(crcs[m], start, sector));
+		if (ok[m] && good < 0)
+			good = m;
+	}
+
+	if (good < 0)
+		return -1;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (!valid[m] || ok[m])
+			continue;
+
+		memcpy(data[m] + off, data[good] + off, KERNEL_SECTOR_SIZE);
+		*ssr_crc_slot(crcs[m], start, sector) = *ssr_crc_slot(crcs[good], start, sector);
+		dirty[m] = true;
+	}
+
+	return good;
+}
+
+#endif
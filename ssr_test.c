@@ -0,0 +1,1003 @@
+// SPDX-License-Identifier: GPL-2.0+
+
+/*
+ * Simple Software Raid - KUnit tests and microbenchmarks
+ *
+ * Included at the end of ssr.c when CONFIG_SSR_KUNIT_TEST is enabled, so the
+ * tests reach the static request and CRC engine. Each test gets an array of
+ * two built-in RAM members, set up like ssr_init_state() does for a new
+ * array, without a gendisk or a workqueue.
+ *
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=drivers/block/ssr
+ *   ./tools/testing/kunit/kunit.py run --kunitconfig=drivers/block/ssr \
+ *	--arch=x86_64 --run_isolated=suite
+ */
+
+#include <kunit/test.h>
+#include <linux/mman.h>
+
+/* sectors the array tests write to, several chunks and CRC sectors */
+#define SSR_TEST_SECTORS	(4 * SSR_CHUNK_SECTORS)
+
+/* concurrent writers and requests per writer of the overlapping write test */
+#define SSR_TEST_WRITERS	4
+#define SSR_TEST_ROUNDS		64
+
+/**
+ * ssr_test_init - Sets up an empty array on two RAM members
+ * @test: Test case, gets the array in test->priv
+ *
+ * Returns 0 on success or a negative error code on failure.
+ */
+static int ssr_test_init(struct kunit *test)
+{
+	struct logical_block_dev *dev;
+	int m;
+
+	ssr_zero_crc = crc32(0, page_address(ZERO_PAGE(0)), KERNEL_SECTOR_SIZE);
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return -ENOMEM;
+	test->priv = dev;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		dev->members[m].null = kzalloc(sizeof(*dev->members[m].null), GFP_KERNEL);
+		if (!dev->members[m].null)
+			return -ENOMEM;
+		xa_init(&dev->members[m].null->pages);
+		dev->members[m].name = m ? "test1" : "test0";
+	}
+
+	/* a new array: every sector reads as zeroes until written */
+	dev->unwritten = bitmap_alloc(LOGICAL_DISK_SECTORS, GFP_KERNEL);
+	if (!dev->unwritten)
+		return -ENOMEM;
+	bitmap_fill(dev->unwritten, LOGICAL_DISK_SECTORS);
+	dev->init_cursor = LOGICAL_DISK_SECTORS;
+
+	spin_lock_init(&dev->range_lock);
+	INIT_LIST_HEAD(&dev->ranges);
+	init_waitqueue_head(&dev->range_wait);
+
+	return ssr_crc_cache_init(dev);
+}
+
+/**
+ * ssr_test_exit - Releases the array of a test case
+ * @test: Test case
+ */
+static void ssr_test_exit(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	int m;
+
+	if (!dev)
+		return;
+
+	if (dev->crc_shrinker)
+		ssr_crc_cache_free(dev);
+	bitmap_free(dev->unwritten);
+	vfree(dev->cmap);
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (dev->members[m].null)
+			ssr_null_free(&dev->members[m]);
+	kfree(dev);
+}
+
+/**
+ * ssr_test_write - Writes a range the way a request does, under its range lock
+ * @dev: Array
+ * @sector: First sector
+ * @nr: Number of sectors
+ * @data: Payload, NULL to write zeroes
+ */
+static blk_status_t ssr_test_write(struct logical_block_dev *dev, sector_t sector,
+				   unsigned int nr, char *data)
+{
+	struct ssr_range range;
+	blk_status_t status;
+
+	ssr_range_lock(dev, &range, sector, nr);
+	status = ssr_rw(dev, sector, nr, data, true, 0);
+	ssr_range_unlock(dev, &range);
+
+	return status;
+}
+
+/**
+ * ssr_test_read - Reads a range the way a request does, under its range lock
+ * @dev: Array
+ * @sector: First sector
+ * @nr: Number of sectors
+ * @out: Receives the verified payload
+ */
+static blk_status_t ssr_test_read(struct logical_block_dev *dev, sector_t sector,
+				  unsigned int nr, char *out)
+{
+	struct ssr_range range;
+	blk_status_t status;
+
+	ssr_range_lock(dev, &range, sector, nr);
+	status = ssr_rw(dev, sector, nr, out, false, 0);
+	ssr_range_unlock(dev, &range);
+
+	return status;
+}
+
+/**
+ * ssr_test_corrupt - Flips a byte of the copy of a sector on one member
+ * @test: Test case
+ * @m: Member index
+ * @sector: Sector to corrupt, its CRC is left alone
+ */
+static void ssr_test_corrupt(struct kunit *test, int m, sector_t sector)
+{
+	struct logical_block_dev *dev = test->priv;
+	char *buf = kunit_kmalloc(test, KERNEL_SECTOR_SIZE, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	KUNIT_ASSERT_EQ(test, ssr_member_io(&dev->members[m], REQ_OP_READ, sector, buf,
+					    KERNEL_SECTOR_SIZE), 0);
+	buf[KERNEL_SECTOR_SIZE / 2] ^= 0x5a;
+	KUNIT_ASSERT_EQ(test, ssr_member_io(&dev->members[m], REQ_OP_WRITE, sector, buf,
+					    KERNEL_SECTOR_SIZE), 0);
+}
+
+/**
+ * ssr_test_member_copy - Tells whether a member holds a given range
+ * @test: Test case
+ * @m: Member index
+ * @sector: First sector
+ * @nr: Number of sectors
+ * @data: Expected payload
+ */
+static bool ssr_test_member_copy(struct kunit *test, int m, sector_t sector,
+				 unsigned int nr, const char *data)
+{
+	struct logical_block_dev *dev = test->priv;
+	size_t len = nr * KERNEL_SECTOR_SIZE;
+	char *buf = kunit_kmalloc(test, len, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	KUNIT_ASSERT_EQ(test, ssr_member_io(&dev->members[m], REQ_OP_READ, sector, buf,
+					    len), 0);
+
+	return !memcmp(buf, data, len);
+}
+
+static void ssr_test_crc_layout(struct kunit *test)
+{
+	__le32 crcs[2 * SSR_CRCS_PER_SECTOR];
+
+	KUNIT_EXPECT_EQ(test, ssr_crc_sector(0), (sector_t)SSR_CRC_FIRST_SECTOR);
+	KUNIT_EXPECT_EQ(test, ssr_crc_sector(SSR_CRCS_PER_SECTOR - 1),
+			(sector_t)SSR_CRC_FIRST_SECTOR);
+	KUNIT_EXPECT_EQ(test, ssr_crc_sector(SSR_CRCS_PER_SECTOR),
+			(sector_t)SSR_CRC_FIRST_SECTOR + 1);
+	KUNIT_EXPECT_EQ(test, ssr_crc_sector(LOGICAL_DISK_SECTORS - 1),
+			(sector_t)SSR_CRC_FIRST_SECTOR + SSR_CRC_SECTORS - 1);
+
+	/* a window covers whole CRC sectors, one more if the range crosses one */
+	KUNIT_EXPECT_EQ(test, ssr_crc_window_len(0, 1), (size_t)KERNEL_SECTOR_SIZE);
+	KUNIT_EXPECT_EQ(test, ssr_crc_window_len(0, SSR_CRCS_PER_SECTOR),
+			(size_t)KERNEL_SECTOR_SIZE);
+	KUNIT_EXPECT_EQ(test, ssr_crc_window_len(SSR_CRCS_PER_SECTOR - 8, 16),
+			(size_t)2 * KERNEL_SECTOR_SIZE);
+
+	KUNIT_EXPECT_PTR_EQ(test, ssr_crc_slot(crcs, 5, 5), &crcs[5]);
+	KUNIT_EXPECT_PTR_EQ(test, ssr_crc_slot(crcs, SSR_CRCS_PER_SECTOR - 8,
+					       SSR_CRCS_PER_SECTOR + 2),
+			    &crcs[SSR_CRCS_PER_SECTOR + 2]);
+	KUNIT_EXPECT_PTR_EQ(test, ssr_crc_slot(crcs, SSR_CRCS_PER_SECTOR + 3,
+					       SSR_CRCS_PER_SECTOR + 9), &crcs[9]);
+
+	/* the metadata follows the data in this order */
+	KUNIT_EXPECT_LT(test, SSR_CRC_FIRST_SECTOR + SSR_CRC_SECTORS - 1,
+			SSR_CMAP_FIRST_SECTOR);
+	KUNIT_EXPECT_LT(test, SSR_CMAP_FIRST_SECTOR + SSR_CMAP_SECTORS, SSR_SB_SECTOR);
+	KUNIT_EXPECT_LT(test, SSR_SB_SECTOR, SSR_RLOG_HEADER_SECTOR);
+	KUNIT_EXPECT_LE(test, SSR_RLOG_FIRST_SECTOR + SSR_RLOG_SECTORS, SSR_JRNL_FIRST_SECTOR);
+	KUNIT_EXPECT_EQ(test, SSR_META_END, SSR_JRNL_FIRST_SECTOR + SSR_JRNL_SECTORS);
+}
+
+static void ssr_test_core_sums(struct kunit *test)
+{
+	size_t len = 8 * KERNEL_SECTOR_SIZE;
+	char *data = kunit_kzalloc(test, len, GFP_KERNEL);
+	u32 sums[8];
+	unsigned int i;
+
+	KUNIT_ASSERT_NOT_NULL(test, data);
+
+	KUNIT_EXPECT_TRUE(test, ssr_core_sums(data, 8, sums, ssr_zero_crc));
+	for (i = 0; i < 8; i++)
+		KUNIT_EXPECT_EQ(test, sums[i], ssr_zero_crc);
+
+	/* a non-zero byte in the last sector only */
+	data[len - 1] = 1;
+	KUNIT_EXPECT_FALSE(test, ssr_core_sums(data, 8, sums, ssr_zero_crc));
+	for (i = 0; i < 8; i++)
+		KUNIT_EXPECT_EQ(test, sums[i], crc32(0, data + i * KERNEL_SECTOR_SIZE,
+						     KERNEL_SECTOR_SIZE));
+}
+
+static void ssr_test_core_verify(struct kunit *test)
+{
+	char *data[SSR_NUM_MEMBERS], *good;
+	__le32 *crcs[SSR_NUM_MEMBERS];
+	bool valid[SSR_NUM_MEMBERS] = { true, true };
+	bool dirty[SSR_NUM_MEMBERS] = { false };
+	size_t crc_len = ssr_crc_window_len(0, 4);
+	u32 sums[4];
+	unsigned int i;
+	int m;
+
+	good = kunit_kmalloc(test, 4 * KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, good);
+	get_random_bytes(good, 4 * KERNEL_SECTOR_SIZE);
+	ssr_core_sums(good, 4, sums, ssr_zero_crc);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		data[m] = kunit_kmalloc(test, 4 * KERNEL_SECTOR_SIZE, GFP_KERNEL);
+		crcs[m] = kunit_kzalloc(test, crc_len, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, data[m]);
+		KUNIT_ASSERT_NOT_NULL(test, crcs[m]);
+		memcpy(data[m], good, 4 * KERNEL_SECTOR_SIZE);
+		for (i = 0; i < 4; i++)
+			*ssr_crc_slot(crcs[m], 0, i) = cpu_to_le32(sums[i]);
+	}
+
+	/* both copies good: the first one wins, nothing to repair */
+	KUNIT_EXPECT_EQ(test, ssr_core_verify_sector(data, crcs, valid, 0, 0, dirty), 0);
+	KUNIT_EXPECT_FALSE(test, dirty[0] || dirty[1]);
+
+	/* bad second copy: repaired from the first */
+	data[1][KERNEL_SECTOR_SIZE] ^= 0xff;
+	KUNIT_EXPECT_EQ(test, ssr_core_verify_sector(data, crcs, valid, 0, 1, dirty), 0);
+	KUNIT_EXPECT_TRUE(test, dirty[1]);
+	KUNIT_EXPECT_FALSE(test, dirty[0]);
+	KUNIT_EXPECT_EQ(test, memcmp(data[1], good, 4 * KERNEL_SECTOR_SIZE), 0);
+
+	/* bad first copy: the second one wins and repairs it */
+	dirty[1] = false;
+	data[0][2 * KERNEL_SECTOR_SIZE + 7] ^= 0x01;
+	KUNIT_EXPECT_EQ(test, ssr_core_verify_sector(data, crcs, valid, 0, 2, dirty), 1);
+	KUNIT_EXPECT_TRUE(test, dirty[0]);
+	KUNIT_EXPECT_EQ(test, memcmp(data[0], good, 4 * KERNEL_SECTOR_SIZE), 0);
+
+	/* bad CRC on the first member: the good CRC is copied over with the data */
+	dirty[0] = false;
+	*ssr_crc_slot(crcs[0], 0, 3) = cpu_to_le32(sums[3] ^ 1);
+	KUNIT_EXPECT_EQ(test, ssr_core_verify_sector(data, crcs, valid, 0, 3, dirty), 1);
+	KUNIT_EXPECT_TRUE(test, dirty[0]);
+	KUNIT_EXPECT_EQ(test, le32_to_cpu(*ssr_crc_slot(crcs[0], 0, 3)), sums[3]);
+
+	/* a member that could not be read is neither used nor repaired */
+	dirty[0] = false;
+	valid[0] = false;
+	data[0][0] ^= 0xff;
+	KUNIT_EXPECT_EQ(test, ssr_core_verify_sector(data, crcs, valid, 0, 0, dirty), 1);
+	KUNIT_EXPECT_FALSE(test, dirty[0]);
+	KUNIT_EXPECT_NE(test, memcmp(data[0], good, KERNEL_SECTOR_SIZE), 0);
+
+	/* both copies bad: no winner, nothing written back */
+	valid[0] = true;
+	data[1][0] ^= 0xff;
+	KUNIT_EXPECT_EQ(test, ssr_core_verify_sector(data, crcs, valid, 0, 0, dirty), -1);
+	KUNIT_EXPECT_FALSE(test, dirty[0] || dirty[1]);
+}
+
+/*
+ * Segments of the test bios: partial pages, a segment crossing nothing but
+ * ending mid-page, and single sectors at odd offsets
+ */
+static const struct {
+	unsigned int page;
+	unsigned int offset;
+	unsigned int len;
+} ssr_test_segs[][4] = {
+	{ { 0, 512, 3584 }, { 1, 0, 1024 }, { 2, 2048, 512 }, { 3, 1536, 1536 } },
+	{ { 0, 0, 512 }, { 1, 3584, 512 }, { 2, 1024, 2048 }, { 3, 0, 3584 } },
+};
+
+#define SSR_TEST_BIO_SECTORS	13	/* sum of the lengths of either set above */
+
+/**
+ * ssr_test_bio - Builds a bio over segments of pages filled with a marker
+ * @test: Test case
+ * @bio: Bio to initialize
+ * @bvecs: Vector of ARRAY_SIZE(ssr_test_segs[0]) entries
+ * @pages: Receives the pages
+ * @shape: Row of ssr_test_segs
+ */
+static void ssr_test_bio(struct kunit *test, struct bio *bio, struct bio_vec *bvecs,
+			 struct page **pages, int shape)
+{
+	unsigned int i, n = ARRAY_SIZE(ssr_test_segs[0]);
+
+	bio_init(bio, NULL, bvecs, n, REQ_OP_WRITE);
+
+	for (i = 0; i < n; i++) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, pages[i]);
+		memset(page_address(pages[i]), 0xa5, PAGE_SIZE);
+	}
+
+	for (i = 0; i < n; i++)
+		__bio_add_page(bio, pages[ssr_test_segs[shape][i].page],
+			       ssr_test_segs[shape][i].len, ssr_test_segs[shape][i].offset);
+
+	KUNIT_ASSERT_EQ(test, bio_sectors(bio), SSR_TEST_BIO_SECTORS);
+}
+
+/**
+ * ssr_test_bio_free - Releases a bio built by ssr_test_bio()
+ * @bio: Bio
+ * @pages: Its pages
+ */
+static void ssr_test_bio_free(struct bio *bio, struct page **pages)
+{
+	unsigned int i;
+
+	bio_uninit(bio);
+	for (i = 0; i < ARRAY_SIZE(ssr_test_segs[0]); i++)
+		if (pages[i])
+			__free_page(pages[i]);
+}
+
+/**
+ * ssr_test_bio_check - Checks a bio's segments against a linear buffer
+ * @test: Test case
+ * @pages: Pages of the bio
+ * @shape: Row of ssr_test_segs the bio was built with
+ * @buf: Expected payload
+ *
+ * The bytes of the pages outside the segments must still hold the marker.
+ */
+static void ssr_test_bio_check(struct kunit *test, struct page **pages, int shape,
+			       const char *buf)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(ssr_test_segs[0]); i++) {
+		const char *p = page_address(pages[ssr_test_segs[shape][i].page]);
+		unsigned int off = ssr_test_segs[shape][i].offset;
+		unsigned int len = ssr_test_segs[shape][i].len;
+
+		KUNIT_EXPECT_EQ(test, memcmp(p + off, buf, len), 0);
+		KUNIT_EXPECT_NULL(test, memchr_inv(p, 0xa5, off));
+		KUNIT_EXPECT_NULL(test, memchr_inv(p + off + len, 0xa5, PAGE_SIZE - off - len));
+		buf += len;
+	}
+}
+
+static void ssr_test_copy_bio(struct kunit *test)
+{
+	size_t len = SSR_TEST_BIO_SECTORS * KERNEL_SECTOR_SIZE;
+	struct bio_vec bvecs[ARRAY_SIZE(ssr_test_segs[0])];
+	struct page *pages[ARRAY_SIZE(ssr_test_segs[0])] = { NULL };
+	char *in, *out;
+	struct bio bio;
+
+	in = kunit_kmalloc(test, len, GFP_KERNEL);
+	out = kunit_kzalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, in);
+	KUNIT_ASSERT_NOT_NULL(test, out);
+	get_random_bytes(in, len);
+
+	ssr_test_bio(test, &bio, bvecs, pages, 0);
+
+	ssr_copy_bio(&bio, in, true);
+	ssr_test_bio_check(test, pages, 0, in);
+
+	ssr_copy_bio(&bio, out, false);
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+
+	/* a bio advanced into its first segment, as left by a split */
+	memset(out, 0, len);
+	bio_advance(&bio, 3 * KERNEL_SECTOR_SIZE);
+	KUNIT_EXPECT_EQ(test, bio_sectors(&bio), SSR_TEST_BIO_SECTORS - 3);
+	ssr_copy_bio(&bio, out, false);
+	KUNIT_EXPECT_EQ(test, memcmp(in + 3 * KERNEL_SECTOR_SIZE, out,
+				     len - 3 * KERNEL_SECTOR_SIZE), 0);
+
+	ssr_test_bio_free(&bio, pages);
+}
+
+static void ssr_test_rw_bio(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	size_t len = SSR_TEST_BIO_SECTORS * KERNEL_SECTOR_SIZE;
+	/* crosses a CRC sector boundary, with partial CRC windows on both ends */
+	sector_t sector = SSR_CRCS_PER_SECTOR - 5;
+	struct bio_vec bvecs[2][ARRAY_SIZE(ssr_test_segs[0])];
+	struct page *pages[2][ARRAY_SIZE(ssr_test_segs[0])] = { { NULL } };
+	struct bio bio[2];
+	char *in, *buf;
+
+	in = kunit_kmalloc(test, len, GFP_KERNEL);
+	buf = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, in);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	get_random_bytes(in, len);
+
+	/* write through one shape of bio, read back through the other one */
+	ssr_test_bio(test, &bio[0], bvecs[0], pages[0], 0);
+	ssr_test_bio(test, &bio[1], bvecs[1], pages[1], 1);
+	ssr_copy_bio(&bio[0], in, true);
+
+	ssr_copy_bio(&bio[0], buf, false);
+	KUNIT_EXPECT_EQ(test, ssr_test_write(dev, sector, SSR_TEST_BIO_SECTORS, buf),
+			BLK_STS_OK);
+
+	memset(buf, 0, len);
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, sector, SSR_TEST_BIO_SECTORS, buf),
+			BLK_STS_OK);
+	ssr_copy_bio(&bio[1], buf, true);
+	ssr_test_bio_check(test, pages[1], 1, in);
+
+	/* both mirrors hold the data, the neighbours still read as zeroes */
+	KUNIT_EXPECT_TRUE(test, ssr_test_member_copy(test, 0, sector, SSR_TEST_BIO_SECTORS, in));
+	KUNIT_EXPECT_TRUE(test, ssr_test_member_copy(test, 1, sector, SSR_TEST_BIO_SECTORS, in));
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, sector - 1, 1, buf), BLK_STS_OK);
+	KUNIT_EXPECT_NULL(test, memchr_inv(buf, 0, KERNEL_SECTOR_SIZE));
+
+	ssr_test_bio_free(&bio[1], pages[1]);
+	ssr_test_bio_free(&bio[0], pages[0]);
+}
+
+static void ssr_test_unwritten(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	size_t len = 16 * KERNEL_SECTOR_SIZE;
+	char *buf = kunit_kmalloc(test, len, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	memset(buf, 0xff, len);
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, 40, 16, buf), BLK_STS_OK);
+	KUNIT_EXPECT_NULL(test, memchr_inv(buf, 0, len));
+
+	get_random_bytes(buf, len);
+	KUNIT_EXPECT_EQ(test, ssr_test_write(dev, 40, 16, buf), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, find_next_bit(dev->unwritten, 56, 40), 56UL);
+
+	/* write-zeroes and all-zero data both mark the range unwritten again */
+	KUNIT_EXPECT_EQ(test, ssr_test_write(dev, 40, 8, NULL), BLK_STS_OK);
+	memset(buf, 0, len);
+	KUNIT_EXPECT_EQ(test, ssr_test_write(dev, 48, 8, buf), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, find_next_zero_bit(dev->unwritten, 56, 40), 56UL);
+
+	memset(buf, 0xff, len);
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, 40, 16, buf), BLK_STS_OK);
+	KUNIT_EXPECT_NULL(test, memchr_inv(buf, 0, len));
+}
+
+static void ssr_test_repair(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	size_t len = 16 * KERNEL_SECTOR_SIZE;
+	char *in = kunit_kmalloc(test, len, GFP_KERNEL);
+	char *out = kunit_kmalloc(test, len, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, in);
+	KUNIT_ASSERT_NOT_NULL(test, out);
+	get_random_bytes(in, len);
+
+	KUNIT_ASSERT_EQ(test, ssr_test_write(dev, 120, 16, in), BLK_STS_OK);
+
+	/* one bad copy per sector, on different members */
+	ssr_test_corrupt(test, 0, 121);
+	ssr_test_corrupt(test, 1, 130);
+	KUNIT_EXPECT_FALSE(test, ssr_test_member_copy(test, 0, 120, 16, in));
+	KUNIT_EXPECT_FALSE(test, ssr_test_member_copy(test, 1, 120, 16, in));
+
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, 120, 16, out), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+
+	/* the read rewrote the bad copies */
+	KUNIT_EXPECT_TRUE(test, ssr_test_member_copy(test, 0, 120, 16, in));
+	KUNIT_EXPECT_TRUE(test, ssr_test_member_copy(test, 1, 120, 16, in));
+	KUNIT_EXPECT_FALSE(test, test_bit(0, &dev->state) || test_bit(1, &dev->state));
+}
+
+static void ssr_test_double_corruption(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	size_t len = 16 * KERNEL_SECTOR_SIZE;
+	char *in = kunit_kmalloc(test, len, GFP_KERNEL);
+	char *out = kunit_kmalloc(test, len, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, in);
+	KUNIT_ASSERT_NOT_NULL(test, out);
+	get_random_bytes(in, len);
+
+	KUNIT_ASSERT_EQ(test, ssr_test_write(dev, 200, 16, in), BLK_STS_OK);
+
+	ssr_test_corrupt(test, 0, 205);
+	ssr_test_corrupt(test, 1, 205);
+
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, 200, 16, out), BLK_STS_IOERR);
+
+	/* the sectors around it are still readable */
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, 200, 5, out), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, 5 * KERNEL_SECTOR_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, 206, 10, out), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, memcmp(in + 6 * KERNEL_SECTOR_SIZE, out,
+				     10 * KERNEL_SECTOR_SIZE), 0);
+
+	/* a rewrite makes the sector good again */
+	KUNIT_EXPECT_EQ(test, ssr_test_write(dev, 205, 1, in + 5 * KERNEL_SECTOR_SIZE),
+			BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, 200, 16, out), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, memcmp(in, out, len), 0);
+}
+
+struct ssr_test_writer {
+	struct work_struct work;
+	struct logical_block_dev *dev;
+	unsigned int id;
+	atomic_t *errors;
+};
+
+/**
+ * ssr_test_writer_fn - Writes random overlapping ranges of the test area
+ * @work: work of a struct ssr_test_writer
+ *
+ * Every u32 of a request holds the same stamp, so a sector mixing two
+ * requests shows up as a sector that is not uniform.
+ */
+static void ssr_test_writer_fn(struct work_struct *work)
+{
+	struct ssr_test_writer *w = container_of(work, struct ssr_test_writer, work);
+	u32 *buf = kmalloc(SSR_MAX_SECTORS * KERNEL_SECTOR_SIZE, GFP_KERNEL);
+	unsigned int round, nr, i;
+	sector_t sector;
+
+	if (!buf) {
+		atomic_inc(w->errors);
+		return;
+	}
+
+	for (round = 0; round < SSR_TEST_ROUNDS; round++) {
+		nr = 1 + get_random_u32_below(SSR_MAX_SECTORS);
+		sector = get_random_u32_below(SSR_TEST_SECTORS - nr + 1);
+
+		for (i = 0; i < nr * KERNEL_SECTOR_SIZE / sizeof(*buf); i++)
+			buf[i] = (w->id + 1) << 16 | round;
+
+		if (ssr_test_write(w->dev, sector, nr, (char *)buf) != BLK_STS_OK)
+			atomic_inc(w->errors);
+	}
+
+	kfree(buf);
+}
+
+static void ssr_test_overlapping_writes(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	struct ssr_test_writer *writers;
+	size_t len = SSR_TEST_SECTORS * KERNEL_SECTOR_SIZE;
+	size_t crc_len = ssr_crc_window_len(0, SSR_TEST_SECTORS);
+	char *data[SSR_NUM_MEMBERS];
+	__le32 *crcs[SSR_NUM_MEMBERS];
+	atomic_t errors = ATOMIC_INIT(0);
+	unsigned int i;
+	sector_t s;
+	int m;
+
+	writers = kunit_kcalloc(test, SSR_TEST_WRITERS, sizeof(*writers), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, writers);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		data[m] = kunit_kzalloc(test, len, GFP_KERNEL);
+		crcs[m] = kunit_kmalloc(test, crc_len, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, data[m]);
+		KUNIT_ASSERT_NOT_NULL(test, crcs[m]);
+	}
+
+	/* data everywhere first, so every sector has a CRC the writers update */
+	memset(data[0], 0xee, len);
+	for (s = 0; s < SSR_TEST_SECTORS; s += SSR_MAX_SECTORS)
+		KUNIT_ASSERT_EQ(test, ssr_test_write(dev, s, SSR_MAX_SECTORS, data[0]),
+				BLK_STS_OK);
+
+	for (i = 0; i < SSR_TEST_WRITERS; i++) {
+		writers[i].dev = dev;
+		writers[i].id = i;
+		writers[i].errors = &errors;
+		INIT_WORK_ONSTACK(&writers[i].work, ssr_test_writer_fn);
+		queue_work(system_unbound_wq, &writers[i].work);
+	}
+
+	for (i = 0; i < SSR_TEST_WRITERS; i++) {
+		flush_work(&writers[i].work);
+		destroy_work_on_stack(&writers[i].work);
+	}
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&errors), 0);
+
+	/* the members as written, without a read that would repair them */
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		KUNIT_ASSERT_EQ(test, ssr_member_io(&dev->members[m], REQ_OP_READ, 0,
+						    data[m], len), 0);
+		KUNIT_ASSERT_EQ(test, ssr_member_io(&dev->members[m], REQ_OP_READ,
+						    ssr_crc_sector(0), crcs[m], crc_len), 0);
+	}
+
+	KUNIT_EXPECT_EQ(test, memcmp(data[0], data[1], len), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(crcs[0], crcs[1], crc_len), 0);
+
+	for (s = 0; s < SSR_TEST_SECTORS; s++) {
+		const u32 *p = (const u32 *)(data[0] + s * KERNEL_SECTOR_SIZE);
+		u32 stamp = p[0];
+
+		for (i = 1; i < KERNEL_SECTOR_SIZE / sizeof(*p); i++)
+			if (p[i] != stamp)
+				break;
+		KUNIT_EXPECT_EQ_MSG(test, i, KERNEL_SECTOR_SIZE / sizeof(*p),
+				    "sector %llu mixes two writes", (unsigned long long)s);
+
+		for (m = 0; m < SSR_NUM_MEMBERS; m++)
+			KUNIT_EXPECT_EQ_MSG(test, le32_to_cpu(*ssr_crc_slot(crcs[m], 0, s)),
+					    crc32(0, p, KERNEL_SECTOR_SIZE),
+					    "member %d: stale CRC of sector %llu", m,
+					    (unsigned long long)s);
+	}
+}
+
+/**
+ * ssr_test_bad_range - Makes writes to a range fail on both members
+ * @dev: Array
+ * @sector: First sector, 0 with @nr 0 to clear the range
+ * @nr: Number of sectors
+ */
+static void ssr_test_bad_range(struct logical_block_dev *dev, sector_t sector, unsigned int nr)
+{
+	int m;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		dev->members[m].null->bad_start = sector;
+		dev->members[m].null->bad_end = sector + nr;
+	}
+}
+
+static void ssr_test_atomic_failed_write(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	size_t len = 16 * KERNEL_SECTOR_SIZE;
+	struct ssr_range range;
+	blk_status_t status;
+	char *old, *newer, *buf;
+
+	old = kunit_kmalloc(test, len, GFP_KERNEL);
+	newer = kunit_kmalloc(test, len, GFP_KERNEL);
+	buf = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, old);
+	KUNIT_ASSERT_NOT_NULL(test, newer);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	get_random_bytes(old, len);
+	get_random_bytes(newer, len);
+
+	KUNIT_ASSERT_EQ(test, ssr_jrnl_init(dev), 0);
+
+	/* the journal takes the write, the in-place copies fail */
+	ssr_test_bad_range(dev, 64, 16);
+	ssr_range_lock(dev, &range, 64, 16);
+	status = ssr_atomic_write(dev, 64, 16, old);
+	ssr_range_unlock(dev, &range);
+	KUNIT_EXPECT_NE(test, status, BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, dev->jrnl_busy, 0UL);
+
+	ssr_test_bad_range(dev, 0, 0);
+	dev->state = 0;
+	KUNIT_ASSERT_EQ(test, ssr_test_write(dev, 64, 16, newer), BLK_STS_OK);
+
+	/* a reload must not put the failed write back over the newer data */
+	KUNIT_ASSERT_EQ(test, ssr_jrnl_init(dev), 0);
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, 64, 16, buf), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, memcmp(buf, newer, len), 0);
+}
+
+static void ssr_test_init_reload(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	sector_t sector = 2 * SSR_CHUNK_SECTORS + 8;
+	size_t len = 16 * KERNEL_SECTOR_SIZE;
+	struct ssr_range range;
+	char *data, *buf;
+
+	data = kunit_kmalloc(test, len, GFP_KERNEL);
+	buf = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, data);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	get_random_bytes(data, len);
+
+	/* a new array, written ahead of its initializer like ssr_handle_bio() does */
+	KUNIT_ASSERT_EQ(test, ssr_sb_init(dev, 0, true), 0);
+	ssr_range_lock(dev, &range, sector, 16);
+	KUNIT_EXPECT_EQ(test, ssr_init_ahead(dev, sector, 16), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, ssr_rw(dev, sector, 16, data, true, 0), BLK_STS_OK);
+	ssr_range_unlock(dev, &range);
+
+	/* a reload only knows what the superblock says */
+	bitmap_zero(dev->unwritten, LOGICAL_DISK_SECTORS);
+	KUNIT_ASSERT_EQ(test, ssr_sb_init(dev, 0, false), 0);
+	KUNIT_EXPECT_EQ(test, dev->init_cursor, 0);
+	KUNIT_EXPECT_TRUE(test, test_bit(2, dev->init_ahead));
+	KUNIT_EXPECT_TRUE(test, test_bit(SSR_CHUNK_SECTORS, dev->unwritten));
+	KUNIT_EXPECT_FALSE(test, test_bit(sector, dev->unwritten));
+
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, sector, 16, buf), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, memcmp(buf, data, len), 0);
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, sector - 8, 8, buf), BLK_STS_OK);
+	KUNIT_EXPECT_NULL(test, memchr_inv(buf, 0, 8 * KERNEL_SECTOR_SIZE));
+
+	/* written data corrupted on both members is an error, not zeroes */
+	ssr_test_corrupt(test, 0, sector);
+	ssr_test_corrupt(test, 1, sector);
+	KUNIT_EXPECT_NE(test, ssr_test_read(dev, sector, 1, buf), BLK_STS_OK);
+}
+
+static void ssr_test_cmp_replay(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	sector_t sector = SSR_CHUNK_SECTORS;
+	char *old, *newer, *buf, *rec;
+	int slot;
+
+	old = kunit_kmalloc(test, SSR_CHUNK_BYTES, GFP_KERNEL);
+	newer = kunit_kmalloc(test, SSR_CHUNK_BYTES, GFP_KERNEL);
+	buf = kunit_kmalloc(test, SSR_CHUNK_BYTES, GFP_KERNEL);
+	rec = kunit_kzalloc(test, KERNEL_SECTOR_SIZE + SSR_CHUNK_BYTES, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, old);
+	KUNIT_ASSERT_NOT_NULL(test, newer);
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	KUNIT_ASSERT_NOT_NULL(test, rec);
+
+	/* compressible, and incompressible so it is stored raw */
+	memset(old, 0x5a, SSR_CHUNK_BYTES);
+	get_random_bytes(newer, SSR_CHUNK_BYTES);
+
+	KUNIT_ASSERT_EQ(test, ssr_cmap_init(dev, true), 0);
+	KUNIT_ASSERT_EQ(test, ssr_jrnl_init(dev), 0);
+	KUNIT_ASSERT_EQ(test, ssr_test_write(dev, sector, SSR_CHUNK_SECTORS, old), BLK_STS_OK);
+	KUNIT_EXPECT_LT(test, le32_to_cpu(dev->cmap[1].len), SSR_CHUNK_BYTES);
+	KUNIT_EXPECT_EQ(test, dev->jrnl_busy, 0UL);
+
+	/* a crash after the journal write and half of the in-place copies */
+	((struct ssr_jrec *)rec)->sector = cpu_to_le64(sector);
+	((struct ssr_jrec *)rec)->cmp_len = cpu_to_le32(SSR_CHUNK_BYTES);
+	memcpy(rec + KERNEL_SECTOR_SIZE, newer, SSR_CHUNK_BYTES);
+	KUNIT_ASSERT_EQ(test, ssr_jrnl_write(dev, rec, SSR_CHUNK_SECTORS, &slot), 0);
+	KUNIT_ASSERT_EQ(test, ssr_member_io(&dev->members[0], REQ_OP_WRITE, sector, newer,
+					    SSR_CHUNK_BYTES), 0);
+
+	/* the reload puts the new payload on both members and maps it */
+	vfree(dev->cmap);
+	KUNIT_ASSERT_EQ(test, ssr_cmap_init(dev, false), 0);
+	KUNIT_ASSERT_EQ(test, ssr_jrnl_init(dev), 0);
+	KUNIT_EXPECT_EQ(test, le32_to_cpu(dev->cmap[1].len), SSR_CHUNK_BYTES);
+	KUNIT_EXPECT_EQ(test, ssr_test_read(dev, sector, SSR_CHUNK_SECTORS, buf), BLK_STS_OK);
+	KUNIT_EXPECT_EQ(test, memcmp(buf, newer, SSR_CHUNK_BYTES), 0);
+	KUNIT_EXPECT_TRUE(test, ssr_test_member_copy(test, 1, sector, SSR_CHUNK_SECTORS, newer));
+}
+
+/* the shipper is left out: the test checks what the log holds */
+static void ssr_test_rlog_worker(struct work_struct *work)
+{
+}
+
+static void ssr_test_rlog(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	struct workqueue_struct *wq = ssr_wq;
+	size_t len = SSR_RLOG_SECTORS * KERNEL_SECTOR_SIZE;
+	int i;
+
+	if (!wq)
+		ssr_wq = alloc_workqueue("ssr_test", 0, 0);
+	KUNIT_ASSERT_NOT_NULL(test, ssr_wq);
+
+	dev->replica.name = "replica";
+	dev->rlog = vzalloc(len);
+	KUNIT_ASSERT_NOT_NULL(test, dev->rlog);
+	mutex_init(&dev->rlog_mutex);
+	init_waitqueue_head(&dev->rlog_wait);
+	INIT_DELAYED_WORK(&dev->rlog_work, ssr_test_rlog_worker);
+	dev->rlog_cursor = LOGICAL_DISK_SECTORS;
+
+	/* three writes logged, the first one shipped */
+	for (i = 0; i < 3; i++) {
+		ssr_rlog_reserve(dev, 8);
+		ssr_rlog_append(dev, 64 * i, 8);
+	}
+	KUNIT_EXPECT_EQ(test, dev->rlog_head, 3);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->rlog_lag), 24);
+	dev->rlog_shipped = 1;
+	cancel_delayed_work_sync(&dev->rlog_work);
+
+	/* a reload ships the other two again, from the log on the members */
+	memset(dev->rlog, 0, len);
+	KUNIT_ASSERT_EQ(test, ssr_member_io(&dev->members[1], REQ_OP_READ,
+					    SSR_RLOG_FIRST_SECTOR, dev->rlog, len), 0);
+	atomic64_set(&dev->rlog_lag, 0);
+	ssr_rlog_scan(dev);
+	KUNIT_EXPECT_EQ(test, dev->rlog_head, 3);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&dev->rlog_lag), 16);
+	KUNIT_EXPECT_EQ(test, le32_to_cpu(dev->rlog[3].sector), 128);
+	KUNIT_EXPECT_EQ(test, dev->rlog_cursor, LOGICAL_DISK_SECTORS);
+
+	/* an entry lost in between cannot be accounted for: full copy */
+	dev->rlog[2].seq = 0;
+	atomic64_set(&dev->rlog_lag, 0);
+	ssr_rlog_scan(dev);
+	KUNIT_EXPECT_EQ(test, dev->rlog_head, 1);
+	KUNIT_EXPECT_EQ(test, dev->rlog_cursor, 0);
+
+	vfree(dev->rlog);
+	dev->rlog = NULL;
+	if (!wq) {
+		destroy_workqueue(ssr_wq);
+		ssr_wq = NULL;
+	}
+}
+
+/**
+ * ssr_test_user_buf - Maps user memory for the ioctl tests
+ * @test: Test case, unmaps it on exit
+ * @len: Length in bytes
+ */
+static void __user *ssr_test_user_buf(struct kunit *test, size_t len)
+{
+	unsigned long addr = kunit_vm_mmap(test, NULL, 0, len, PROT_READ | PROT_WRITE,
+					   MAP_ANONYMOUS | MAP_PRIVATE, 0);
+
+	KUNIT_ASSERT_FALSE(test, IS_ERR_VALUE(addr));
+
+	return (void __user *)addr;
+}
+
+static void ssr_test_cbt(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	void __user *ubuf = ssr_test_user_buf(test, PAGE_SIZE);
+	struct ssr_cbt_info info = { .bitmap = (u64)(uintptr_t)ubuf + sizeof(info) };
+	struct ssr_cbt *cbt = &dev->cbt;
+	unsigned long region;
+	u64 generation;
+	u32 *words;
+
+	KUNIT_ASSERT_EQ(test, ssr_cbt_init(cbt), 0);
+	KUNIT_ASSERT_LE(test, sizeof(info) + BITS_TO_U32(cbt->nr_bits) * sizeof(u32),
+			PAGE_SIZE);
+	words = kunit_kcalloc(test, BITS_TO_U32(cbt->nr_bits), sizeof(u32), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, words);
+	region = 1UL << cbt->shift;
+	info.nr_bits = cbt->nr_bits;
+
+	/* no epoch closed yet */
+	ssr_cbt_mark(cbt, 0, 1);
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &info, sizeof(info)), 0);
+	KUNIT_EXPECT_EQ(test, ssr_cbt_get(cbt, ubuf), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&info, ubuf, sizeof(info)), 0);
+	KUNIT_EXPECT_EQ(test, info.epoch, 0);
+	generation = info.generation;
+
+	/* epoch 1 holds the write straddling regions 2 and 3 */
+	ssr_cbt_mark(cbt, 3 * region - 1, 2);
+	ssr_cbt_rotate(cbt);
+	ssr_cbt_mark(cbt, 5 * region, 1);
+	KUNIT_EXPECT_EQ(test, ssr_cbt_get(cbt, ubuf), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&info, ubuf, sizeof(info)), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(words, ubuf + sizeof(info),
+					     BITS_TO_U32(cbt->nr_bits) * sizeof(u32)), 0);
+	KUNIT_EXPECT_EQ(test, info.epoch, 1);
+	KUNIT_EXPECT_EQ(test, info.generation, generation);
+	KUNIT_EXPECT_EQ(test, info.granularity, cbt_granularity * 1024);
+	KUNIT_EXPECT_EQ(test, words[0], 0xd);
+
+	/* a reload starts another generation */
+	ssr_cbt_free(cbt);
+	KUNIT_ASSERT_EQ(test, ssr_cbt_init(cbt), 0);
+	KUNIT_EXPECT_NE(test, cbt->generation, generation);
+	KUNIT_EXPECT_EQ(test, cbt->epoch, 1);
+	ssr_cbt_free(cbt);
+}
+
+static void ssr_test_csum_get(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	void __user *ubuf = ssr_test_user_buf(test, PAGE_SIZE);
+	size_t len = 8 * KERNEL_SECTOR_SIZE;
+	struct ssr_csum_info info = {
+		.sector = 0,
+		.nr_sectors = 24,
+		.crcs = (u64)(uintptr_t)ubuf + sizeof(info),
+	};
+	__le32 crcs[24];
+	struct ssr_range range;
+	char *data;
+	int i;
+
+	data = kunit_kmalloc(test, len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, data);
+	get_random_bytes(data, len);
+
+	/* written ahead of the initializer, which has not started */
+	KUNIT_ASSERT_EQ(test, ssr_sb_init(dev, 0, true), 0);
+	ssr_range_lock(dev, &range, 8, 8);
+	KUNIT_ASSERT_EQ(test, ssr_init_ahead(dev, 8, 8), BLK_STS_OK);
+	KUNIT_ASSERT_EQ(test, ssr_rw(dev, 8, 8, data, true, 0), BLK_STS_OK);
+	ssr_range_unlock(dev, &range);
+
+	KUNIT_ASSERT_EQ(test, copy_to_user(ubuf, &info, sizeof(info)), 0);
+	KUNIT_ASSERT_EQ(test, ssr_csum_get(dev, ubuf), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(&info, ubuf, sizeof(info)), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(crcs, ubuf + sizeof(info), sizeof(crcs)), 0);
+
+	KUNIT_EXPECT_EQ(test, info.mismatches, 0);
+	KUNIT_EXPECT_EQ(test, info.digest, crc32(0, crcs, sizeof(crcs)));
+	for (i = 0; i < 24; i++)
+		KUNIT_EXPECT_EQ_MSG(test, le32_to_cpu(crcs[i]),
+				    i >= 8 && i < 16 ?
+				    crc32(0, data + (i - 8) * KERNEL_SECTOR_SIZE, KERNEL_SECTOR_SIZE) :
+				    ssr_zero_crc, "sector %d", i);
+}
+
+/**
+ * ssr_test_bench_report - Reports the result of a microbenchmark
+ * @priv: Test case
+ * @name: Name of the benchmark
+ * @ns: Average cost of one operation in ns
+ */
+static void ssr_test_bench_report(void *priv, const char *name, u64 ns)
+{
+	kunit_info((struct kunit *)priv, "%s %llu\n", name, ns);
+}
+
+static void ssr_test_bench(struct kunit *test)
+{
+	struct logical_block_dev *dev = test->priv;
+	size_t len = PAGE_SIZE;
+	char *buf = kunit_kmalloc(test, len, GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+
+	/* written data, so the read benchmark does not take the zero fast path */
+	get_random_bytes(buf, len);
+	KUNIT_ASSERT_EQ(test, ssr_test_write(dev, 0, len / KERNEL_SECTOR_SIZE, buf),
+			BLK_STS_OK);
+
+	KUNIT_EXPECT_EQ(test, ssr_bench_run(dev, ssr_test_bench_report, test), 0);
+}
+
+static struct kunit_case ssr_test_cases[] = {
+	KUNIT_CASE(ssr_test_crc_layout),
+	KUNIT_CASE(ssr_test_core_sums),
+	KUNIT_CASE(ssr_test_core_verify),
+	KUNIT_CASE(ssr_test_copy_bio),
+	KUNIT_CASE(ssr_test_rw_bio),
+	KUNIT_CASE(ssr_test_unwritten),
+	KUNIT_CASE(ssr_test_repair),
+	KUNIT_CASE(ssr_test_double_corruption),
+	KUNIT_CASE(ssr_test_overlapping_writes),
+	KUNIT_CASE(ssr_test_atomic_failed_write),
+	KUNIT_CASE(ssr_test_init_reload),
+	KUNIT_CASE(ssr_test_csum_get),
+	KUNIT_CASE(ssr_test_cbt),
+	KUNIT_CASE(ssr_test_cmp_replay),
+	KUNIT_CASE(ssr_test_rlog),
+	KUNIT_CASE_SLOW(ssr_test_bench),
+	{}
+};
+
+static struct kunit_suite ssr_test_suite = {
+	.name = "ssr",
+	.init = ssr_test_init,
+	.exit = ssr_test_exit,
+	.test_cases = ssr_test_cases,
+};
+
+kunit_test_suite(ssr_test_suite);
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0+
+
+/*
+ * Simple Software Raid - example read policy
+ *
+ * Reads go to the member with the shortest expected wait (average latency
+ * times queued requests), a faulty member only when both are. Sectors below
+ * PINNED_SECTORS, e.g. the range of one tenant, are always read from member
+ * 0. Repairs are put off while the member to repair is busy.
+ */
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+#ifndef PINNED_SECTORS
+#define PINNED_SECTORS	0
+#endif
+
+/* repairs wait while the member to repair has more requests queued */
+#define REPAIR_MAX_INFLIGHT	8
+
+char LICENSE[] SEC("license") = "GPL";
+
+SEC("struct_ops/select_read")
+int BPF_PROG(select_read, const struct ssr_policy_ctx *ctx)
+{
+	__u64 wait0, wait1;
+
+	if (ctx->sector < PINNED_SECTORS)
+		return 0;
+
+	if (ctx->stats[0].faulty != ctx->stats[1].faulty)
+		return ctx->stats[0].faulty ? 1 : 0;
+
+	wait0 = ctx->stats[0].lat_ns * (ctx->stats[0].inflight + 1);
+	wait1 = ctx->stats[1].lat_ns * (ctx->stats[1].inflight + 1);
+
+	return wait0 <= wait1 ? 0 : 1;
+}
+
+SEC("struct_ops/repair")
+int BPF_PROG(repair, const struct ssr_policy_ctx *ctx)
+{
+	__u32 inflight = ctx->member ? ctx->stats[1].inflight : ctx->stats[0].inflight;
+
+	return inflight < REPAIR_MAX_INFLIGHT;
+}
+
+SEC(".struct_ops.link")
+struct ssr_policy_ops ssr_least_wait = {
+	.select_read = (void *)select_read,
+	.repair = (void *)repair,
+};
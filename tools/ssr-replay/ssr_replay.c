@@ -0,0 +1,505 @@
+// SPDX-License-Identifier: GPL-2.0+
+
+/*
+ * Capture and deterministic replay of ssr I/O traces
+ *
+ * "capture" drains <debugfs>/ssr/trace (module loaded with trace_entries)
+ * into a trace file until interrupted. "replay" issues the requests of a
+ * trace file against a block device with io_uring, either with the original
+ * inter-arrival times or as fast as the queue depth allows, and reports the
+ * latency distribution of each operation, so two builds can be compared on
+ * the production access pattern.
+ *
+ * Usage: ssr-replay capture [-t trace] <file>
+ *        ssr-replay replay [-f] [-q depth] <file> <device>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+
+#include <liburing.h>
+
+#include "../../ssr.h"
+
+#define SSR_REPLAY_TRACE	"/sys/kernel/debug/ssr/trace"
+#define SSR_REPLAY_MAGIC	"SSRTRACE"
+#define SSR_REPLAY_VERSION	1
+#define SSR_REPLAY_MAX_DEPTH	256
+#define SSR_REPLAY_MAX_BYTES	(128 * KERNEL_SECTOR_SIZE)
+#define SSR_REPLAY_NR_OPS	4
+
+struct ssr_replay_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;
+};
+
+struct ssr_replay_slot {
+	uint64_t start_ns;
+	unsigned int op;
+	char *buf;
+};
+
+struct ssr_replay_stats {
+	uint64_t *lat;
+	size_t nr;
+	uint64_t errors;
+};
+
+static const char * const ssr_replay_op_names[SSR_REPLAY_NR_OPS] = {
+	[SSR_TRACE_READ] = "read",
+	[SSR_TRACE_WRITE] = "write",
+	[SSR_TRACE_WRITE_ZEROES] = "write-zeroes",
+	[SSR_TRACE_FLUSH] = "flush",
+};
+
+static volatile sig_atomic_t ssr_replay_stop;
+
+static uint64_t ssr_replay_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void ssr_replay_signal(int sig)
+{
+	ssr_replay_stop = 1;
+}
+
+/**
+ * ssr_replay_capture - Drains the trace ring into a trace file
+ * @trace: debugfs trace file
+ * @path: Output trace file
+ *
+ * The ring is polled every millisecond until SIGINT or SIGTERM.
+ */
+static int ssr_replay_capture(const char *trace, const char *path)
+{
+	struct ssr_replay_header hdr = {
+		.magic = SSR_REPLAY_MAGIC,
+		.version = SSR_REPLAY_VERSION,
+		.rec_size = sizeof(struct ssr_trace_rec),
+	};
+	static struct ssr_trace_rec recs[4096];
+	uint64_t total = 0, last_seq = 0, gaps = 0;
+	FILE *out;
+	int fd;
+
+	fd = open(trace, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "ssr-replay: %s: %s\n", trace, strerror(errno));
+		return -1;
+	}
+
+	out = fopen(path, "w");
+	if (!out || fwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+		fprintf(stderr, "ssr-replay: %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	while (!ssr_replay_stop) {
+		ssize_t n = read(fd, recs, sizeof(recs));
+		size_t i, nr;
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "ssr-replay: %s: %s\n", trace, strerror(errno));
+			break;
+		}
+
+		if (!n) {
+			usleep(1000);
+			continue;
+		}
+
+		nr = n / sizeof(recs[0]);
+		for (i = 0; i < nr; i++) {
+			if (last_seq && recs[i].seq != last_seq + 1)
+				gaps += recs[i].seq - last_seq - 1;
+			last_seq = recs[i].seq;
+		}
+
+		if (fwrite(recs, sizeof(recs[0]), nr, out) != nr) {
+			fprintf(stderr, "ssr-replay: %s: %s\n", path, strerror(errno));
+			break;
+		}
+		total += nr;
+	}
+
+	fclose(out);
+	close(fd);
+
+	fprintf(stderr, "ssr-replay: captured %llu requests, %llu dropped\n",
+		(unsigned long long)total, (unsigned long long)gaps);
+
+	return 0;
+}
+
+/**
+ * ssr_replay_load - Reads a trace file
+ * @path: Trace file
+ * @nr: Output, number of records
+ *
+ * Returns the records, or NULL on failure.
+ */
+static struct ssr_trace_rec *ssr_replay_load(const char *path, size_t *nr)
+{
+	struct ssr_replay_header hdr;
+	struct ssr_trace_rec *recs = NULL;
+	size_t cap = 0;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (!in) {
+		fprintf(stderr, "ssr-replay: %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr.magic, SSR_REPLAY_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.version != SSR_REPLAY_VERSION || hdr.rec_size != sizeof(*recs)) {
+		fprintf(stderr, "ssr-replay: %s: not an ssr trace\n", path);
+		fclose(in);
+		return NULL;
+	}
+
+	*nr = 0;
+	for (;;) {
+		if (*nr == cap) {
+			struct ssr_trace_rec *grown;
+
+			cap = cap ? cap * 2 : 65536;
+			grown = realloc(recs, cap * sizeof(*recs));
+			if (!grown) {
+				free(recs);
+				fclose(in);
+				return NULL;
+			}
+			recs = grown;
+		}
+
+		if (fread(&recs[*nr], sizeof(*recs), 1, in) != 1)
+			break;
+		(*nr)++;
+	}
+
+	fclose(in);
+
+	return recs;
+}
+
+/**
+ * ssr_replay_prep - Prepares the SQE of one trace record
+ * @sqe: Submission queue entry
+ * @fd: Target device
+ * @rec: Trace record
+ * @slot: Slot holding the buffer of the request
+ */
+static void ssr_replay_prep(struct io_uring_sqe *sqe, int fd, const struct ssr_trace_rec *rec,
+			    struct ssr_replay_slot *slot)
+{
+	off_t off = rec->sector * KERNEL_SECTOR_SIZE;
+	unsigned int len = rec->nr_sectors * KERNEL_SECTOR_SIZE;
+
+	switch (rec->op) {
+	case SSR_TRACE_READ:
+		io_uring_prep_read(sqe, fd, slot->buf, len, off);
+		break;
+	case SSR_TRACE_WRITE:
+		io_uring_prep_write(sqe, fd, slot->buf, len, off);
+		if (rec->flags & SSR_TRACE_FUA)
+			sqe->rw_flags = RWF_DSYNC;
+		break;
+	case SSR_TRACE_WRITE_ZEROES:
+		io_uring_prep_fallocate(sqe, fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+					off, len);
+		break;
+	default:
+		io_uring_prep_fsync(sqe, fd, 0);
+	}
+}
+
+static int ssr_replay_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * ssr_replay_report - Prints the latency distribution of each operation
+ * @stats: Per-operation latencies
+ * @elapsed_ns: Wall time of the replay
+ */
+static void ssr_replay_report(struct ssr_replay_stats *stats, uint64_t elapsed_ns)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9 };
+	unsigned int op, i;
+
+	printf("%-13s %9s %9s %9s %9s %9s %9s %9s %7s\n", "op", "count", "mean_us",
+	       "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us", "errors");
+
+	for (op = 0; op < SSR_REPLAY_NR_OPS; op++) {
+		struct ssr_replay_stats *s = &stats[op];
+		double sum = 0;
+		size_t j;
+
+		if (!s->nr && !s->errors)
+			continue;
+
+		qsort(s->lat, s->nr, sizeof(*s->lat), ssr_replay_cmp);
+		for (j = 0; j < s->nr; j++)
+			sum += s->lat[j];
+
+		printf("%-13s %9zu %9.1f", ssr_replay_op_names[op], s->nr,
+		       s->nr ? sum / s->nr / 1000 : 0);
+		for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+			printf(" %9.1f", s->nr ?
+			       s->lat[(size_t)(pcts[i] / 100 * (s->nr - 1))] / 1000.0 : 0);
+		printf(" %9.1f %7llu\n", s->nr ? s->lat[s->nr - 1] / 1000.0 : 0,
+		       (unsigned long long)s->errors);
+	}
+
+	printf("elapsed %.3f s\n", elapsed_ns / 1e9);
+}
+
+/**
+ * ssr_replay_reap - Completes one request
+ * @ring: io_uring
+ * @slots: Request slots
+ * @stats: Per-operation latencies
+ * @idle: Stack of idle slots
+ * @nr_idle: Number of idle slots
+ * @wait: Whether to wait for a completion
+ *
+ * Returns 1 if a request completed, 0 if none did, or a negative error code.
+ */
+static int ssr_replay_reap(struct io_uring *ring, struct ssr_replay_slot *slots,
+			   struct ssr_replay_stats *stats, unsigned int *idle,
+			   unsigned int *nr_idle, bool wait)
+{
+	struct io_uring_cqe *cqe;
+	struct ssr_replay_slot *slot;
+	unsigned int idx;
+	int ret;
+
+	ret = wait ? io_uring_wait_cqe(ring, &cqe) : io_uring_peek_cqe(ring, &cqe);
+	if (ret == -EAGAIN)
+		return 0;
+	if (ret < 0)
+		return ret;
+
+	idx = (unsigned int)io_uring_cqe_get_data64(cqe);
+	slot = &slots[idx];
+
+	if (cqe->res < 0)
+		stats[slot->op].errors++;
+	else
+		stats[slot->op].lat[stats[slot->op].nr++] = ssr_replay_now() - slot->start_ns;
+
+	io_uring_cqe_seen(ring, cqe);
+	idle[(*nr_idle)++] = idx;
+
+	return 1;
+}
+
+/**
+ * ssr_replay_run - Replays a trace against a block device
+ * @recs: Trace records
+ * @nr: Number of records
+ * @dev: Target block device
+ * @depth: Maximum number of requests in flight
+ * @fast: Ignore the recorded timing and keep the queue full
+ */
+static int ssr_replay_run(struct ssr_trace_rec *recs, size_t nr, const char *dev,
+			  unsigned int depth, bool fast)
+{
+	static struct ssr_replay_slot slots[SSR_REPLAY_MAX_DEPTH];
+	static unsigned int idle[SSR_REPLAY_MAX_DEPTH];
+	struct ssr_replay_stats stats[SSR_REPLAY_NR_OPS] = { 0 };
+	unsigned int i, nr_idle = depth;
+	uint64_t size = 0, start, t0 = nr ? recs[0].time_ns : 0;
+	unsigned long long skipped = 0;
+	struct io_uring ring;
+	size_t r;
+	int fd, ret;
+
+	fd = open(dev, O_RDWR | O_DIRECT);
+	if (fd < 0 || ioctl(fd, BLKGETSIZE64, &size)) {
+		fprintf(stderr, "ssr-replay: %s: %s\n", dev, strerror(errno));
+		return -1;
+	}
+
+	ret = io_uring_queue_init(depth, &ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "ssr-replay: io_uring: %s\n", strerror(-ret));
+		close(fd);
+		return -1;
+	}
+
+	for (i = 0; i < SSR_REPLAY_NR_OPS; i++) {
+		stats[i].lat = calloc(nr ? nr : 1, sizeof(*stats[i].lat));
+		if (!stats[i].lat)
+			return -1;
+	}
+
+	for (i = 0; i < depth; i++) {
+		if (posix_memalign((void **)&slots[i].buf, 4096, SSR_REPLAY_MAX_BYTES))
+			return -1;
+		memset(slots[i].buf, 0xa5, SSR_REPLAY_MAX_BYTES);
+		idle[i] = i;
+	}
+
+	start = ssr_replay_now();
+
+	for (r = 0; r < nr && !ssr_replay_stop; r++) {
+		struct ssr_trace_rec *rec = &recs[r];
+		struct io_uring_sqe *sqe;
+		struct ssr_replay_slot *slot;
+
+		if (rec->op >= SSR_REPLAY_NR_OPS ||
+		    rec->nr_sectors * KERNEL_SECTOR_SIZE > SSR_REPLAY_MAX_BYTES ||
+		    (rec->sector + rec->nr_sectors) * KERNEL_SECTOR_SIZE > size) {
+			skipped++;
+			continue;
+		}
+
+		if (!fast) {
+			uint64_t due = start + (rec->time_ns - t0);
+
+			/* complete what we can while waiting for the arrival time */
+			for (;;) {
+				uint64_t now = ssr_replay_now();
+
+				if (now >= due)
+					break;
+				if (ssr_replay_reap(&ring, slots, stats, idle, &nr_idle, false) <= 0 &&
+				    due - now > 100000)
+					usleep(50);
+			}
+		}
+
+		while (!nr_idle) {
+			ret = ssr_replay_reap(&ring, slots, stats, idle, &nr_idle, true);
+			if (ret < 0)
+				goto out;
+		}
+
+		slot = &slots[idle[--nr_idle]];
+		slot->op = rec->op;
+
+		sqe = io_uring_get_sqe(&ring);
+		ssr_replay_prep(sqe, fd, rec, slot);
+		io_uring_sqe_set_data64(sqe, slot - slots);
+
+		slot->start_ns = ssr_replay_now();
+		ret = io_uring_submit(&ring);
+		if (ret < 0)
+			goto out;
+	}
+
+	while (nr_idle < depth) {
+		ret = ssr_replay_reap(&ring, slots, stats, idle, &nr_idle, true);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+
+out:
+	if (ret < 0)
+		fprintf(stderr, "ssr-replay: %s\n", strerror(-ret));
+	if (skipped)
+		fprintf(stderr, "ssr-replay: skipped %llu requests outside %s\n", skipped, dev);
+
+	ssr_replay_report(stats, ssr_replay_now() - start);
+
+	for (i = 0; i < SSR_REPLAY_NR_OPS; i++)
+		free(stats[i].lat);
+	for (i = 0; i < depth; i++)
+		free(slots[i].buf);
+	io_uring_queue_exit(&ring);
+	close(fd);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa = { .sa_handler = ssr_replay_signal };
+	const char *trace = SSR_REPLAY_TRACE;
+	unsigned int depth = 32;
+	bool fast = false, capture;
+	struct ssr_trace_rec *recs;
+	size_t nr;
+	int opt, ret;
+
+	if (argc < 2)
+		goto usage;
+
+	if (!strcmp(argv[1], "capture"))
+		capture = true;
+	else if (!strcmp(argv[1], "replay"))
+		capture = false;
+	else
+		goto usage;
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "fq:t:")) != -1) {
+		switch (opt) {
+		case 'f':
+			fast = true;
+			break;
+		case 'q':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (capture) {
+		if (argc - optind != 1)
+			goto usage;
+		return ssr_replay_capture(trace, argv[optind]) ? 1 : 0;
+	}
+
+	if (argc - optind != 2 || !depth || depth > SSR_REPLAY_MAX_DEPTH)
+		goto usage;
+
+	recs = ssr_replay_load(argv[optind], &nr);
+	if (!recs)
+		return 1;
+
+	ret = ssr_replay_run(recs, nr, argv[optind + 1], depth, fast);
+	free(recs);
+
+	return ret ? 1 : 0;
+
+usage:
+	fprintf(stderr, "usage: %s capture [-t trace] <file>\n"
+		"       %s replay [-f] [-q depth] <file> <device>\n", argv[0], argv[0]);
+	return 2;
+}
@@ -0,0 +1,1031 @@
+// SPDX-License-Identifier: GPL-2.0+
+
+/*
+ * Userspace ublk target running the ssr mirror/CRC/repair engine
+ *
+ * Exposes /dev/ublkbN on top of two member files or block devices laid out
+ * exactly like the kernel module's members, so an array can be moved
+ * between the two implementations. The layout math and the verify/repair
+ * decisions come from ssr_core.h; this file only does the I/O. Only the
+ * plain layout is served: arrays in any other layout are refused at start.
+ * Member I/O goes through a second io_uring, so both mirrors of a request
+ * are read or written concurrently.
+ *
+ * Usage: ssr-ublk [-q depth] <member1> <member2>
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <liburing.h>
+#include <linux/blkzoned.h>
+#include <linux/fs.h>
+#include <linux/ublk_cmd.h>
+
+#include "../../ssr_core.h"
+
+#define SSR_UBLK_CTRL_DEV	"/dev/ublk-control"
+#define SSR_UBLK_MAX_DEPTH	128
+
+/* largest batch of member I/O: data and CRCs of every member */
+#define SSR_UBLK_MEMBER_DEPTH	(2 * SSR_NUM_MEMBERS)
+
+struct ssr_array {
+	const char *names[SSR_NUM_MEMBERS];
+	int fds[SSR_NUM_MEMBERS];
+	struct io_uring ring;	/* member I/O */
+	u64 sb_flags;
+	sector_t init_cursor;
+	__u8 init_ahead[DIV_ROUND_UP(SSR_NUM_CHUNKS, 8)];	/* as in the superblock */
+};
+
+/* one member I/O of a batch, see ssr_member_batch() */
+struct ssr_io {
+	int m;
+	int op;		/* IORING_OP_READ, IORING_OP_WRITE or IORING_OP_FSYNC */
+	sector_t sector;
+	void *buf;
+	size_t len;
+	int ret;
+};
+
+struct ssr_ublk {
+	struct ssr_array array;
+	struct ublksrv_ctrl_dev_info info;
+	int ctrl_fd;
+	int cdev_fd;
+	struct io_uring ctrl_ring;
+	struct io_uring ring;
+	struct ublksrv_io_desc *descs;
+	size_t descs_len;
+	char *bufs[SSR_UBLK_MAX_DEPTH];
+};
+
+static volatile sig_atomic_t ssr_ublk_stop;
+
+static u32 crc32_table[256];
+static u32 ssr_zero_crc;
+
+/**
+ * crc32 - Bitwise-reflected CRC32, identical to the kernel's crc32_le()
+ * @seed: Initial value, no pre- or post-inversion is applied
+ * @buf: Data
+ * @len: Length of @buf in bytes
+ */
+u32 crc32(u32 seed, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len--)
+		seed = (seed >> 8) ^ crc32_table[(seed ^ *p++) & 0xff];
+
+	return seed;
+}
+
+/**
+ * ssr_alloc - Allocates a zeroed buffer usable for O_DIRECT member I/O
+ * @len: Length in bytes
+ */
+static void *ssr_alloc(size_t len)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, 4096, round_up(len, (size_t)4096)))
+		return NULL;
+
+	return memset(buf, 0, len);
+}
+
+static void crc32_init(void)
+{
+	static const char zero[KERNEL_SECTOR_SIZE];
+	u32 i, j, c;
+
+	for (i = 0; i < 256; i++) {
+		for (c = i, j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? 0xedb88320 : 0);
+		crc32_table[i] = c;
+	}
+
+	ssr_zero_crc = crc32(0, zero, sizeof(zero));
+}
+
+/**
+ * ssr_member_pio - Synchronous member I/O at a byte offset
+ * @a: Array
+ * @m: Member index
+ * @write: true for writes
+ * @off: Offset on the member in bytes
+ * @buf: Buffer
+ * @len: Length in bytes
+ *
+ * Returns 0 on success or a negative errno.
+ */
+static int ssr_member_pio(struct ssr_array *a, int m, bool write, off_t off, void *buf,
+			  size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write ? pwrite(a->fds[m], buf, len, off) : pread(a->fds[m], buf, len, off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret < 0 ? -errno : -EIO;
+
+		buf = (char *)buf + ret;
+		off += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/**
+ * ssr_member_io - Synchronous member I/O
+ * @a: Array
+ * @m: Member index
+ * @write: true for writes
+ * @sector: First sector on the member
+ * @buf: Buffer
+ * @len: Length in bytes
+ *
+ * Returns 0 on success or a negative errno.
+ */
+static int ssr_member_io(struct ssr_array *a, int m, bool write, sector_t sector,
+			 void *buf, size_t len)
+{
+	return ssr_member_pio(a, m, write, (off_t)sector * KERNEL_SECTOR_SIZE, buf, len);
+}
+
+/**
+ * ssr_member_batch - Runs member I/Os concurrently
+ * @a: Array
+ * @io: I/Os, their ret is set to 0 or a negative errno
+ * @n: Number of I/Os, at most SSR_UBLK_MEMBER_DEPTH
+ *
+ * The I/Os are submitted together on the member ring, so the members work
+ * in parallel; short transfers are completed synchronously.
+ */
+static void ssr_member_batch(struct ssr_array *a, struct ssr_io *io, unsigned int n)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int i, done;
+	int ret;
+
+	if (!n)
+		return;
+
+	for (i = 0; i < n; i++) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&a->ring);
+		off_t off = (off_t)io[i].sector * KERNEL_SECTOR_SIZE;
+		int fd = a->fds[io[i].m];
+
+		if (io[i].op == IORING_OP_READ)
+			io_uring_prep_read(sqe, fd, io[i].buf, io[i].len, off);
+		else if (io[i].op == IORING_OP_WRITE)
+			io_uring_prep_write(sqe, fd, io[i].buf, io[i].len, off);
+		else
+			io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+		io_uring_sqe_set_data64(sqe, i);
+	}
+
+	do
+		ret = io_uring_submit(&a->ring);
+	while (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY);
+
+	/* queued SQEs point at the caller's buffers, they must not stay behind */
+	if (ret < 0) {
+		fprintf(stderr, "ssr_member_batch: submit failed: %s\n", strerror(-ret));
+		abort();
+	}
+
+	for (done = 0; done < n; done++) {
+		do
+			ret = io_uring_wait_cqe(&a->ring, &cqe);
+		while (ret == -EINTR);
+
+		if (ret < 0) {
+			fprintf(stderr, "ssr_member_batch: wait failed: %s\n", strerror(-ret));
+			abort();
+		}
+
+		i = io_uring_cqe_get_data64(cqe);
+		io[i].ret = cqe->res;
+		io_uring_cqe_seen(&a->ring, cqe);
+	}
+
+	for (i = 0; i < n; i++) {
+		size_t res = io[i].ret;
+
+		if (io[i].ret < 0 || io[i].op == IORING_OP_FSYNC)
+			io[i].ret = io[i].ret < 0 ? io[i].ret : 0;
+		else if (!res)
+			io[i].ret = -EIO;
+		else if (res < io[i].len)
+			io[i].ret = ssr_member_pio(a, io[i].m, io[i].op == IORING_OP_WRITE,
+						   (off_t)io[i].sector * KERNEL_SECTOR_SIZE + res,
+						   (char *)io[i].buf + res, io[i].len - res);
+		else
+			io[i].ret = 0;
+	}
+}
+
+/**
+ * ssr_member_each - Runs the same I/O on every member that has not failed yet
+ * @a: Array
+ * @op: IORING_OP_READ, IORING_OP_WRITE or IORING_OP_FSYNC
+ * @sector: First sector on the members
+ * @bufs: Buffer of each member, NULL for IORING_OP_FSYNC
+ * @len: Length in bytes
+ * @err: Error of each member so far, updated
+ */
+static void ssr_member_each(struct ssr_array *a, int op, sector_t sector, void **bufs,
+			    size_t len, int *err)
+{
+	struct ssr_io io[SSR_NUM_MEMBERS];
+	unsigned int i, n = 0;
+	int m;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (!err[m])
+			io[n++] = (struct ssr_io){
+				.m = m, .op = op, .sector = sector,
+				.buf = bufs ? bufs[m] : NULL, .len = len,
+			};
+
+	ssr_member_batch(a, io, n);
+
+	for (i = 0; i < n; i++)
+		err[io[i].m] = io[i].ret;
+}
+
+/**
+ * ssr_write_sectors - Userspace counterpart of the module's ssr_write_sectors()
+ * @a: Array
+ * @sector: First sector of the range
+ * @nr: Number of sectors
+ * @data: Payload, NULL to write zeroes
+ *
+ * Zero ranges are written as data here: portable write-zeroes on files
+ * would need fallocate() support the members may not have.
+ *
+ * Returns 0 if at least one member was written, a negative errno otherwise.
+ */
+static int ssr_write_sectors(struct ssr_array *a, sector_t sector, unsigned int nr,
+			     char *data)
+{
+	size_t crc_len = ssr_crc_window_len(sector, nr);
+	bool partial = !IS_ALIGNED(sector, SSR_CRCS_PER_SECTOR) ||
+		       !IS_ALIGNED(sector + nr, SSR_CRCS_PER_SECTOR);
+	void *bufs[SSR_NUM_MEMBERS], *crcs[SSR_NUM_MEMBERS] = { NULL };
+	int err[SSR_NUM_MEMBERS] = { 0 };
+	u32 sums[SSR_MAX_SECTORS];
+	char *zeroes = NULL;
+	unsigned int i;
+	int m, ret = 0, written = 0;
+
+	if (!data) {
+		zeroes = ssr_alloc(nr * KERNEL_SECTOR_SIZE);
+		if (!zeroes)
+			return -ENOMEM;
+		data = zeroes;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		bufs[m] = data;
+		crcs[m] = ssr_alloc(crc_len);
+		if (!crcs[m]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	ssr_core_sums(data, nr, sums, ssr_zero_crc);
+
+	/* each member keeps its own CRC window, as in the module */
+	if (partial)
+		ssr_member_each(a, IORING_OP_READ, ssr_crc_sector(sector), crcs, crc_len, err);
+	else
+		for (m = 0; m < SSR_NUM_MEMBERS; m++)
+			memset(crcs[m], 0, crc_len);
+
+	ssr_member_each(a, IORING_OP_WRITE, sector, bufs, nr * KERNEL_SECTOR_SIZE, err);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		for (i = 0; i < nr && !err[m]; i++)
+			*ssr_crc_slot(crcs[m], sector, sector + i) = cpu_to_le32(sums[i]);
+
+	ssr_member_each(a, IORING_OP_WRITE, ssr_crc_sector(sector), crcs, crc_len, err);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (err[m]) {
+			fprintf(stderr, "ssr_write_sectors: %s: write of sector %llu failed (%d)\n",
+				a->names[m], (unsigned long long)sector, err[m]);
+			continue;
+		}
+
+		written++;
+	}
+
+	ret = written ? 0 : -EIO;
+out:
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		free(crcs[m]);
+	free(zeroes);
+
+	return ret;
+}
+
+/**
+ * ssr_init_fresh - Tells whether a sector is in a chunk no write has reached yet
+ * @a: Array
+ * @sector: Sector
+ *
+ * Past the initializer's cursor, only the chunks flagged in init_ahead of
+ * the superblock were ever written, see the module's ssr_init_ahead().
+ */
+static bool ssr_init_fresh(struct ssr_array *a, sector_t sector)
+{
+	unsigned long c = sector / SSR_CHUNK_SECTORS;
+
+	return (a->sb_flags & SSR_SB_INITIALIZING) && sector >= a->init_cursor &&
+	       !(a->init_ahead[c / 8] & (1 << (c % 8)));
+}
+
+/**
+ * ssr_read_sectors - Userspace counterpart of the module's ssr_read_sectors()
+ * @a: Array
+ * @sector: First sector of the range
+ * @nr: Number of sectors
+ * @out: Buffer receiving the verified payload
+ *
+ * Returns 0 on success or a negative errno.
+ */
+static int ssr_read_sectors(struct ssr_array *a, sector_t sector, unsigned int nr, char *out)
+{
+	size_t len = nr * KERNEL_SECTOR_SIZE;
+	size_t crc_len = ssr_crc_window_len(sector, nr);
+	char *data[SSR_NUM_MEMBERS] = { NULL };
+	__le32 *crcs[SSR_NUM_MEMBERS] = { NULL };
+	bool valid[SSR_NUM_MEMBERS] = { false }, dirty[SSR_NUM_MEMBERS] = { false };
+	struct ssr_io io[SSR_UBLK_MEMBER_DEPTH];
+	int m, primary = -1, ret = 0;
+	unsigned int i, n = 0;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		data[m] = ssr_alloc(len);
+		crcs[m] = ssr_alloc(crc_len);
+		if (!data[m] || !crcs[m]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		io[n++] = (struct ssr_io){
+			.m = m, .op = IORING_OP_READ, .sector = sector,
+			.buf = data[m], .len = len,
+		};
+		io[n++] = (struct ssr_io){
+			.m = m, .op = IORING_OP_READ, .sector = ssr_crc_sector(sector),
+			.buf = crcs[m], .len = crc_len,
+		};
+	}
+
+	ssr_member_batch(a, io, n);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		valid[m] = !io[2 * m].ret && !io[2 * m + 1].ret;
+		if (valid[m] && primary < 0)
+			primary = m;
+	}
+
+	if (primary < 0) {
+		ret = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (ssr_init_fresh(a, sector + i)) {
+			memset(data[primary] + i * KERNEL_SECTOR_SIZE, 0, KERNEL_SECTOR_SIZE);
+			continue;
+		}
+
+		if (ssr_core_verify_sector(data, crcs, valid, sector, sector + i, dirty) >= 0)
+			continue;
+
+		fprintf(stderr, "ssr_read_sectors: sector %llu is corrupted on all members\n",
+			(unsigned long long)(sector + i));
+		ret = -EIO;
+	}
+
+	n = 0;
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (!dirty[m])
+			continue;
+
+		fprintf(stderr, "ssr_read_sectors: %s: repairing sectors %llu-%llu\n",
+			a->names[m], (unsigned long long)sector,
+			(unsigned long long)(sector + nr - 1));
+		io[n++] = (struct ssr_io){
+			.m = m, .op = IORING_OP_WRITE, .sector = sector,
+			.buf = data[m], .len = len,
+		};
+		io[n++] = (struct ssr_io){
+			.m = m, .op = IORING_OP_WRITE, .sector = ssr_crc_sector(sector),
+			.buf = crcs[m], .len = crc_len,
+		};
+	}
+
+	ssr_member_batch(a, io, n);
+
+	for (i = 0; i < n; i += 2)
+		if (io[i].ret || io[i + 1].ret)
+			fprintf(stderr, "ssr_read_sectors: %s: repair failed\n",
+				a->names[io[i].m]);
+
+	if (!ret)
+		memcpy(out, data[primary], len);
+
+out:
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		free(data[m]);
+		free(crcs[m]);
+	}
+
+	return ret;
+}
+
+/**
+ * ssr_sb_valid - Checks a superblock read from a member
+ * @buf: Sector holding the superblock, its crc field is cleared
+ */
+static bool ssr_sb_valid(char *buf)
+{
+	struct ssr_superblock *sb = (struct ssr_superblock *)buf;
+	u32 crc;
+
+	if (le32_to_cpu(sb->magic) != SSR_SB_MAGIC)
+		return false;
+
+	crc = le32_to_cpu(sb->crc);
+	sb->crc = 0;
+
+	return crc32(0, buf, KERNEL_SECTOR_SIZE) == crc;
+}
+
+/**
+ * ssr_sb_write - Writes the superblock of an initializing array to both members
+ * @a: Array
+ *
+ * Returns 0 if at least one member was updated, a negative errno otherwise.
+ */
+static int ssr_sb_write(struct ssr_array *a)
+{
+	struct ssr_superblock *sb = ssr_alloc(KERNEL_SECTOR_SIZE);
+	int err[SSR_NUM_MEMBERS] = { 0 };
+	void *bufs[SSR_NUM_MEMBERS];
+	int m, ret = -EIO;
+
+	if (!sb)
+		return -ENOMEM;
+
+	sb->magic = cpu_to_le32(SSR_SB_MAGIC);
+	sb->version = cpu_to_le32(SSR_SB_VERSION);
+	sb->flags = cpu_to_le64(a->sb_flags);
+	sb->init_cursor = cpu_to_le64(a->init_cursor);
+	memcpy(sb->init_ahead, a->init_ahead, sizeof(sb->init_ahead));
+	sb->crc = cpu_to_le32(crc32(0, sb, KERNEL_SECTOR_SIZE));
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		bufs[m] = sb;
+
+	ssr_member_each(a, IORING_OP_WRITE, SSR_SB_SECTOR, bufs, KERNEL_SECTOR_SIZE, err);
+	ssr_member_each(a, IORING_OP_FSYNC, 0, NULL, 0, err);
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++)
+		if (!err[m])
+			ret = 0;
+
+	free(sb);
+
+	return ret;
+}
+
+/**
+ * ssr_init_ahead - Userspace counterpart of the module's ssr_init_ahead()
+ * @a: Array
+ * @sector: First sector of the write
+ * @nr: Number of sectors of the write
+ *
+ * No initializer runs here, so every chunk past the cursor is either fresh
+ * or flagged: a fresh one is zeroed, made stable, flagged and the
+ * superblock written before the write goes in.
+ *
+ * Returns 0 on success or a negative errno.
+ */
+static int ssr_init_ahead(struct ssr_array *a, sector_t sector, unsigned int nr)
+{
+	int err[SSR_NUM_MEMBERS] = { 0 };
+	sector_t start;
+	unsigned long c;
+	int ret;
+
+	for (start = round_down(sector, SSR_CHUNK_SECTORS); start < sector + nr;
+	     start += SSR_CHUNK_SECTORS) {
+		if (!ssr_init_fresh(a, start))
+			continue;
+
+		ret = ssr_write_sectors(a, start, SSR_CHUNK_SECTORS, NULL);
+		if (ret)
+			return ret;
+		ssr_member_each(a, IORING_OP_FSYNC, 0, NULL, 0, err);
+
+		c = start / SSR_CHUNK_SECTORS;
+		a->init_ahead[c / 8] |= 1 << (c % 8);
+		ret = ssr_sb_write(a);
+		if (ret) {
+			a->init_ahead[c / 8] &= ~(1 << (c % 8));
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * ssr_jrnl_pending - Checks a member's atomic write journal for a record to replay
+ * @a: Array
+ * @m: Member index
+ * @buf: Buffer of SSR_JRNL_SLOT_SECTORS sectors
+ *
+ * Validates each slot the way the module's replay does.
+ *
+ * Returns the first slot holding a record, or -1 if there is none.
+ */
+static int ssr_jrnl_pending(struct ssr_array *a, int m, char *buf)
+{
+	struct ssr_jrec *rec = (struct ssr_jrec *)buf;
+	unsigned int slot, nr;
+	u32 crc;
+
+	for (slot = 0; slot < SSR_JRNL_SLOTS; slot++) {
+		sector_t at = SSR_JRNL_FIRST_SECTOR + slot * SSR_JRNL_SLOT_SECTORS;
+
+		if (ssr_member_io(a, m, false, at, buf, KERNEL_SECTOR_SIZE) ||
+		    le32_to_cpu(rec->magic) != SSR_JRNL_MAGIC)
+			continue;
+
+		crc = le32_to_cpu(rec->crc);
+		rec->crc = 0;
+		nr = le32_to_cpu(rec->nr);
+		if (crc32(0, buf, KERNEL_SECTOR_SIZE) != crc || !nr || nr > SSR_MAX_SECTORS ||
+		    le64_to_cpu(rec->sector) + nr > LOGICAL_DISK_SECTORS)
+			continue;
+
+		if (ssr_member_io(a, m, false, at + 1, buf + KERNEL_SECTOR_SIZE,
+				  nr * KERNEL_SECTOR_SIZE) ||
+		    crc32(0, buf + KERNEL_SECTOR_SIZE, nr * KERNEL_SECTOR_SIZE) !=
+		    le32_to_cpu(rec->data_crc))
+			continue;
+
+		return slot;
+	}
+
+	return -1;
+}
+
+/**
+ * ssr_array_check - Refuses arrays in a layout this target does not implement
+ * @a: Array with the members open and the superblock loaded
+ * @buf: Buffer of SSR_JRNL_SLOT_SECTORS sectors
+ *
+ * Compressed, tiered and log-structured arrays and arrays with their
+ * metadata on a meta_dev are refused, going by the superblock's layout
+ * bits, and so are zoned members and members too small to hold the
+ * metadata. So are journals holding an interrupted atomic write: only the
+ * module replays them.
+ *
+ * Returns 0 if the array can be served, a negative errno otherwise.
+ */
+static int ssr_array_check(struct ssr_array *a, char *buf)
+{
+	static const struct {
+		u64 flag;
+		const char *what;
+	} layouts[] = {
+		{ SSR_SB_COMPRESSED,	"compressed" },
+		{ SSR_SB_META_DEV,	"keeps its metadata on a meta_dev" },
+		{ SSR_SB_TIERED,	"tiered over a fast member pair" },
+		{ SSR_SB_LOG,		"log-structured" },
+	};
+	struct ssr_superblock *sb = (struct ssr_superblock *)buf;
+	struct stat st;
+	unsigned int i;
+	u64 size;
+	u32 zone;
+	int m, slot;
+
+	for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+		if (!(a->sb_flags & layouts[i].flag))
+			continue;
+
+		fprintf(stderr, "ssr-ublk: the array is %s, only the module serves it\n",
+			layouts[i].what);
+		return -EOPNOTSUPP;
+	}
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (fstat(a->fds[m], &st)) {
+			perror(a->names[m]);
+			return -errno;
+		}
+
+		size = st.st_size;
+		if (S_ISBLK(st.st_mode)) {
+			if (ioctl(a->fds[m], BLKGETSIZE64, &size)) {
+				perror(a->names[m]);
+				return -errno;
+			}
+
+			if (!ioctl(a->fds[m], BLKGETZONESZ, &zone) && zone) {
+				fprintf(stderr, "ssr-ublk: %s: zoned members are log-structured, only the module serves them\n",
+					a->names[m]);
+				return -EOPNOTSUPP;
+			}
+		}
+
+		if (size < (u64)SSR_META_END * KERNEL_SECTOR_SIZE) {
+			fprintf(stderr, "ssr-ublk: %s: too small to hold the metadata, is it on a meta_dev?\n",
+				a->names[m]);
+			return -EOPNOTSUPP;
+		}
+
+		if (!ssr_member_io(a, m, false, ssr_sb_log_sector(size / KERNEL_SECTOR_SIZE),
+				   buf, KERNEL_SECTOR_SIZE) &&
+		    ssr_sb_valid(buf) && (le64_to_cpu(sb->flags) & SSR_SB_LOG)) {
+			fprintf(stderr, "ssr-ublk: %s: the array is log-structured, only the module serves it\n",
+				a->names[m]);
+			return -EOPNOTSUPP;
+		}
+
+		slot = ssr_jrnl_pending(a, m, buf);
+		if (slot >= 0) {
+			fprintf(stderr, "ssr-ublk: %s: journal slot %d holds an interrupted atomic write, load the module once to replay it\n",
+				a->names[m], slot);
+			return -EOPNOTSUPP;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * ssr_array_open - Opens the members and loads the superblock
+ * @a: Array with names filled in
+ *
+ * Returns 0 on success or a negative errno.
+ */
+static int ssr_array_open(struct ssr_array *a)
+{
+	struct ssr_superblock *sb;
+	char *buf;
+	int m, ret;
+
+	a->sb_flags = 0;
+	a->init_cursor = LOGICAL_DISK_SECTORS;
+
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		a->fds[m] = open(a->names[m], O_RDWR | O_DIRECT);
+		if (a->fds[m] < 0)
+			a->fds[m] = open(a->names[m], O_RDWR);
+		if (a->fds[m] < 0) {
+			perror(a->names[m]);
+			return -errno;
+		}
+	}
+
+	ret = io_uring_queue_init(SSR_UBLK_MEMBER_DEPTH, &a->ring, 0);
+	if (ret < 0) {
+		fprintf(stderr, "ssr-ublk: member ring: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	buf = ssr_alloc(SSR_JRNL_SLOT_SECTORS * KERNEL_SECTOR_SIZE);
+	if (!buf)
+		return -ENOMEM;
+
+	sb = (struct ssr_superblock *)buf;
+	for (m = 0; m < SSR_NUM_MEMBERS; m++) {
+		if (ssr_member_io(a, m, false, SSR_SB_SECTOR, buf, KERNEL_SECTOR_SIZE) ||
+		    !ssr_sb_valid(buf))
+			continue;
+
+		a->sb_flags = le64_to_cpu(sb->flags);
+		if (a->sb_flags & SSR_SB_INITIALIZING) {
+			a->init_cursor = le64_to_cpu(sb->init_cursor);
+			memcpy(a->init_ahead, sb->init_ahead, sizeof(a->init_ahead));
+		}
+		break;
+	}
+
+	ret = ssr_array_check(a, buf);
+	free(buf);
+
+	return ret;
+}
+
+/**
+ * ssr_ublk_handle - Serves one ublk request
+ * @u: Target
+ * @tag: Request tag
+ *
+ * Returns the result to commit: bytes transferred or a negative errno.
+ */
+static int ssr_ublk_handle(struct ssr_ublk *u, unsigned int tag)
+{
+	const struct ublksrv_io_desc *iod = &u->descs[tag];
+	sector_t sector = iod->start_sector;
+	unsigned int nr = iod->nr_sectors;
+	char *buf = u->bufs[tag];
+	int err[SSR_NUM_MEMBERS] = { 0 };
+	int ret = 0, m;
+
+	if (sector + nr > LOGICAL_DISK_SECTORS)
+		return -EIO;
+
+	switch (ublksrv_get_op(iod)) {
+	case UBLK_IO_OP_READ:
+		ret = ssr_read_sectors(&u->array, sector, nr, buf);
+		break;
+	case UBLK_IO_OP_WRITE:
+		ret = ssr_init_ahead(&u->array, sector, nr);
+		if (!ret)
+			ret = ssr_write_sectors(&u->array, sector, nr, buf);
+		break;
+	case UBLK_IO_OP_WRITE_ZEROES:
+		ret = ssr_init_ahead(&u->array, sector, nr);
+		if (!ret)
+			ret = ssr_write_sectors(&u->array, sector, nr, NULL);
+		break;
+	case UBLK_IO_OP_FLUSH:
+		ssr_member_each(&u->array, IORING_OP_FSYNC, 0, NULL, 0, err);
+		for (m = 0; m < SSR_NUM_MEMBERS; m++)
+			if (!err[m])
+				return 0;
+		return -EIO;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return ret ? ret : (int)(nr * KERNEL_SECTOR_SIZE);
+}
+
+/**
+ * ssr_ublk_ctrl - Issues a control command on /dev/ublk-control
+ * @u: Target
+ * @op: UBLK_CMD_*
+ * @addr: Address of the command buffer
+ * @len: Length of the command buffer
+ * @data: Inline command data
+ *
+ * Returns the command result.
+ */
+static int ssr_ublk_ctrl(struct ssr_ublk *u, unsigned int op, void *addr, unsigned int len,
+			 __u64 data)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ctrl_ring);
+	struct ublksrv_ctrl_cmd *cmd = (struct ublksrv_ctrl_cmd *)sqe->cmd;
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	memset(sqe, 0, 2 * sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = u->ctrl_fd;
+	sqe->cmd_op = op;
+	cmd->dev_id = u->info.dev_id;
+	cmd->queue_id = (__u16)-1;
+	cmd->addr = (__u64)(uintptr_t)addr;
+	cmd->len = len;
+	cmd->data[0] = data;
+
+	ret = io_uring_submit_and_wait(&u->ctrl_ring, 1);
+	if (ret < 0)
+		return ret;
+
+	ret = io_uring_wait_cqe(&u->ctrl_ring, &cqe);
+	if (ret < 0)
+		return ret;
+
+	ret = cqe->res;
+	io_uring_cqe_seen(&u->ctrl_ring, cqe);
+
+	return ret;
+}
+
+/**
+ * ssr_ublk_queue_io - Queues a FETCH or COMMIT_AND_FETCH command for a tag
+ * @u: Target
+ * @op: UBLK_IO_FETCH_REQ or UBLK_IO_COMMIT_AND_FETCH_REQ
+ * @tag: Request tag
+ * @result: Result of the request being committed
+ */
+static void ssr_ublk_queue_io(struct ssr_ublk *u, unsigned int op, unsigned int tag,
+			      int result)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+	struct ublksrv_io_cmd *cmd = (struct ublksrv_io_cmd *)sqe->cmd;
+
+	memset(sqe, 0, 2 * sizeof(*sqe));
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = u->cdev_fd;
+	sqe->cmd_op = op;
+	sqe->user_data = tag;
+	cmd->q_id = 0;
+	cmd->tag = tag;
+	cmd->result = result;
+	cmd->addr = (__u64)(uintptr_t)u->bufs[tag];
+}
+
+/**
+ * ssr_ublk_setup - Adds and configures the ublk device
+ * @u: Target with array opened
+ * @depth: Queue depth
+ *
+ * Returns 0 on success or a negative errno.
+ */
+static int ssr_ublk_setup(struct ssr_ublk *u, unsigned int depth)
+{
+	struct ublk_params params = { 0 };
+	char path[64];
+	unsigned int tag;
+	int ret;
+
+	ret = io_uring_queue_init(4, &u->ctrl_ring, IORING_SETUP_SQE128);
+	if (ret < 0)
+		return ret;
+
+	u->ctrl_fd = open(SSR_UBLK_CTRL_DEV, O_RDWR);
+	if (u->ctrl_fd < 0)
+		return -errno;
+
+	u->info.nr_hw_queues = 1;
+	u->info.queue_depth = depth;
+	u->info.max_io_buf_bytes = SSR_MAX_SECTORS * KERNEL_SECTOR_SIZE;
+	u->info.dev_id = -1;
+	u->info.ublksrv_pid = getpid();
+
+	ret = ssr_ublk_ctrl(u, UBLK_CMD_ADD_DEV, &u->info, sizeof(u->info), 0);
+	if (ret < 0)
+		return ret;
+
+	params.len = sizeof(params);
+	params.types = UBLK_PARAM_TYPE_BASIC;
+	params.basic.attrs = UBLK_ATTR_VOLATILE_CACHE;
+	params.basic.logical_bs_shift = 9;
+	params.basic.physical_bs_shift = 9;
+	params.basic.io_min_shift = 9;
+	params.basic.io_opt_shift = 9;
+	params.basic.max_sectors = SSR_MAX_SECTORS;
+	params.basic.chunk_sectors = SSR_CHUNK_SECTORS;
+	params.basic.dev_sectors = LOGICAL_DISK_SECTORS;
+
+	ret = ssr_ublk_ctrl(u, UBLK_CMD_SET_PARAMS, &params, sizeof(params), 0);
+	if (ret < 0)
+		return ret;
+
+	snprintf(path, sizeof(path), "/dev/ublkc%u", u->info.dev_id);
+	u->cdev_fd = open(path, O_RDWR);
+	if (u->cdev_fd < 0)
+		return -errno;
+
+	u->descs_len = round_up(depth * sizeof(struct ublksrv_io_desc),
+				(size_t)sysconf(_SC_PAGESIZE));
+	u->descs = mmap(NULL, u->descs_len, PROT_READ, MAP_SHARED | MAP_POPULATE,
+			u->cdev_fd, UBLKSRV_CMD_BUF_OFFSET);
+	if (u->descs == MAP_FAILED)
+		return -errno;
+
+	ret = io_uring_queue_init(depth, &u->ring, IORING_SETUP_SQE128);
+	if (ret < 0)
+		return ret;
+
+	for (tag = 0; tag < depth; tag++) {
+		u->bufs[tag] = ssr_alloc(SSR_MAX_SECTORS * KERNEL_SECTOR_SIZE);
+		if (!u->bufs[tag])
+			return -ENOMEM;
+		ssr_ublk_queue_io(u, UBLK_IO_FETCH_REQ, tag, 0);
+	}
+
+	ret = io_uring_submit(&u->ring);
+	if (ret < 0)
+		return ret;
+
+	return ssr_ublk_ctrl(u, UBLK_CMD_START_DEV, NULL, 0, getpid());
+}
+
+/**
+ * ssr_ublk_run - Serves requests until the device is stopped
+ * @u: Started target
+ *
+ * Returns 0 when the device went away or a stop signal arrived, a negative
+ * errno on failure.
+ */
+static int ssr_ublk_run(struct ssr_ublk *u)
+{
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	for (;;) {
+		ret = io_uring_submit_and_wait(&u->ring, 1);
+		if (ssr_ublk_stop)
+			return 0;
+		if (ret < 0 && ret != -EINTR)
+			return ret;
+
+		while (!io_uring_peek_cqe(&u->ring, &cqe)) {
+			unsigned int tag = cqe->user_data;
+			int res = cqe->res;
+
+			io_uring_cqe_seen(&u->ring, cqe);
+
+			if (res == UBLK_IO_RES_ABORT)
+				return 0;
+			if (res != UBLK_IO_RES_OK)
+				return res;
+
+			ssr_ublk_queue_io(u, UBLK_IO_COMMIT_AND_FETCH_REQ, tag,
+					  ssr_ublk_handle(u, tag));
+		}
+	}
+}
+
+static void ssr_ublk_signal(int sig)
+{
+	ssr_ublk_stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct sigaction sa = { .sa_handler = ssr_ublk_signal };
+	static struct ssr_ublk u;
+	unsigned int depth = 64;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "q:")) != -1) {
+		switch (opt) {
+		case 'q':
+			depth = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			goto usage;
+		}
+	}
+
+	if (argc - optind != SSR_NUM_MEMBERS || !depth || depth > SSR_UBLK_MAX_DEPTH)
+		goto usage;
+
+	crc32_init();
+
+	u.array.names[0] = argv[optind];
+	u.array.names[1] = argv[optind + 1];
+
+	ret = ssr_array_open(&u.array);
+	if (ret < 0)
+		return 1;
+
+	ret = ssr_ublk_setup(&u, depth);
+	if (ret < 0) {
+		fprintf(stderr, "ssr-ublk: setup failed: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	printf("ssr-ublk: serving /dev/ublkb%u\n", u.info.dev_id);
+	fflush(stdout);
+
+	ret = ssr_ublk_run(&u);
+
+	ssr_ublk_ctrl(&u, UBLK_CMD_STOP_DEV, NULL, 0, 0);
+	ssr_ublk_ctrl(&u, UBLK_CMD_DEL_DEV, NULL, 0, 0);
+
+	if (ret < 0) {
+		fprintf(stderr, "ssr-ublk: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-q depth] <member1> <member2>\n", argv[0]);
+	return 2;
+}